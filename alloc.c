@@ -0,0 +1,170 @@
+// 使用 mmap 的 MAP_ANONYMOUS 需要引入 BSD/SVID 扩展
+#define _DEFAULT_SOURCE
+
+#include "rvcc.h"
+
+#include <sys/mman.h>
+
+//
+// 内存池（bump-pointer arena）
+//
+// 每一类对象各自拥有一个内存池，内存池向系统申请大块的匿名映射，
+// 然后在块内通过移动指针的方式分配对象，整个编译过程只进行少量的映射，
+// 编译结束后一次性释放。
+//
+
+// 第一个内存块的大小
+#define CHUNK_MIN_SIZE (1 << 20)
+// 内存块大小增长的上限
+#define CHUNK_MAX_SIZE (64 << 20)
+// 分配的对齐量
+#define ARENA_ALIGN 8
+
+// 内存块，块头存放在映射区域的开头
+typedef struct Chunk Chunk;
+struct Chunk
+{
+    Chunk *next; // 上一个（更早映射的）内存块
+    size_t Cap;  // 内存块的总大小（包含块头）
+    size_t Used; // 已使用的大小（包含块头）
+};
+
+// 内存池
+typedef struct
+{
+    Chunk *Chunks;  // 内存块链表，表头为当前正在使用的块
+    size_t Bytes;   // 累计分配的字节数
+    size_t Objects; // 累计分配的对象数
+    size_t Mapped;  // 当前映射的字节数
+} Arena;
+
+static _Thread_local Arena Arenas[AK_COUNT];
+
+// 各类内存池的名称，用于输出统计信息
+static char *ArenaNames[] = {
+    [AK_TOKEN] = "token",
+    [AK_NODE] = "node",
+    [AK_TYPE] = "type",
+    [AK_OBJ] = "obj",
+    [AK_SCOPE] = "scope",
+    [AK_LOCAL] = "local",
+    [AK_STR] = "string",
+    [AK_MACRO] = "macro",
+    [AK_HEADER] = "header",
+    [AK_PERM] = "perm",
+};
+
+// 映射一个新的内存块，匿名映射的内存已经被清零
+static Chunk *newChunk(size_t Size)
+{
+    void *P = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (P == MAP_FAILED)
+    {
+        error("out of memory: %s", strerror(errno));
+    }
+
+    Chunk *C = P;
+    C->Cap = Size;
+    C->Used = alignTo(sizeof(Chunk), ARENA_ALIGN);
+    return C;
+}
+
+// 从内存池中分配 Size 字节并清零
+void *arenaAlloc(ArenaKind Kind, size_t Size)
+{
+    Arena *A = &Arenas[Kind];
+    Size = (Size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+    Chunk *C = A->Chunks;
+    if (!C || C->Used + Size > C->Cap)
+    {
+        // 新的块大小翻倍增长，直到达到上限，超大的对象单独映射
+        size_t Cap = C ? C->Cap * 2 : CHUNK_MIN_SIZE;
+        if (Cap > CHUNK_MAX_SIZE)
+        {
+            Cap = CHUNK_MAX_SIZE;
+        }
+        size_t Need = alignTo(sizeof(Chunk), ARENA_ALIGN) + Size;
+        if (Cap < Need)
+        {
+            Cap = Need;
+        }
+
+        C = newChunk(Cap);
+        C->next = A->Chunks;
+        A->Chunks = C;
+        A->Mapped += Cap;
+    }
+
+    void *P = (char *)C + C->Used;
+    C->Used += Size;
+    A->Bytes += Size;
+    A->Objects++;
+    return P;
+}
+
+// 在内存池中复制字符串的前 N 个字符
+char *arenaStrndup(ArenaKind Kind, char *S, size_t N)
+{
+    char *Buf = arenaAlloc(Kind, N + 1);
+    memcpy(Buf, S, N);
+    return Buf;
+}
+
+// 释放内存池的所有块，保留第一个块并清零以便重复使用
+void arenaReset(ArenaKind Kind)
+{
+    Arena *A = &Arenas[Kind];
+    Chunk *C = A->Chunks;
+    if (!C)
+    {
+        return;
+    }
+
+    // 最早映射的块位于链表末尾
+    while (C->next)
+    {
+        Chunk *Next = C->next;
+        A->Mapped -= C->Cap;
+        munmap(C, C->Cap);
+        C = Next;
+    }
+
+    size_t Head = alignTo(sizeof(Chunk), ARENA_ALIGN);
+    memset((char *)C + Head, 0, C->Used - Head);
+    C->Used = Head;
+    A->Chunks = C;
+}
+
+// 一次性释放所有内存池
+void arenaFreeAll(void)
+{
+    for (int I = 0; I < AK_COUNT; I++)
+    {
+        Arena *A = &Arenas[I];
+        while (A->Chunks)
+        {
+            Chunk *Next = A->Chunks->next;
+            munmap(A->Chunks, A->Chunks->Cap);
+            A->Chunks = Next;
+        }
+        A->Mapped = 0;
+    }
+}
+
+// 输出各类内存池的分配统计信息
+void arenaPrintStats(FILE *Out)
+{
+    size_t Objects = 0, Bytes = 0, Mapped = 0;
+
+    fprintf(Out, "%-8s %12s %14s %14s\n", "kind", "objects", "bytes", "mapped");
+    for (int I = 0; I < AK_COUNT; I++)
+    {
+        Arena *A = &Arenas[I];
+        fprintf(Out, "%-8s %12zu %14zu %14zu\n", ArenaNames[I], A->Objects, A->Bytes, A->Mapped);
+        Objects += A->Objects;
+        Bytes += A->Bytes;
+        Mapped += A->Mapped;
+    }
+    fprintf(Out, "%-8s %12zu %14zu %14zu\n", "total", Objects, Bytes, Mapped);
+}
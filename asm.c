@@ -0,0 +1,1176 @@
+#include "rvcc.h"
+
+#include <elf.h>
+
+//
+// 汇编器
+//
+// 代码生成输出的汇编代码直接在进程内编码为 RV64 指令，写出 ELF64 可重定位文件。
+// 只支持代码生成用到的指令、伪指令和伪操作，一行一条。
+// 不需要输出汇编代码的文本时，代码生成直接调用 asmInsn 等函数编码，不再经过文本。
+//
+// 文本段按函数编码：函数内的指令先暂存起来，遇到下一个函数的标签或函数结束时，
+// 确定函数内标签的位置并回填分支。beqz 的跳转范围只有 ±4KiB，
+// 超出时改写为 bnez 跳过其后的一条 j，与汇编器的分支松弛相同。
+//
+
+// 寄存器名
+static char *RegNames[] = {
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+    "fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+
+// 指令的格式
+typedef enum
+{
+    IF_R,     // rd, rs1, rs2
+    IF_I,     // rd, rs1, imm
+    IF_SHIFT, // rd, rs1, shamt
+    IF_LOAD,  // rd, imm(rs1)
+    IF_STORE, // rs2, imm(rs1)
+    IF_LI,    // rd, imm
+    IF_LA,    // rd, symbol
+    IF_MV,    // rd, rs
+    IF_NEG,   // rd, rs
+    IF_SEQZ,  // rd, rs
+    IF_SNEZ,  // rd, rs
+    IF_BEQZ,  // rs, label
+    IF_J,     // label
+    IF_CALL,  // symbol
+    IF_RET,   //
+} InsnFormat;
+
+// 指令的编码信息
+typedef struct
+{
+    char *Name;
+    InsnFormat Fmt;
+    int Opcode;
+    int Funct3;
+    int Funct7;
+} InsnInfo;
+
+// 按 AsmInsn 排列，代码生成直接编码时按编号查找
+static InsnInfo InsnTable[] = {
+    [AI_ADD] = {"add", IF_R, 0x33, 0, 0x00},
+    [AI_SUB] = {"sub", IF_R, 0x33, 0, 0x20},
+    [AI_MUL] = {"mul", IF_R, 0x33, 0, 0x01},
+    [AI_DIV] = {"div", IF_R, 0x33, 4, 0x01},
+    [AI_SLT] = {"slt", IF_R, 0x33, 2, 0x00},
+    [AI_SLTU] = {"sltu", IF_R, 0x33, 3, 0x00},
+    [AI_XOR] = {"xor", IF_R, 0x33, 4, 0x00},
+    [AI_ADDW] = {"addw", IF_R, 0x3b, 0, 0x00},
+    [AI_SUBW] = {"subw", IF_R, 0x3b, 0, 0x20},
+    [AI_MULW] = {"mulw", IF_R, 0x3b, 0, 0x01},
+    [AI_DIVW] = {"divw", IF_R, 0x3b, 4, 0x01},
+    [AI_ADDI] = {"addi", IF_I, 0x13, 0},
+    [AI_SLTIU] = {"sltiu", IF_I, 0x13, 3},
+    [AI_XORI] = {"xori", IF_I, 0x13, 4},
+    [AI_ADDIW] = {"addiw", IF_I, 0x1b, 0},
+    [AI_SLLI] = {"slli", IF_SHIFT, 0x13, 1, 0x00},
+    [AI_SRAI] = {"srai", IF_SHIFT, 0x13, 5, 0x20},
+    [AI_LB] = {"lb", IF_LOAD, 0x03, 0},
+    [AI_LH] = {"lh", IF_LOAD, 0x03, 1},
+    [AI_LW] = {"lw", IF_LOAD, 0x03, 2},
+    [AI_LD] = {"ld", IF_LOAD, 0x03, 3},
+    [AI_SB] = {"sb", IF_STORE, 0x23, 0},
+    [AI_SH] = {"sh", IF_STORE, 0x23, 1},
+    [AI_SW] = {"sw", IF_STORE, 0x23, 2},
+    [AI_SD] = {"sd", IF_STORE, 0x23, 3},
+    [AI_LI] = {"li", IF_LI},
+    [AI_LA] = {"la", IF_LA},
+    [AI_MV] = {"mv", IF_MV},
+    [AI_NEG] = {"neg", IF_NEG, 0x33},
+    [AI_NEGW] = {"negw", IF_NEG, 0x3b},
+    [AI_SEQZ] = {"seqz", IF_SEQZ},
+    [AI_SNEZ] = {"snez", IF_SNEZ},
+    [AI_BEQZ] = {"beqz", IF_BEQZ},
+    [AI_J] = {"j", IF_J},
+    [AI_CALL] = {"call", IF_CALL},
+    [AI_RET] = {"ret", IF_RET},
+};
+_Static_assert(sizeof(InsnTable) / sizeof(*InsnTable) == AI_COUNT, "InsnTable does not match AsmInsn");
+
+// 助记符到编码信息的映射
+static _Thread_local HashMap InsnMap;
+
+// 节
+enum
+{
+    SEC_UNDEF,
+    SEC_TEXT,
+    SEC_DATA,
+};
+
+// 符号
+typedef struct
+{
+    char *Name;     // 驻留的名称
+    int Sec;        // 所在的节，SEC_UNDEF 表示未定义
+    uint64_t Value; // 在节内的偏移量
+    bool Global;    // 是否由 .globl 声明为全局符号
+    bool Used;      // 是否被重定位引用
+    int Index;      // 在符号表中的下标
+} Symbol;
+
+// 文本段的重定位
+typedef struct
+{
+    uint64_t Offset;
+    Symbol *Sym;
+    int Type;
+} Reloc;
+
+// 函数内暂存的指令的种类
+typedef enum
+{
+    IK_WORD,  // 已经编码的指令
+    IK_LABEL, // 函数内标签的定义
+    IK_BEQZ,  // 跳转到函数内标签的 beqz
+    IK_J,     // 跳转到函数内标签的 j
+    IK_CALL,  // 调用符号，auipc + jalr
+    IK_LA,    // 加载符号的地址，auipc + addi
+} ItemKind;
+
+// 函数内暂存的指令
+typedef struct
+{
+    uint8_t Kind;
+    uint8_t Reg;  // beqz 的源寄存器，la 的目标寄存器
+    bool Long;    // beqz 是否超出了跳转范围
+    uint32_t Word;
+    union
+    {
+        int Label;   // 函数内标签的编号
+        Symbol *Sym; // 引用的符号
+    };
+} Item;
+
+// 节的内容
+typedef struct
+{
+    char *Buf;
+    size_t Len;
+    size_t Cap;
+} Section;
+
+static _Thread_local Section Text;
+static _Thread_local Section Data;
+// 当前所在的节
+static _Thread_local int CurSec = SEC_TEXT;
+
+// 所有的符号，名称到符号的映射
+static _Thread_local HashMap SymMap;
+static _Thread_local Symbol **Syms;
+static _Thread_local int SymCnt;
+static _Thread_local int SymCap;
+
+static _Thread_local Reloc *Relocs;
+static _Thread_local int RelocCnt;
+static _Thread_local int RelocCap;
+
+// 正在编码的函数
+static _Thread_local Item *Items;
+static _Thread_local int ItemCnt;
+static _Thread_local int ItemCap;
+// 函数内标签的名称到编号 +1 的映射，名称的副本在函数结束时释放
+static _Thread_local HashMap LabelMap;
+static _Thread_local char **LabelNames;
+static _Thread_local int *LabelItems; // 定义标签的暂存指令的下标，未定义时为 -1
+static _Thread_local int LabelCnt;
+static _Thread_local int LabelCap;
+// 每条暂存的指令在函数内的偏移量
+static _Thread_local uint32_t *ItemOffs;
+static _Thread_local int ItemOffCap;
+
+// la 所用的 %pcrel_hi 标签的编号
+static _Thread_local int PcrelCnt;
+
+// 在节的末尾追加 Len 个字节，Src 为 NULL 时填充零
+static void secAppend(Section *S, void *Src, size_t Len)
+{
+    if (S->Len + Len > S->Cap)
+    {
+        while (S->Len + Len > S->Cap)
+        {
+            S->Cap = S->Cap ? S->Cap * 2 : 4096;
+        }
+        S->Buf = realloc(S->Buf, S->Cap);
+    }
+    if (Src)
+    {
+        memcpy(S->Buf + S->Len, Src, Len);
+    }
+    else
+    {
+        memset(S->Buf + S->Len, 0, Len);
+    }
+    S->Len += Len;
+}
+
+static void emitWord(uint32_t W)
+{
+    secAppend(&Text, &W, 4);
+}
+
+// 获取名称对应的符号，不存在时创建一个未定义的符号
+static Symbol *getSymbol(char *Name, int Len)
+{
+    Name = intern(Name, Len);
+    Symbol *Sym = hashmapGetPtr(&SymMap, Name);
+    if (Sym)
+    {
+        return Sym;
+    }
+
+    Sym = calloc(1, sizeof(Symbol));
+    Sym->Name = Name;
+    hashmapPutPtr(&SymMap, Name, Sym);
+    if (SymCnt == SymCap)
+    {
+        SymCap = SymCap ? SymCap * 2 : 256;
+        Syms = realloc(Syms, sizeof(Symbol *) * SymCap);
+    }
+    Syms[SymCnt++] = Sym;
+    return Sym;
+}
+
+// 在节内的偏移量 Value 处定义符号
+static void defineSymbol(Symbol *Sym, int Sec, uint64_t Value)
+{
+    if (Sym->Sec)
+    {
+        error("symbol redefined: %s", Sym->Name);
+    }
+    Sym->Sec = Sec;
+    Sym->Value = Value;
+}
+
+static void addReloc(uint64_t Offset, Symbol *Sym, int Type)
+{
+    if (RelocCnt == RelocCap)
+    {
+        RelocCap = RelocCap ? RelocCap * 2 : 256;
+        Relocs = realloc(Relocs, sizeof(Reloc) * RelocCap);
+    }
+    Sym->Used = true;
+    Relocs[RelocCnt++] = (Reloc){Offset, Sym, Type};
+}
+
+//
+// 指令编码
+//
+
+static uint32_t rType(int Op, int F3, int F7, int Rd, int Rs1, int Rs2)
+{
+    return F7 << 25 | Rs2 << 20 | Rs1 << 15 | F3 << 12 | Rd << 7 | Op;
+}
+
+static uint32_t iType(int Op, int F3, int Rd, int Rs1, int Imm)
+{
+    return (uint32_t)(Imm & 0xfff) << 20 | Rs1 << 15 | F3 << 12 | Rd << 7 | Op;
+}
+
+static uint32_t sType(int Op, int F3, int Rs1, int Rs2, int Imm)
+{
+    return (uint32_t)(Imm >> 5 & 0x7f) << 25 | Rs2 << 20 | Rs1 << 15 | F3 << 12 |
+           (Imm & 0x1f) << 7 | Op;
+}
+
+static uint32_t bType(int F3, int Rs1, int Rs2, int Imm)
+{
+    return (uint32_t)(Imm >> 12 & 1) << 31 | (Imm >> 5 & 0x3f) << 25 | Rs2 << 20 |
+           Rs1 << 15 | F3 << 12 | (Imm >> 1 & 0xf) << 8 | (Imm >> 11 & 1) << 7 | 0x63;
+}
+
+static uint32_t jType(int Rd, int Imm)
+{
+    return (uint32_t)(Imm >> 20 & 1) << 31 | (Imm >> 1 & 0x3ff) << 21 |
+           (Imm >> 11 & 1) << 20 | (Imm >> 12 & 0xff) << 12 | Rd << 7 | 0x6f;
+}
+
+static uint32_t uType(int Op, int Rd, int Imm)
+{
+    return (uint32_t)(Imm & 0xfffff) << 12 | Rd << 7 | Op;
+}
+
+// 判断 Val 是否为 Bits 位的有符号数
+static bool fitsSigned(int64_t Val, int Bits)
+{
+    return -(1LL << (Bits - 1)) <= Val && Val < (1LL << (Bits - 1));
+}
+
+// 低 12 位的符号扩展
+static int64_t signExtend12(int64_t Val)
+{
+    return (int64_t)((uint64_t)Val << 52) >> 52;
+}
+
+//
+// 函数的暂存与回填
+//
+
+static Item *newItem(ItemKind Kind)
+{
+    if (ItemCnt == ItemCap)
+    {
+        ItemCap = ItemCap ? ItemCap * 2 : 1024;
+        Items = realloc(Items, sizeof(Item) * ItemCap);
+    }
+    Item *It = &Items[ItemCnt++];
+    *It = (Item){.Kind = Kind};
+    return It;
+}
+
+// 暂存一条已经编码的指令
+static void addWord(uint32_t W)
+{
+    newItem(IK_WORD)->Word = W;
+}
+
+// 将 64 位的立即数加载到寄存器中，与汇编器展开 li 的方式相同
+static void emitLi(int Rd, int64_t Val)
+{
+    if (fitsSigned(Val, 32))
+    {
+        int Hi20 = ((Val + 0x800) >> 12) & 0xfffff;
+        int Lo12 = signExtend12(Val);
+        if (Hi20)
+        {
+            addWord(uType(0x37, Rd, Hi20)); // lui
+        }
+        if (Lo12 || !Hi20)
+        {
+            // 高位非零时用 addiw 使结果为 32 位的符号扩展
+            addWord(iType(Hi20 ? 0x1b : 0x13, 0, Rd, Hi20 ? Rd : 0, Lo12));
+        }
+        return;
+    }
+
+    // 先加载去掉低 12 位并右移后的值，再左移并加上低 12 位
+    int64_t Lo12 = signExtend12(Val);
+    uint64_t Hi52 = ((uint64_t)Val + 0x800) >> 12;
+    int Shift = 12 + __builtin_ctzll(Hi52);
+    emitLi(Rd, (int64_t)((Hi52 >> (Shift - 12)) << Shift) >> Shift);
+    addWord(iType(0x13, 1, Rd, Rd, Shift)); // slli
+    if (Lo12)
+    {
+        addWord(iType(0x13, 0, Rd, Rd, Lo12)); // addi
+    }
+}
+
+// 获取函数内标签的编号
+static int getLabel(char *Name, int Len)
+{
+    int Idx = (intptr_t)hashmapGet2(&LabelMap, Name, Len) - 1;
+    if (Idx >= 0)
+    {
+        return Idx;
+    }
+
+    if (LabelCnt == LabelCap)
+    {
+        LabelCap = LabelCap ? LabelCap * 2 : 64;
+        LabelNames = realloc(LabelNames, sizeof(char *) * LabelCap);
+        LabelItems = realloc(LabelItems, sizeof(int) * LabelCap);
+    }
+    Idx = LabelCnt++;
+    LabelNames[Idx] = strndup(Name, Len);
+    LabelItems[Idx] = -1;
+    hashmapPut2(&LabelMap, LabelNames[Idx], Len, (void *)(intptr_t)(Idx + 1));
+    return Idx;
+}
+
+// 暂存的指令的大小
+static int itemSize(Item *It)
+{
+    switch (It->Kind)
+    {
+    case IK_LABEL:
+        return 0;
+    case IK_BEQZ:
+        return It->Long ? 8 : 4;
+    case IK_CALL:
+    case IK_LA:
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+// 计算每条暂存的指令的偏移量，返回函数的大小
+static uint32_t layoutItems(void)
+{
+    uint32_t Off = 0;
+    for (int I = 0; I < ItemCnt; I++)
+    {
+        ItemOffs[I] = Off;
+        Off += itemSize(&Items[I]);
+    }
+    ItemOffs[ItemCnt] = Off;
+    return Off;
+}
+
+// 函数内标签的偏移量
+static uint32_t labelOffset(int Label)
+{
+    if (LabelItems[Label] < 0)
+    {
+        error("undefined label: %s", LabelNames[Label]);
+    }
+    return ItemOffs[LabelItems[Label]];
+}
+
+// 结束正在编码的函数：确定标签的位置，编码跳转指令，写入文本段
+static void finishFunction(void)
+{
+    if (ItemCnt == 0)
+    {
+        return;
+    }
+
+    if (ItemCnt + 1 > ItemOffCap)
+    {
+        ItemOffCap = ItemCnt + 1;
+        ItemOffs = realloc(ItemOffs, sizeof(uint32_t) * ItemOffCap);
+    }
+
+    // beqz 改写后函数变长，其他 beqz 也可能随之超出范围，直到不再变化
+    for (bool Changed = true; Changed;)
+    {
+        Changed = false;
+        layoutItems();
+        for (int I = 0; I < ItemCnt; I++)
+        {
+            Item *It = &Items[I];
+            if (It->Kind == IK_BEQZ && !It->Long &&
+                !fitsSigned((int64_t)labelOffset(It->Label) - ItemOffs[I], 13))
+            {
+                It->Long = true;
+                Changed = true;
+            }
+        }
+    }
+
+    uint64_t Base = Text.Len;
+    for (int I = 0; I < ItemCnt; I++)
+    {
+        Item *It = &Items[I];
+        uint64_t Off = Base + ItemOffs[I];
+        switch (It->Kind)
+        {
+        case IK_WORD:
+            emitWord(It->Word);
+            break;
+        case IK_LABEL:
+            break;
+        case IK_BEQZ:
+        {
+            int64_t Disp = (int64_t)labelOffset(It->Label) - ItemOffs[I];
+            if (!It->Long)
+            {
+                emitWord(bType(0, It->Reg, 0, Disp));
+                break;
+            }
+            // bnez rs, 8 跳过其后的 j
+            emitWord(bType(1, It->Reg, 0, 8));
+            Disp -= 4;
+            if (!fitsSigned(Disp, 21))
+            {
+                error("branch out of range: %s", LabelNames[It->Label]);
+            }
+            emitWord(jType(0, Disp));
+            break;
+        }
+        case IK_J:
+        {
+            int64_t Disp = (int64_t)labelOffset(It->Label) - ItemOffs[I];
+            if (!fitsSigned(Disp, 21))
+            {
+                error("jump out of range: %s", LabelNames[It->Label]);
+            }
+            emitWord(jType(0, Disp));
+            break;
+        }
+        case IK_CALL:
+            addReloc(Off, It->Sym, R_RISCV_CALL_PLT);
+            emitWord(uType(0x17, 1, 0));        // auipc ra, 0
+            emitWord(iType(0x67, 0, 1, 1, 0)); // jalr ra, 0(ra)
+            break;
+        case IK_LA:
+        {
+            // %pcrel_lo 引用的是 auipc 处的局部标签
+            char Name[32];
+            int Len = snprintf(Name, sizeof(Name), ".Lpcrel_hi%d", PcrelCnt++);
+            Symbol *Hi = getSymbol(Name, Len);
+            defineSymbol(Hi, SEC_TEXT, Off);
+            addReloc(Off, It->Sym, R_RISCV_PCREL_HI20);
+            addReloc(Off + 4, Hi, R_RISCV_PCREL_LO12_I);
+            emitWord(uType(0x17, It->Reg, 0));              // auipc rd, 0
+            emitWord(iType(0x13, 0, It->Reg, It->Reg, 0)); // addi rd, rd, 0
+            break;
+        }
+        }
+    }
+
+    ItemCnt = 0;
+    for (int I = 0; I < LabelCnt; I++)
+    {
+        free(LabelNames[I]);
+    }
+    LabelCnt = 0;
+    hashmapFree(&LabelMap);
+}
+
+//
+// 解析汇编代码
+//
+
+// 汇编代码中的一个字段
+typedef struct
+{
+    char *Str;
+    int Len;
+} Field;
+
+// 去掉字段两端的空白
+static Field trim(char *P, char *End)
+{
+    while (P < End && *P == ' ')
+    {
+        P++;
+    }
+    while (End > P && End[-1] == ' ')
+    {
+        End--;
+    }
+    return (Field){P, End - P};
+}
+
+static bool fieldEqual(Field F, char *S)
+{
+    return F.Len == strlen(S) && !strncmp(F.Str, S, F.Len);
+}
+
+// 报告无法汇编的行
+static void badLine(Field Line, char *Msg)
+{
+    error("%.*s: %s", Line.Len, Line.Str, Msg);
+}
+
+// 解析寄存器名
+static int parseReg(Field Line, Field F)
+{
+    for (int I = 0; I < sizeof(RegNames) / sizeof(*RegNames); I++)
+    {
+        if (fieldEqual(F, RegNames[I]))
+        {
+            return I;
+        }
+    }
+    if (fieldEqual(F, "s0"))
+    {
+        return 8;
+    }
+    badLine(Line, "invalid register");
+    return 0;
+}
+
+// 解析十进制的立即数
+static int64_t parseImm(Field Line, Field F)
+{
+    char Buf[32];
+    if (F.Len == 0 || F.Len >= sizeof(Buf))
+    {
+        badLine(Line, "invalid immediate");
+    }
+    memcpy(Buf, F.Str, F.Len);
+    Buf[F.Len] = '\0';
+
+    char *End;
+    errno = 0;
+    int64_t Val = strtoll(Buf, &End, 10);
+    if (*End || errno)
+    {
+        badLine(Line, "invalid immediate");
+    }
+    return Val;
+}
+
+// 解析 12 位的有符号立即数
+static int parseImm12(Field Line, Field F)
+{
+    int64_t Val = parseImm(Line, F);
+    if (!fitsSigned(Val, 12))
+    {
+        badLine(Line, "immediate out of range");
+    }
+    return Val;
+}
+
+// 解析 imm(rs1) 形式的内存操作数
+static void parseMem(Field Line, Field F, int *Imm, int *Rs1)
+{
+    char *L = memchr(F.Str, '(', F.Len);
+    if (!L || F.Str[F.Len - 1] != ')')
+    {
+        badLine(Line, "invalid memory operand");
+    }
+    *Imm = parseImm12(Line, trim(F.Str, L));
+    *Rs1 = parseReg(Line, trim(L + 1, F.Str + F.Len - 1));
+}
+
+// 编码一条不引用符号的指令，操作数的顺序与 asmInsn 相同
+static void encodeInsn(InsnInfo *Info, int A, int B, int64_t C)
+{
+    switch (Info->Fmt)
+    {
+    case IF_R:
+        addWord(rType(Info->Opcode, Info->Funct3, Info->Funct7, A, B, C));
+        return;
+    case IF_I:
+    case IF_LOAD:
+        addWord(iType(Info->Opcode, Info->Funct3, A, B, C));
+        return;
+    case IF_SHIFT:
+        addWord(iType(Info->Opcode, Info->Funct3, A, B, Info->Funct7 << 5 | C));
+        return;
+    case IF_STORE:
+        addWord(sType(Info->Opcode, Info->Funct3, B, A, C));
+        return;
+    case IF_LI:
+        emitLi(A, C);
+        return;
+    case IF_MV: // addi rd, rs, 0
+        addWord(iType(0x13, 0, A, B, 0));
+        return;
+    case IF_NEG: // sub[w] rd, zero, rs
+        addWord(rType(Info->Opcode, 0, 0x20, A, 0, B));
+        return;
+    case IF_SEQZ: // sltiu rd, rs, 1
+        addWord(iType(0x13, 3, A, B, 1));
+        return;
+    case IF_SNEZ: // sltu rd, zero, rs
+        addWord(rType(0x33, 3, 0, A, 0, B));
+        return;
+    case IF_RET: // jalr zero, 0(ra)
+        addWord(iType(0x67, 0, 0, 1, 0));
+        return;
+    default:
+        unreachable();
+    }
+}
+
+// 编码一条引用符号或函数内标签的指令
+static void encodeSymInsn(InsnInfo *Info, int Reg, char *Name, int Len)
+{
+    switch (Info->Fmt)
+    {
+    case IF_LA:
+    {
+        Item *It = newItem(IK_LA);
+        It->Reg = Reg;
+        It->Sym = getSymbol(Name, Len);
+        return;
+    }
+    case IF_BEQZ:
+    {
+        Item *It = newItem(IK_BEQZ);
+        It->Reg = Reg;
+        It->Label = getLabel(Name, Len);
+        return;
+    }
+    case IF_J:
+        newItem(IK_J)->Label = getLabel(Name, Len);
+        return;
+    case IF_CALL:
+        newItem(IK_CALL)->Sym = getSymbol(Name, Len);
+        return;
+    default:
+        unreachable();
+    }
+}
+
+// 解析并编码一条指令，Ops 为逗号分隔的操作数
+static void assembleInsn(Field Line, InsnInfo *Info, Field *Ops, int OpCnt)
+{
+    static int NeedOps[] = {
+        [IF_R] = 3, [IF_I] = 3, [IF_SHIFT] = 3, [IF_LOAD] = 2,
+        [IF_STORE] = 2, [IF_LI] = 2, [IF_LA] = 2, [IF_MV] = 2,
+        [IF_NEG] = 2, [IF_SEQZ] = 2, [IF_SNEZ] = 2, [IF_BEQZ] = 2,
+        [IF_J] = 1, [IF_CALL] = 1, [IF_RET] = 0,
+    };
+    if (OpCnt != NeedOps[Info->Fmt])
+    {
+        badLine(Line, "wrong number of operands");
+    }
+
+    switch (Info->Fmt)
+    {
+    case IF_R:
+        encodeInsn(Info, parseReg(Line, Ops[0]), parseReg(Line, Ops[1]), parseReg(Line, Ops[2]));
+        return;
+    case IF_I:
+        encodeInsn(Info, parseReg(Line, Ops[0]), parseReg(Line, Ops[1]), parseImm12(Line, Ops[2]));
+        return;
+    case IF_SHIFT:
+    {
+        int64_t Shamt = parseImm(Line, Ops[2]);
+        if (Shamt < 0 || Shamt > 63)
+        {
+            badLine(Line, "shift amount out of range");
+        }
+        encodeInsn(Info, parseReg(Line, Ops[0]), parseReg(Line, Ops[1]), Shamt);
+        return;
+    }
+    case IF_LOAD:
+    case IF_STORE:
+    {
+        int Imm, Rs1;
+        parseMem(Line, Ops[1], &Imm, &Rs1);
+        encodeInsn(Info, parseReg(Line, Ops[0]), Rs1, Imm);
+        return;
+    }
+    case IF_LI:
+        encodeInsn(Info, parseReg(Line, Ops[0]), 0, parseImm(Line, Ops[1]));
+        return;
+    case IF_MV:
+    case IF_NEG:
+    case IF_SEQZ:
+    case IF_SNEZ:
+        encodeInsn(Info, parseReg(Line, Ops[0]), parseReg(Line, Ops[1]), 0);
+        return;
+    case IF_LA:
+    case IF_BEQZ:
+        encodeSymInsn(Info, parseReg(Line, Ops[0]), Ops[1].Str, Ops[1].Len);
+        return;
+    case IF_J:
+    case IF_CALL:
+        encodeSymInsn(Info, 0, Ops[0].Str, Ops[0].Len);
+        return;
+    case IF_RET:
+        encodeInsn(Info, 0, 0, 0);
+        return;
+    }
+}
+
+// 切换当前的节
+static void switchSection(int Sec)
+{
+    if (CurSec == SEC_TEXT)
+    {
+        finishFunction();
+    }
+    CurSec = Sec;
+}
+
+// 定义标签：文本段中 .L 开头的标签只在函数内可见，其余的标签为符号
+static void defineLabel(Field Name)
+{
+    if (CurSec == SEC_TEXT && Name.Len > 2 && !strncmp(Name.Str, ".L", 2))
+    {
+        int Label = getLabel(Name.Str, Name.Len);
+        if (LabelItems[Label] >= 0)
+        {
+            error("label redefined: %.*s", Name.Len, Name.Str);
+        }
+        LabelItems[Label] = ItemCnt;
+        newItem(IK_LABEL);
+        return;
+    }
+
+    if (CurSec == SEC_TEXT)
+    {
+        // 新的函数开始
+        finishFunction();
+        defineSymbol(getSymbol(Name.Str, Name.Len), SEC_TEXT, Text.Len);
+        return;
+    }
+    defineSymbol(getSymbol(Name.Str, Name.Len), SEC_DATA, Data.Len);
+}
+
+// 处理伪操作
+static void assembleDirective(Field Line, Field Name, Field Arg)
+{
+    if (fieldEqual(Name, ".text"))
+    {
+        switchSection(SEC_TEXT);
+    }
+    else if (fieldEqual(Name, ".data"))
+    {
+        switchSection(SEC_DATA);
+    }
+    else if (fieldEqual(Name, ".globl"))
+    {
+        getSymbol(Arg.Str, Arg.Len)->Global = true;
+    }
+    else if (fieldEqual(Name, ".byte") && CurSec == SEC_DATA)
+    {
+        char B = parseImm(Line, Arg);
+        secAppend(&Data, &B, 1);
+    }
+    else if (fieldEqual(Name, ".zero") && CurSec == SEC_DATA)
+    {
+        int64_t N = parseImm(Line, Arg);
+        if (N < 0)
+        {
+            badLine(Line, "invalid size");
+        }
+        secAppend(&Data, NULL, N);
+    }
+    else if (!fieldEqual(Name, ".loc") && !fieldEqual(Name, ".file"))
+    {
+        // 目标文件中不生成调试信息，忽略 .loc 和 .file
+        badLine(Line, "unsupported directive");
+    }
+}
+
+// 汇编一行代码
+static void assembleLine(char *P, char *End)
+{
+    Field Line = trim(P, End);
+    if (Line.Len == 0 || Line.Str[0] == '#')
+    {
+        return;
+    }
+
+    // 标签
+    if (Line.Str[Line.Len - 1] == ':')
+    {
+        defineLabel(trim(Line.Str, Line.Str + Line.Len - 1));
+        return;
+    }
+
+    // 助记符或伪操作名到第一个空白为止
+    char *LineEnd = Line.Str + Line.Len;
+    char *Sp = memchr(Line.Str, ' ', Line.Len);
+    Field Name = {Line.Str, (Sp ? Sp : LineEnd) - Line.Str};
+    char *Rest = Sp ? Sp : LineEnd;
+
+    if (Name.Str[0] == '.')
+    {
+        assembleDirective(Line, Name, trim(Rest, LineEnd));
+        return;
+    }
+
+    if (!InsnMap.Buckets)
+    {
+        for (int I = 0; I < sizeof(InsnTable) / sizeof(*InsnTable); I++)
+        {
+            hashmapPut(&InsnMap, InsnTable[I].Name, &InsnTable[I]);
+        }
+    }
+    InsnInfo *Info = hashmapGet2(&InsnMap, Name.Str, Name.Len);
+    if (!Info)
+    {
+        badLine(Line, "unsupported instruction");
+    }
+    if (CurSec != SEC_TEXT)
+    {
+        badLine(Line, "instruction outside of .text");
+    }
+
+    // 按逗号切分操作数
+    Field Ops[3];
+    int OpCnt = 0;
+    Field Args = trim(Rest, LineEnd);
+    for (char *Q = Args.Str, *AEnd = Args.Str + Args.Len; Args.Len && Q <= AEnd;)
+    {
+        char *Comma = memchr(Q, ',', AEnd - Q);
+        char *E = Comma ? Comma : AEnd;
+        if (OpCnt == 3)
+        {
+            badLine(Line, "too many operands");
+        }
+        Ops[OpCnt++] = trim(Q, E);
+        Q = E + 1;
+    }
+    assembleInsn(Line, Info, Ops, OpCnt);
+}
+
+// 汇编 Buf 中的代码，可以分多次传入，每次都以完整的行结束
+void assemble(char *Buf, size_t Len)
+{
+    char *End = Buf + Len;
+    for (char *P = Buf; P < End;)
+    {
+        char *NL = memchr(P, '\n', End - P);
+        char *E = NL ? NL : End;
+        assembleLine(P, E);
+        P = E + 1;
+    }
+}
+
+//
+// 直接编码，结果与汇编对应的文本完全相同
+//
+
+void asmInsn(AsmInsn Insn, int A, int B, int64_t C)
+{
+    InsnInfo *Info = &InsnTable[Insn];
+    assert(CurSec == SEC_TEXT);
+    if ((Info->Fmt == IF_I || Info->Fmt == IF_LOAD || Info->Fmt == IF_STORE) && !fitsSigned(C, 12))
+    {
+        error("%s: immediate out of range: %ld", Info->Name, C);
+    }
+    if (Info->Fmt == IF_SHIFT && (C < 0 || C > 63))
+    {
+        error("%s: shift amount out of range: %ld", Info->Name, C);
+    }
+    encodeInsn(Info, A, B, C);
+}
+
+void asmSymInsn(AsmInsn Insn, int Reg, char *Name)
+{
+    assert(CurSec == SEC_TEXT);
+    encodeSymInsn(&InsnTable[Insn], Reg, Name, strlen(Name));
+}
+
+void asmLabel(char *Name)
+{
+    defineLabel((Field){Name, strlen(Name)});
+}
+
+void asmText(void)
+{
+    switchSection(SEC_TEXT);
+}
+
+void asmData(void)
+{
+    switchSection(SEC_DATA);
+}
+
+void asmGlobal(char *Name)
+{
+    getSymbol(Name, strlen(Name))->Global = true;
+}
+
+void asmBytes(char *Buf, int64_t Len)
+{
+    assert(CurSec == SEC_DATA && Len >= 0);
+    secAppend(&Data, Buf, Len);
+}
+
+//
+// 输出 ELF 可重定位文件
+//
+
+// 字符串表
+typedef struct
+{
+    char *Buf;
+    size_t Len;
+    size_t Cap;
+} StrTab;
+
+// 在字符串表中添加字符串，返回其偏移量
+static uint32_t addString(StrTab *T, char *S)
+{
+    size_t Len = strlen(S) + 1;
+    if (T->Len + Len > T->Cap)
+    {
+        while (T->Len + Len > T->Cap)
+        {
+            T->Cap = T->Cap ? T->Cap * 2 : 4096;
+        }
+        T->Buf = realloc(T->Buf, T->Cap);
+    }
+    memcpy(T->Buf + T->Len, S, Len);
+    T->Len += Len;
+    return T->Len - Len;
+}
+
+// 节头表中各节的下标
+enum
+{
+    SH_NULL,
+    SH_TEXT,
+    SH_DATA,
+    SH_RELA_TEXT,
+    SH_SYMTAB,
+    SH_STRTAB,
+    SH_SHSTRTAB,
+    SH_COUNT,
+};
+
+// 输出的文件中 Off 之前的部分已经写出，补零到 To
+static void padTo(FILE *Out, uint64_t *Off, uint64_t To)
+{
+    for (; *Off < To; (*Off)++)
+    {
+        fputc(0, Out);
+    }
+}
+
+
+// 结束汇编，将目标文件写入 Out
+void writeObject(FILE *Out)
+{
+    switchSection(SEC_UNDEF);
+
+    // 符号表：局部符号在前，全局符号在后，未被引用的 .L 标签不需要输出
+    StrTab Str = {};
+    addString(&Str, "");
+    Elf64_Sym *SymTab = calloc(SymCnt + 1, sizeof(Elf64_Sym));
+    int N = 1;
+    int FirstGlobal = 0;
+    for (int Pass = 0; Pass < 2; Pass++)
+    {
+        if (Pass == 1)
+        {
+            FirstGlobal = N;
+        }
+        for (int I = 0; I < SymCnt; I++)
+        {
+            Symbol *Sym = Syms[I];
+            bool IsLabel = !strncmp(Sym->Name, ".L", 2);
+            bool Global = Sym->Global || (!Sym->Sec && !IsLabel);
+            if (Global != (Pass == 1) || (IsLabel && !Sym->Used))
+            {
+                continue;
+            }
+            if (!Sym->Sec && IsLabel)
+            {
+                error("undefined label: %s", Sym->Name);
+            }
+
+            Sym->Index = N;
+            Elf64_Sym *S = &SymTab[N++];
+            S->st_name = addString(&Str, Sym->Name);
+            S->st_info = ELF64_ST_INFO(Global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+            S->st_shndx = Sym->Sec == SEC_TEXT ? SH_TEXT : Sym->Sec == SEC_DATA ? SH_DATA : SHN_UNDEF;
+            S->st_value = Sym->Value;
+        }
+    }
+
+    Elf64_Rela *Rela = calloc(RelocCnt, sizeof(Elf64_Rela));
+    for (int I = 0; I < RelocCnt; I++)
+    {
+        Rela[I].r_offset = Relocs[I].Offset;
+        Rela[I].r_info = ELF64_R_INFO(Relocs[I].Sym->Index, Relocs[I].Type);
+    }
+
+    StrTab ShStr = {};
+    Elf64_Shdr Sh[SH_COUNT] = {};
+    addString(&ShStr, "");
+    Sh[SH_TEXT] = (Elf64_Shdr){
+        .sh_name = addString(&ShStr, ".text"),
+        .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+        .sh_addralign = 4,
+    };
+    Sh[SH_DATA] = (Elf64_Shdr){
+        .sh_name = addString(&ShStr, ".data"),
+        .sh_type = SHT_PROGBITS,
+        .sh_flags = SHF_ALLOC | SHF_WRITE,
+        .sh_addralign = 1,
+    };
+    Sh[SH_RELA_TEXT] = (Elf64_Shdr){
+        .sh_name = addString(&ShStr, ".rela.text"),
+        .sh_type = SHT_RELA,
+        .sh_flags = SHF_INFO_LINK,
+        .sh_link = SH_SYMTAB,
+        .sh_info = SH_TEXT,
+        .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Rela),
+    };
+    Sh[SH_SYMTAB] = (Elf64_Shdr){
+        .sh_name = addString(&ShStr, ".symtab"),
+        .sh_type = SHT_SYMTAB,
+        .sh_link = SH_STRTAB,
+        .sh_info = FirstGlobal,
+        .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Sym),
+    };
+    Sh[SH_STRTAB] = (Elf64_Shdr){
+        .sh_name = addString(&ShStr, ".strtab"),
+        .sh_type = SHT_STRTAB,
+        .sh_addralign = 1,
+    };
+    Sh[SH_SHSTRTAB] = (Elf64_Shdr){
+        .sh_name = addString(&ShStr, ".shstrtab"),
+        .sh_type = SHT_STRTAB,
+        .sh_addralign = 1,
+    };
+
+    Elf64_Ehdr Eh = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT},
+        .e_type = ET_REL,
+        .e_machine = EM_RISCV,
+        .e_version = EV_CURRENT,
+        // 与 lp64d 的目标文件链接时需要相同的浮点 ABI 标记
+        .e_flags = EF_RISCV_FLOAT_ABI_DOUBLE,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = SH_COUNT,
+        .e_shstrndx = SH_SHSTRTAB,
+    };
+
+    // 各节的内容依次排在文件头之后，节头表在最后，
+    // 先确定各部分的偏移量再按顺序写出，输出可以是管道
+    void *Bufs[SH_COUNT] = {
+        [SH_TEXT] = Text.Buf,
+        [SH_DATA] = Data.Buf,
+        [SH_RELA_TEXT] = Rela,
+        [SH_SYMTAB] = SymTab,
+        [SH_STRTAB] = Str.Buf,
+        [SH_SHSTRTAB] = ShStr.Buf,
+    };
+    Sh[SH_TEXT].sh_size = Text.Len;
+    Sh[SH_DATA].sh_size = Data.Len;
+    Sh[SH_RELA_TEXT].sh_size = sizeof(Elf64_Rela) * RelocCnt;
+    Sh[SH_SYMTAB].sh_size = sizeof(Elf64_Sym) * N;
+    Sh[SH_STRTAB].sh_size = Str.Len;
+    Sh[SH_SHSTRTAB].sh_size = ShStr.Len;
+
+    uint64_t Off = sizeof(Eh);
+    for (int I = 1; I < SH_COUNT; I++)
+    {
+        Sh[I].sh_offset = alignTo(Off, Sh[I].sh_addralign);
+        Off = Sh[I].sh_offset + Sh[I].sh_size;
+    }
+    Eh.e_shoff = alignTo(Off, 8);
+
+    Off = 0;
+    fwrite(&Eh, sizeof(Eh), 1, Out);
+    Off += sizeof(Eh);
+    for (int I = 1; I < SH_COUNT; I++)
+    {
+        padTo(Out, &Off, Sh[I].sh_offset);
+        fwrite(Bufs[I], 1, Sh[I].sh_size, Out);
+        Off += Sh[I].sh_size;
+    }
+    padTo(Out, &Off, Eh.e_shoff);
+    fwrite(Sh, sizeof(Sh), 1, Out);
+
+    free(SymTab);
+    free(Rela);
+    free(Str.Buf);
+    free(ShStr.Buf);
+}
+
+// 清除汇编器的符号、重定位和节的内容，保留已分配的缓冲区
+void asmReset(void)
+{
+    for (int I = 0; I < SymCnt; I++)
+    {
+        free(Syms[I]);
+    }
+    SymCnt = 0;
+    hashmapFree(&SymMap);
+    RelocCnt = 0;
+    ItemCnt = 0;
+    for (int I = 0; I < LabelCnt; I++)
+    {
+        free(LabelNames[I]);
+    }
+    LabelCnt = 0;
+    hashmapFree(&LabelMap);
+    Text.Len = 0;
+    Data.Len = 0;
+    CurSec = SEC_TEXT;
+    PcrelCnt = 0;
+}
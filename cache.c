@@ -0,0 +1,933 @@
+// flock 需要引入 BSD 扩展
+#define _DEFAULT_SOURCE
+
+#include "rvcc.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// 编译缓存
+//
+// 以输入文件的内容、影响输出的选项和编译器本身计算 128 位的哈希值，
+// 编译结果以哈希值命名保存在缓存目录中。再次编译相同的输入时直接复制缓存的结果，
+// 不再进行词法分析、语法分析和代码生成。
+//
+// 编译结果先写入缓存目录中的临时文件，完成后通过 rename 原子地放入缓存，
+// 多个同时进行的编译不会读到写了一半的结果。缓存超过大小上限时，
+// 按最近使用的时间删除最旧的结果，命中时会更新结果的修改时间。
+//
+// 编译结果未命中时还会进行增量编译：每个输入文件对应一个函数记录文件，
+// 保存上次编译时每个函数的指纹和代码。函数的指纹没有变化时，语法分析跳过函数体，
+// 代码生成直接输出记录中的代码，只有修改过的函数需要重新解析和生成。
+//
+// 统计信息保存在缓存目录的 stats 文件中，读写时通过 flock 加锁。
+//
+
+// 缓存格式的版本，哈希值的计算方式改变时递增
+#define CACHE_VERSION 1
+// 清理时删除到大小上限的这一比例，避免每次写入都要清理
+#define CACHE_EVICT_RATIO 0.9
+
+// 统计信息的各项
+enum
+{
+    STAT_HIT,    // 命中的次数
+    STAT_MISS,   // 未命中的次数
+    STAT_BYPASS, // 不使用缓存的次数
+    STAT_EVICT,  // 清理删除的结果数
+    STAT_SIZE,   // 缓存中结果的总字节数
+    STAT_FN_HIT,  // 增量编译时复用的函数数
+    STAT_FN_MISS, // 增量编译时重新生成的函数数
+    STAT_COUNT,
+};
+
+static char *StatNames[] = {
+    [STAT_HIT] = "hits",
+    [STAT_MISS] = "misses",
+    [STAT_BYPASS] = "bypassed",
+    [STAT_EVICT] = "evicted",
+    [STAT_SIZE] = "bytes",
+    [STAT_FN_HIT] = "fn-hits",
+    [STAT_FN_MISS] = "fn-misses",
+};
+
+// 缓存目录
+static _Thread_local char *CacheDir;
+// 缓存的大小上限
+static _Thread_local size_t CacheMax;
+// 编译结果在缓存中的路径
+static _Thread_local char *EntryPath;
+// 打开的编译结果，放入缓存后即使被其他进程清理也能继续读取
+static _Thread_local int EntryFD = -1;
+// 正在写入的临时文件的路径，编译出错退出时删除
+static _Thread_local char *TmpPath;
+
+//
+// 哈希值
+//
+
+// 128 位的 FNV-1a 哈希函数
+typedef unsigned __int128 Hash128;
+
+// 128 位 FNV 的偏移量和质数
+#define FNV128_BASIS (((Hash128)0x6c62272e07bb0142 << 64) | 0x62b821756295c58d)
+#define FNV128_PRIME (((Hash128)1 << 88) | 0x13b)
+
+static void hashBytes(Hash128 *H, void *Data, size_t Len)
+{
+    unsigned char *P = Data;
+    Hash128 V = *H;
+    for (size_t I = 0; I < Len; I++)
+    {
+        V ^= P[I];
+        V *= FNV128_PRIME;
+    }
+    *H = V;
+}
+
+// 计入一段数据，先计入长度，使相邻的两段数据不会因为边界不同而得到相同的结果
+static void hashData(Hash128 *H, void *Data, size_t Len)
+{
+    uint64_t N = Len;
+    hashBytes(H, &N, sizeof(N));
+    hashBytes(H, Data, Len);
+}
+
+// 计入文件的全部内容
+static void hashFile(Hash128 *H, char *Path)
+{
+    size_t Len;
+    char *Buf = readFile(Path, &Len);
+    hashData(H, Path, strlen(Path));
+    hashData(H, Buf, Len);
+}
+
+// 计入编译器本身，编译器重新构建后之前的结果全部失效
+static void hashCompiler(Hash128 *H)
+{
+    int Version = CACHE_VERSION;
+    hashBytes(H, &Version, sizeof(Version));
+
+    struct stat St;
+    if (stat("/proc/self/exe", &St) == 0)
+    {
+        hashBytes(H, &St.st_size, sizeof(St.st_size));
+        hashBytes(H, &St.st_mtim, sizeof(St.st_mtim));
+    }
+    else
+    {
+        char *Build = __DATE__ " " __TIME__;
+        hashData(H, Build, strlen(Build));
+    }
+}
+
+// 判断输入中是否有 #include 指令，被包含的文件也会影响编译结果，
+// 这样的输入不使用缓存
+static bool hasInclude(char *Buf, size_t Len)
+{
+    char *End = Buf + Len;
+    for (char *P = Buf; P < End; P++)
+    {
+        P = memchr(P, '#', End - P);
+        if (!P)
+        {
+            return false;
+        }
+
+        // # 之前只能有空白字符
+        char *Q = P;
+        while (Q > Buf && (Q[-1] == ' ' || Q[-1] == '\t'))
+        {
+            Q--;
+        }
+        if (Q > Buf && Q[-1] != '\n')
+        {
+            continue;
+        }
+
+        char *R = P + 1;
+        while (R < End && (*R == ' ' || *R == '\t'))
+        {
+            R++;
+        }
+        if (End - R >= 7 && !memcmp(R, "include", 7))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//
+// 统计信息
+//
+
+// 打开并锁住统计信息文件，读出其中的各项
+static int lockStats(char *Dir, uint64_t *Stats)
+{
+    memset(Stats, 0, sizeof(uint64_t) * STAT_COUNT);
+    int FD = open(format("%s/stats", Dir), O_RDWR | O_CREAT, 0644);
+    if (FD < 0 || flock(FD, LOCK_EX) < 0)
+    {
+        if (FD >= 0)
+        {
+            close(FD);
+        }
+        return -1;
+    }
+
+    char Buf[512];
+    ssize_t N = pread(FD, Buf, sizeof(Buf) - 1, 0);
+    if (N > 0)
+    {
+        Buf[N] = '\0';
+        char *P = Buf;
+        for (int I = 0; I < STAT_COUNT; I++)
+        {
+            Stats[I] = strtoull(P, &P, 10);
+        }
+    }
+    return FD;
+}
+
+// 写回统计信息并解锁
+static void unlockStats(int FD, uint64_t *Stats)
+{
+    char Buf[512];
+    int N = 0;
+    for (int I = 0; I < STAT_COUNT; I++)
+    {
+        N += snprintf(Buf + N, sizeof(Buf) - N, "%llu\n", (unsigned long long)Stats[I]);
+    }
+    if (pwrite(FD, Buf, N, 0) == N)
+    {
+        ftruncate(FD, N);
+    }
+    close(FD);
+}
+
+// 给统计信息的某一项加上 N
+static void addStat(int Kind, uint64_t N)
+{
+    uint64_t Stats[STAT_COUNT];
+    int FD = lockStats(CacheDir, Stats);
+    if (FD < 0)
+    {
+        return;
+    }
+    Stats[Kind] += N;
+    unlockStats(FD, Stats);
+}
+
+//
+// 清理
+//
+
+// 缓存中的一个结果
+typedef struct
+{
+    char *Name;
+    off_t Size;
+    struct timespec MTime;
+} CacheEntry;
+
+static int compareEntry(const void *A, const void *B)
+{
+    const CacheEntry *X = A, *Y = B;
+    if (X->MTime.tv_sec != Y->MTime.tv_sec)
+    {
+        return X->MTime.tv_sec < Y->MTime.tv_sec ? -1 : 1;
+    }
+    if (X->MTime.tv_nsec != Y->MTime.tv_nsec)
+    {
+        return X->MTime.tv_nsec < Y->MTime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+// 判断目录项是否为编译结果或函数记录，以 32 位十六进制数命名
+static bool isEntryName(char *Name)
+{
+    return strlen(Name) == 34 && Name[32] == '.' && strchr("sof", Name[33]);
+}
+
+// 缓存超过大小上限时，从最久未使用的结果开始删除，
+// 调用时持有统计信息文件的锁，同一时间只有一个进程在清理
+static void evict(uint64_t *Stats)
+{
+    DIR *D = opendir(CacheDir);
+    if (!D)
+    {
+        return;
+    }
+
+    CacheEntry *Entries = NULL;
+    int Cnt = 0, Cap = 0;
+    uint64_t Total = 0;
+    for (struct dirent *DE; (DE = readdir(D));)
+    {
+        struct stat St;
+        if (!isEntryName(DE->d_name) || fstatat(dirfd(D), DE->d_name, &St, 0) < 0)
+        {
+            continue;
+        }
+        if (Cnt == Cap)
+        {
+            Cap = Cap ? Cap * 2 : 256;
+            Entries = realloc(Entries, sizeof(CacheEntry) * Cap);
+        }
+        Entries[Cnt++] = (CacheEntry){strdup(DE->d_name), St.st_size, St.st_mtim};
+        Total += St.st_size;
+    }
+
+    qsort(Entries, Cnt, sizeof(CacheEntry), compareEntry);
+    uint64_t Limit = CacheMax * CACHE_EVICT_RATIO;
+    for (int I = 0; I < Cnt && Total > Limit; I++)
+    {
+        if (unlinkat(dirfd(D), Entries[I].Name, 0) == 0)
+        {
+            Total -= Entries[I].Size;
+            Stats[STAT_EVICT]++;
+        }
+    }
+
+    // 重新统计的大小也修正了异常退出等原因造成的偏差
+    Stats[STAT_SIZE] = Total;
+    for (int I = 0; I < Cnt; I++)
+    {
+        free(Entries[I].Name);
+    }
+    free(Entries);
+    closedir(D);
+}
+
+// 记录缓存大小的变化和增量编译的统计信息，超过大小上限时进行清理
+static void addSize(int64_t Delta, uint64_t FnHit, uint64_t FnMiss)
+{
+    uint64_t Stats[STAT_COUNT];
+    int FD = lockStats(CacheDir, Stats);
+    if (FD < 0)
+    {
+        return;
+    }
+    int64_t Size = (int64_t)Stats[STAT_SIZE] + Delta;
+    Stats[STAT_SIZE] = Size > 0 ? Size : 0;
+    Stats[STAT_FN_HIT] += FnHit;
+    Stats[STAT_FN_MISS] += FnMiss;
+    if (Stats[STAT_SIZE] > CacheMax)
+    {
+        evict(Stats);
+    }
+    unlockStats(FD, Stats);
+}
+
+//
+// 查找和写入
+//
+
+// 创建目录及其上级目录
+static void makeDirs(char *Dir)
+{
+    char *Path = strdup(Dir);
+    for (char *P = Path + 1; *P; P++)
+    {
+        if (*P == '/')
+        {
+            *P = '\0';
+            mkdir(Path, 0755);
+            *P = '/';
+        }
+    }
+    if (mkdir(Path, 0755) < 0 && errno != EEXIST)
+    {
+        error("cannot create cache directory %s: %s", Dir, strerror(errno));
+    }
+    free(Path);
+}
+
+// 所有线程尚未放入缓存的临时文件，进程退出时删除。
+// 同时编译多个文件时，每个编译线程各有一个临时文件
+typedef struct TmpFile TmpFile;
+struct TmpFile
+{
+    TmpFile *Next;
+    char *Path;
+};
+
+static TmpFile *TmpFiles;
+static pthread_mutex_t TmpLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t TmpOnce = PTHREAD_ONCE_INIT;
+
+// 退出时删除没有放入缓存的临时文件
+static void removeTmps(void)
+{
+    pthread_mutex_lock(&TmpLock);
+    for (TmpFile *T = TmpFiles; T; T = T->Next)
+    {
+        unlink(T->Path);
+    }
+    pthread_mutex_unlock(&TmpLock);
+}
+
+static void registerRemoveTmps(void)
+{
+    atexit(removeTmps);
+}
+
+// 记录当前线程新建的临时文件
+static void addTmp(char *Path)
+{
+    pthread_once(&TmpOnce, registerRemoveTmps);
+    TmpFile *T = malloc(sizeof(TmpFile));
+    T->Path = Path;
+    pthread_mutex_lock(&TmpLock);
+    T->Next = TmpFiles;
+    TmpFiles = T;
+    pthread_mutex_unlock(&TmpLock);
+    TmpPath = Path;
+}
+
+// 当前线程的临时文件已放入缓存或不再需要，Remove 为 true 时删除它
+static void dropTmp(bool Remove)
+{
+    if (!TmpPath)
+    {
+        return;
+    }
+    pthread_mutex_lock(&TmpLock);
+    for (TmpFile **P = &TmpFiles; *P; P = &(*P)->Next)
+    {
+        if ((*P)->Path == TmpPath)
+        {
+            TmpFile *T = *P;
+            *P = T->Next;
+            free(T);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&TmpLock);
+    if (Remove)
+    {
+        unlink(TmpPath);
+    }
+    free(TmpPath);
+    TmpPath = NULL;
+}
+
+// 在缓存目录 Dir 中查找输入内容 Buf 在选项 Opts 下的编译结果，
+// Dep 不为空时其内容也参与计算哈希值，MaxSize 为缓存的大小上限
+CacheResult cacheLookup(char *Dir, size_t MaxSize, char *Buf, size_t Len, char *Opts, char *Dep)
+{
+    CacheDir = Dir;
+    CacheMax = MaxSize;
+    makeDirs(Dir);
+
+    if (hasInclude(Buf, Len))
+    {
+        addStat(STAT_BYPASS, 1);
+        return CACHE_BYPASS;
+    }
+
+    Hash128 H = FNV128_BASIS;
+    hashCompiler(&H);
+    hashData(&H, Opts, strlen(Opts));
+    if (Dep)
+    {
+        hashFile(&H, Dep);
+    }
+    hashData(&H, Buf, Len);
+
+    EntryPath = format("%s/%016llx%016llx.%c", Dir, (unsigned long long)(H >> 64),
+                       (unsigned long long)H, OptC ? 'o' : 's');
+
+    // 命中时更新修改时间，清理时按最近使用的顺序保留
+    EntryFD = open(EntryPath, O_RDONLY);
+    if (EntryFD >= 0)
+    {
+        futimens(EntryFD, NULL);
+        addStat(STAT_HIT, 1);
+        return CACHE_HIT;
+    }
+
+    addStat(STAT_MISS, 1);
+    return CACHE_MISS;
+}
+
+// 在缓存目录中创建临时文件，写完后通过 rename 放入缓存
+static FILE *createTmp(void)
+{
+    char *Path = format("%s/tmp.XXXXXX", CacheDir);
+    int FD = mkstemp(Path);
+    if (FD < 0)
+    {
+        error("cannot create temporary file in %s: %s", CacheDir, strerror(errno));
+    }
+    addTmp(Path);
+    // mkstemp 创建的文件只有所有者可读写，缓存可能被多个用户共享
+    fchmod(FD, 0644);
+
+    FILE *Out = fdopen(FD, "w+");
+    if (!Out)
+    {
+        error("cannot open %s: %s", TmpPath, strerror(errno));
+    }
+    return Out;
+}
+
+// 未命中时，创建写入编译结果的临时文件
+FILE *cacheCreate(void)
+{
+    return createTmp();
+}
+
+// 将写完的临时文件原子地放入缓存
+void cacheCommit(FILE *Tmp)
+{
+    if (fflush(Tmp) || ferror(Tmp))
+    {
+        error("cannot write %s: %s", TmpPath, strerror(errno));
+    }
+
+    struct stat St;
+    fstat(fileno(Tmp), &St);
+    EntryFD = dup(fileno(Tmp));
+    fclose(Tmp);
+
+    // 其他进程可能同时放入了相同的结果，rename 会原子地替换它，内容相同
+    if (rename(TmpPath, EntryPath) < 0)
+    {
+        error("cannot rename %s to %s: %s", TmpPath, EntryPath, strerror(errno));
+    }
+    dropTmp(false);
+
+    addSize(St.st_size, 0, 0);
+}
+
+// 将缓存中的编译结果复制到输出文件
+void cacheCopy(FILE *Out)
+{
+    char Buf[1 << 16];
+    for (off_t Off = 0;;)
+    {
+        ssize_t N = pread(EntryFD, Buf, sizeof(Buf), Off);
+        if (N < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("cannot read %s: %s", EntryPath, strerror(errno));
+        }
+        if (N == 0)
+        {
+            break;
+        }
+        fwrite(Buf, 1, N, Out);
+        Off += N;
+    }
+    close(EntryFD);
+    EntryFD = -1;
+
+    if (fflush(Out) || ferror(Out))
+    {
+        error("cannot write output: %s", strerror(errno));
+    }
+}
+
+// 输出缓存的命中统计信息
+void cachePrintStats(char *Dir, FILE *Out)
+{
+    uint64_t Stats[STAT_COUNT];
+    int FD = lockStats(Dir, Stats);
+    if (FD < 0)
+    {
+        fprintf(Out, "cannot read cache statistics in %s\n", Dir);
+        return;
+    }
+    close(FD);
+
+    for (int I = 0; I < STAT_COUNT; I++)
+    {
+        fprintf(Out, "%-10s %14llu\n", StatNames[I], (unsigned long long)Stats[I]);
+    }
+    uint64_t Total = Stats[STAT_HIT] + Stats[STAT_MISS];
+    fprintf(Out, "%-10s %13.1f%%\n", "hit rate", Total ? 100.0 * Stats[STAT_HIT] / Total : 0.0);
+}
+
+//
+// 增量编译
+//
+
+#define FN_PACK_MAGIC "RVCCFNS1"
+
+// 函数在增量编译缓存中的记录
+struct FnRecord
+{
+    char Key[16]; // 函数的指纹
+    int FileNo;   // 函数所在的文件
+    int Line;     // 函数体开头的行号
+    bool Hit;     // 是否复用上次编译的代码
+    int OldLine;  // 上次编译时函数体开头的行号
+
+    // 函数用到的字符串字面量，按创建的顺序排列
+    char **Strs;
+    int *StrLens;
+    int StrCnt;
+    int StrCap;
+
+    // 函数的代码，命中时指向函数记录文件，否则由代码生成写入
+    char *Text;
+    size_t TextLen;
+};
+
+// 函数记录文件的路径
+static _Thread_local char *PackPath;
+// 上次编译的函数记录文件的大小
+static _Thread_local size_t OldPackSize;
+// 上次编译的各个函数的记录，以指纹为键
+static _Thread_local HashMap OldRecs;
+// 上次编译的函数的数量
+static _Thread_local int OldCnt;
+// 本次编译的所有函数，按解析的顺序排列
+static _Thread_local FnRecord **Recs;
+static _Thread_local int RecCnt;
+static _Thread_local int RecCap;
+
+// 从函数记录文件中读取一个 32 位整数，越界时返回 false
+static bool readU32(char **P, char *End, uint32_t *Val)
+{
+    if (End - *P < 4)
+    {
+        return false;
+    }
+    memcpy(Val, *P, 4);
+    *P += 4;
+    return true;
+}
+
+// 解析函数记录文件中的一条记录，存入 OldRecs
+static bool loadRecord(char **P, char *End)
+{
+    if (End - *P < 16)
+    {
+        return false;
+    }
+    FnRecord *R = calloc(1, sizeof(FnRecord));
+    memcpy(R->Key, *P, 16);
+    *P += 16;
+
+    uint32_t Line, StrCnt, TextLen;
+    if (!readU32(P, End, &Line) || !readU32(P, End, &StrCnt) || !readU32(P, End, &TextLen) ||
+        StrCnt > (size_t)(End - *P) / 4)
+    {
+        return false;
+    }
+    R->OldLine = Line;
+    R->StrCnt = R->StrCap = StrCnt;
+    R->Strs = calloc(StrCnt, sizeof(char *));
+    R->StrLens = calloc(StrCnt, sizeof(int));
+    for (uint32_t I = 0; I < StrCnt; I++)
+    {
+        uint32_t Len;
+        if (!readU32(P, End, &Len) || Len > End - *P)
+        {
+            return false;
+        }
+        R->Strs[I] = *P;
+        R->StrLens[I] = Len;
+        *P += Len;
+    }
+    if (TextLen > End - *P)
+    {
+        return false;
+    }
+    R->Text = *P;
+    R->TextLen = TextLen;
+    *P += TextLen;
+
+    hashmapPut2(&OldRecs, R->Key, 16, R);
+    return true;
+}
+
+// 开始增量编译，载入上次编译输入文件 Path 时各个函数的记录。
+// 函数的代码与是否输出注释和行号信息有关，这些选项也参与计算记录文件的名称
+void fnCacheOpen(char *Path)
+{
+    Hash128 H = FNV128_BASIS;
+    hashCompiler(&H);
+    char *Opts = format("fn verbose-asm=%d g=%d", OptVerboseAsm, OptDebugInfo);
+    hashData(&H, Opts, strlen(Opts));
+    hashData(&H, Path, strlen(Path));
+    PackPath = format("%s/%016llx%016llx.f", CacheDir, (unsigned long long)(H >> 64),
+                      (unsigned long long)H);
+
+    int FD = open(PackPath, O_RDONLY);
+    if (FD < 0)
+    {
+        return;
+    }
+    close(FD);
+
+    // 映射的文件在被其他进程替换后仍然有效
+    char *Buf = readFile(PackPath, &OldPackSize);
+    char *P = Buf, *End = Buf + OldPackSize;
+    uint32_t Cnt;
+    if (OldPackSize < 8 || memcmp(P, FN_PACK_MAGIC, 8))
+    {
+        return;
+    }
+    P += 8;
+    if (!readU32(&P, End, &Cnt))
+    {
+        return;
+    }
+
+    // 记录文件损坏时丢弃其中所有的记录
+    for (uint32_t I = 0; I < Cnt; I++)
+    {
+        if (!loadRecord(&P, End))
+        {
+            hashmapFree(&OldRecs);
+            return;
+        }
+    }
+    OldCnt = Cnt;
+}
+
+// 是否正在进行增量编译
+bool fnCacheEnabled(void)
+{
+    return PackPath;
+}
+
+// 查找指纹数据为 Data 的函数的记录，函数体开头位于文件 FileNo 的第 Line 行
+FnRecord *fnCacheLookup(char *Data, size_t Len, int FileNo, int Line)
+{
+    Hash128 H = FNV128_BASIS;
+    hashBytes(&H, Data, Len);
+
+    FnRecord *R = calloc(1, sizeof(FnRecord));
+    memcpy(R->Key, &H, 16);
+    R->FileNo = FileNo;
+    R->Line = Line;
+
+    FnRecord *Old = hashmapGet2(&OldRecs, R->Key, 16);
+    if (Old)
+    {
+        R->Hit = true;
+        R->OldLine = Old->OldLine;
+        R->Strs = Old->Strs;
+        R->StrLens = Old->StrLens;
+        R->StrCnt = Old->StrCnt;
+        R->Text = Old->Text;
+        R->TextLen = Old->TextLen;
+    }
+
+    if (RecCnt == RecCap)
+    {
+        RecCap = RecCap ? RecCap * 2 : 256;
+        Recs = realloc(Recs, sizeof(FnRecord *) * RecCap);
+    }
+    Recs[RecCnt++] = R;
+    return R;
+}
+
+// 是否复用上次编译的代码
+bool fnCacheHit(FnRecord *R)
+{
+    return R->Hit;
+}
+
+// 记录函数用到的字符串字面量
+void fnCacheAddString(FnRecord *R, char *Str, int Len)
+{
+    if (R->StrCnt == R->StrCap)
+    {
+        R->StrCap = R->StrCap ? R->StrCap * 2 : 8;
+        R->Strs = realloc(R->Strs, sizeof(char *) * R->StrCap);
+        R->StrLens = realloc(R->StrLens, sizeof(int) * R->StrCap);
+    }
+    R->Strs[R->StrCnt] = Str;
+    R->StrLens[R->StrCnt++] = Len;
+}
+
+// 获取命中的函数用到的第 I 个字符串字面量，没有更多时返回 NULL
+char *fnCacheString(FnRecord *R, int I, int *Len)
+{
+    if (I >= R->StrCnt)
+    {
+        return NULL;
+    }
+    *Len = R->StrLens[I];
+    return R->Strs[I];
+}
+
+// 获取命中的函数的代码，函数移动了位置时修正其中 .loc 的行号。
+// 由代码生成的线程调用，每个函数只属于一个线程，不使用内存池
+char *fnCacheText(FnRecord *R, size_t *Len)
+{
+    int Delta = R->Line - R->OldLine;
+    if (!Delta)
+    {
+        *Len = R->TextLen;
+        return R->Text;
+    }
+
+    // 每个 .loc 至少占 10 个字符，行号增加的位数不会超过这一长度
+    char *Buf = malloc(R->TextLen * 2 + 1);
+    char *W = Buf;
+    char *End = R->Text + R->TextLen;
+    for (char *P = R->Text; P < End;)
+    {
+        char *NL = memchr(P, '\n', End - P);
+        char *Q = NL ? NL + 1 : End;
+        char *Next;
+        long FileNo, Line;
+        if (Q - P > 7 && !memcmp(P, "  .loc ", 7) && (FileNo = strtol(P + 7, &Next, 10)) == R->FileNo)
+        {
+            Line = strtol(Next, &Next, 10);
+            W += sprintf(W, "  .loc %ld %ld", FileNo, Line + Delta);
+            P = Next;
+        }
+        memcpy(W, P, Q - P);
+        W += Q - P;
+        P = Q;
+    }
+    // 修正后的代码替换原来的代码，之后写入记录文件时不必再次修正
+    R->Text = Buf;
+    R->TextLen = *Len = W - Buf;
+    R->OldLine = R->Line;
+    return Buf;
+}
+
+// 记录重新生成的函数的代码，由代码生成的线程调用
+void fnCacheStore(FnRecord *R, char *Text, size_t Len)
+{
+    R->Text = malloc(Len);
+    memcpy(R->Text, Text, Len);
+    R->TextLen = Len;
+}
+
+// 写入 32 位整数
+static void writeU32(FILE *Out, uint32_t Val)
+{
+    fwrite(&Val, 4, 1, Out);
+}
+
+// 结束增量编译，将本次编译的所有函数写入新的函数记录文件，原子地替换上次的文件
+void fnCacheCommit(void)
+{
+    if (!PackPath)
+    {
+        return;
+    }
+
+    int Hits = 0;
+    for (int I = 0; I < RecCnt; I++)
+    {
+        Hits += Recs[I]->Hit;
+    }
+    // 所有的函数都没有变化时不必重写
+    if (Hits == RecCnt && RecCnt == OldCnt)
+    {
+        addSize(0, Hits, 0);
+        return;
+    }
+
+    FILE *Out = createTmp();
+    fwrite(FN_PACK_MAGIC, 1, 8, Out);
+    long CntPos = ftell(Out);
+    writeU32(Out, 0);
+    uint32_t Cnt = 0;
+    for (int I = 0; I < RecCnt; I++)
+    {
+        FnRecord *R = Recs[I];
+        // 解析出错时之后的函数没有生成代码
+        if (!R->Text)
+        {
+            continue;
+        }
+        // 命中的代码按本次的行号保存
+        if (R->Hit)
+        {
+            fnCacheText(R, &R->TextLen);
+        }
+        fwrite(R->Key, 1, 16, Out);
+        writeU32(Out, R->Line);
+        writeU32(Out, R->StrCnt);
+        writeU32(Out, R->TextLen);
+        for (int J = 0; J < R->StrCnt; J++)
+        {
+            writeU32(Out, R->StrLens[J]);
+            fwrite(R->Strs[J], 1, R->StrLens[J], Out);
+        }
+        fwrite(R->Text, 1, R->TextLen, Out);
+        Cnt++;
+    }
+    fseek(Out, CntPos, SEEK_SET);
+    writeU32(Out, Cnt);
+
+    if (fflush(Out) || ferror(Out))
+    {
+        error("cannot write %s: %s", TmpPath, strerror(errno));
+    }
+    struct stat St;
+    fstat(fileno(Out), &St);
+    fclose(Out);
+    if (rename(TmpPath, PackPath) < 0)
+    {
+        error("cannot rename %s to %s: %s", TmpPath, PackPath, strerror(errno));
+    }
+    dropTmp(false);
+
+    addSize((int64_t)St.st_size - (int64_t)OldPackSize, Hits, RecCnt - Hits);
+}
+
+// 结束本次编译对缓存的使用：删除出错时没有放入缓存的临时文件，
+// 关闭打开的编译结果，丢弃增量编译的记录。记录文件的映射由词法分析统一释放
+void cacheReset(void)
+{
+    dropTmp(true);
+    if (EntryFD >= 0)
+    {
+        close(EntryFD);
+        EntryFD = -1;
+    }
+    CacheDir = NULL;
+    EntryPath = NULL;
+
+    // 命中的记录与上次的记录共用字符串的数组，代码可能指向记录文件
+    for (int I = 0; I < RecCnt; I++)
+    {
+        FnRecord *R = Recs[I];
+        FnRecord *Old = R->Hit ? hashmapGet2(&OldRecs, R->Key, 16) : NULL;
+        if (!R->Hit)
+        {
+            free(R->Strs);
+            free(R->StrLens);
+        }
+        if (!Old || R->Text != Old->Text)
+        {
+            free(R->Text);
+        }
+        free(R);
+    }
+    RecCnt = 0;
+    int Iter = 0;
+    for (HashEntry *Ent; (Ent = hashmapNext(&OldRecs, &Iter));)
+    {
+        FnRecord *Old = Ent->Val;
+        free(Old->Strs);
+        free(Old->StrLens);
+        free(Old);
+    }
+    hashmapFree(&OldRecs);
+    OldCnt = 0;
+    OldPackSize = 0;
+    PackPath = NULL;
+}
@@ -0,0 +1,148 @@
+// 使用 SCM_RIGHTS 等套接字扩展需要引入 BSD/SVID 扩展
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//
+// rvcc-client：用法与 rvcc 相同，将命令行参数交给常驻的 rvcc --server 编译，
+// 编译在客户端的当前目录下进行，直接使用客户端的标准输入输出，退出状态与 rvcc 相同。
+// 没有服务器在监听时，直接执行与客户端位于同一目录的 rvcc
+//
+
+// 服务器的套接字路径，与 rvcc --server 的约定相同
+static char *socketPath(void)
+{
+    static char Buf[64];
+    char *Path = getenv("RVCC_SERVER");
+    if (Path)
+    {
+        return Path;
+    }
+    snprintf(Buf, sizeof(Buf), "/tmp/rvcc-%d.sock", (int)getuid());
+    return Buf;
+}
+
+// 连接服务器，失败时返回 -1
+static int connectServer(void)
+{
+    char *Path = socketPath();
+    struct sockaddr_un Addr = {.sun_family = AF_UNIX};
+    if (strlen(Path) >= sizeof(Addr.sun_path))
+    {
+        return -1;
+    }
+    strcpy(Addr.sun_path, Path);
+
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD >= 0 && connect(FD, (struct sockaddr *)&Addr, sizeof(Addr)) < 0)
+    {
+        close(FD);
+        return -1;
+    }
+    return FD;
+}
+
+// 不经过服务器，直接执行 rvcc
+static void runLocal(char **Argv)
+{
+    char Path[PATH_MAX];
+    ssize_t N = readlink("/proc/self/exe", Path, sizeof(Path) - sizeof("rvcc"));
+    if (N > 0)
+    {
+        Path[N] = '\0';
+        char *Slash = strrchr(Path, '/');
+        strcpy(Slash + 1, "rvcc");
+        execv(Path, Argv);
+    }
+    execvp("rvcc", Argv);
+    fprintf(stderr, "rvcc-client: cannot run rvcc: %s\n", strerror(errno));
+    exit(1);
+}
+
+// 写入全部数据
+static int writeAll(int FD, char *Buf, size_t Len)
+{
+    while (Len > 0)
+    {
+        ssize_t N = write(FD, Buf, Len);
+        if (N < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        Buf += N;
+        Len -= N;
+    }
+    return 0;
+}
+
+int main(int Argc, char **Argv)
+{
+    int FD = connectServer();
+    if (FD < 0)
+    {
+        runLocal(Argv);
+    }
+
+    // 请求为当前目录和各个参数，均以 '\0' 结尾
+    char *Cwd = getcwd(NULL, 0);
+    if (!Cwd)
+    {
+        fprintf(stderr, "rvcc-client: cannot get current directory: %s\n", strerror(errno));
+        return 1;
+    }
+    size_t Len = strlen(Cwd) + 1;
+    for (int I = 0; I < Argc; I++)
+    {
+        Len += strlen(Argv[I]) + 1;
+    }
+    char *Req = malloc(Len);
+    char *P = stpcpy(Req, Cwd) + 1;
+    for (int I = 0; I < Argc; I++)
+    {
+        P = stpcpy(P, Argv[I]) + 1;
+    }
+
+    // 请求的长度与标准输入、标准输出和标准错误一起发送
+    uint32_t Len32 = Len;
+    int Fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char Ctrl[CMSG_SPACE(sizeof(Fds))] = {};
+    struct iovec IO = {.iov_base = &Len32, .iov_len = sizeof(Len32)};
+    struct msghdr Msg = {
+        .msg_iov = &IO,
+        .msg_iovlen = 1,
+        .msg_control = Ctrl,
+        .msg_controllen = sizeof(Ctrl),
+    };
+    struct cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+    C->cmsg_level = SOL_SOCKET;
+    C->cmsg_type = SCM_RIGHTS;
+    C->cmsg_len = CMSG_LEN(sizeof(Fds));
+    memcpy(CMSG_DATA(C), Fds, sizeof(Fds));
+
+    if (sendmsg(FD, &Msg, 0) != sizeof(Len32) || writeAll(FD, Req, Len) < 0)
+    {
+        fprintf(stderr, "rvcc-client: cannot send request: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // 等待编译结束，服务器回复退出状态
+    int32_t Status;
+    if (recv(FD, &Status, sizeof(Status), MSG_WAITALL) != sizeof(Status))
+    {
+        fprintf(stderr, "rvcc-client: server closed the connection\n");
+        return 1;
+    }
+    return Status;
+}
@@ -1,53 +1,290 @@
 #include "rvcc.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 // 用于存储函数参数的寄存器
 static char *ArgReg[] = {"a0", "a1", "a2", "a3", "a4", "a5"};
-// 输出文件
-static FILE *OutputFile;
+
+// 输出缓冲区的大小，缓冲区将满时整块写入输出文件
+#define OUT_BUF_SIZE (1 << 20)
+// 缓冲区中的内容超过该大小后，在下一行的开头写出
+#define OUT_FLUSH_SIZE (OUT_BUF_SIZE - 4096)
+
+// 选项属于正在编译的线程，并行生成函数的工作线程沿用创建它们的线程的选项
+// 是否输出解释每条指令的注释，以及每个语法树节点处的 .loc
+_Thread_local bool OptVerboseAsm;
+// 是否输出源码的行号信息（.loc）
+_Thread_local bool OptDebugInfo = true;
+// 是否由内置的汇编器直接输出目标文件
+_Thread_local bool OptC;
+
+// 以下状态只属于正在生成的函数，并行生成时每个线程各有一份
+// 输出文件，为 NULL 时输出只积累在缓冲区中
+static _Thread_local FILE *OutputFile;
+// 输出缓冲区
+static _Thread_local char *OutBuf;
+static _Thread_local size_t OutLen;
+static _Thread_local size_t OutCap;
 // 栈深度
-static int Depth;
+static _Thread_local int Depth;
 // 当前的函数
-static Obj *CurrentFn;
+static _Thread_local Obj *CurrentFn;
+// 当前函数内语句的编号，标签中含有函数名，因此每个函数从 0 开始编号
+static _Thread_local int LabelCnt;
+// 最近一次输出的 .loc 的文件编号和行号
+static _Thread_local int LastFileNo;
+static _Thread_local int LastLine;
+// 当前的函数或数据段是否直接交给汇编器编码，不生成汇编代码的文本
+static _Thread_local bool Encode;
+// 直接编码时函数内标签的名称
+static _Thread_local char *LabelBuf;
+static _Thread_local size_t LabelBufCap;
 
 static void genExpr(Node *node);
 static void genStmt(Node *node);
 
+// 将汇编代码写入输出文件，或交给内置的汇编器
+static void writeOutput(char *Buf, size_t Len)
+{
+    if (OptC)
+    {
+        assemble(Buf, Len);
+        return;
+    }
+    fwrite(Buf, 1, Len, OutputFile);
+}
+
+// 将缓冲区中的内容写入输出文件
+static void flushOutput(void)
+{
+    if (OutputFile && OutLen)
+    {
+        writeOutput(OutBuf, OutLen);
+        OutLen = 0;
+    }
+}
+
+// 代码生成结束，直接输出目标文件时写出目标文件
+static void finishOutput(void)
+{
+    flushOutput();
+    if (OptC)
+    {
+        writeObject(OutputFile);
+    }
+}
+
+// 确保缓冲区中还能写入 N 个字符
+static void reserveOutput(size_t N)
+{
+    if (OutLen + N <= OutCap)
+    {
+        return;
+    }
+    while (OutLen + N > OutCap)
+    {
+        OutCap = OutCap ? OutCap * 2 : OUT_BUF_SIZE;
+    }
+    OutBuf = realloc(OutBuf, OutCap);
+}
+
+// 输出 Len 个字符
+static void emitStr(char *S, size_t Len)
+{
+    reserveOutput(Len);
+    memcpy(OutBuf + OutLen, S, Len);
+    OutLen += Len;
+}
+
+// 输出十进制整数
+static void emitInt(int64_t Val)
+{
+    char Tmp[24];
+    char *P = Tmp + sizeof(Tmp);
+    uint64_t U = Val < 0 ? -(uint64_t)Val : Val;
+    do
+    {
+        *--P = '0' + U % 10;
+        U /= 10;
+    } while (U);
+    if (Val < 0)
+    {
+        *--P = '-';
+    }
+    emitStr(P, Tmp + sizeof(Tmp) - P);
+}
+
+// 判断格式串是否为一行注释
+static bool isComment(char *Fmt)
+{
+    while (*Fmt == '\n' || *Fmt == ' ')
+    {
+        Fmt++;
+    }
+    return *Fmt == '#';
+}
+
+// 删除缓冲区中从 Start 开始的注释行和空行
+static void stripLines(size_t Start)
+{
+    // 多数格式串只以多余的换行符结尾，去掉后只剩一行时不必逐行检查
+    while (OutLen - Start >= 2 && OutBuf[OutLen - 2] == '\n')
+    {
+        OutLen--;
+    }
+    char *NL = memchr(OutBuf + Start, '\n', OutLen - Start);
+    if (NL == OutBuf + OutLen - 1 && NL != OutBuf + Start)
+    {
+        return;
+    }
+
+    char *W = OutBuf + Start;
+    char *End = OutBuf + OutLen;
+    for (char *P = W; P < End;)
+    {
+        char *Q = memchr(P, '\n', End - P) + 1;
+        char *C = P;
+        while (*C == ' ')
+        {
+            C++;
+        }
+        if (*C != '\n' && *C != '#')
+        {
+            memmove(W, P, Q - P);
+            W += Q - P;
+        }
+        P = Q;
+    }
+    OutLen = W - OutBuf;
+}
+
 // 输出字符串到目标文件并换行
+// 只支持代码生成用到的 %s、%d、%ld 和 %c，指令的格式串中的其余部分按段整体复制。
+// 默认的精简输出中不含注释和空行
 static void writeln(char *Fmt, ...)
 {
-    va_list VA;
+    if (!OptVerboseAsm && isComment(Fmt))
+    {
+        return;
+    }
+    assert(!Encode);
+    // 有输出文件时在行的开头整块写出，没有时（并行生成）缓冲区只会扩大
+    if (OutLen >= OUT_FLUSH_SIZE)
+    {
+        flushOutput();
+    }
+    size_t Start = OutLen;
 
+    va_list VA;
     va_start(VA, Fmt);
-    vfprintf(OutputFile, Fmt, VA);
+
+    for (char *P = Fmt;;)
+    {
+        char *Q = P + strcspn(P, "%");
+        emitStr(P, Q - P);
+        if (!*Q)
+        {
+            break;
+        }
+
+        switch (Q[1])
+        {
+        case 's':
+        {
+            char *S = va_arg(VA, char *);
+            emitStr(S, strlen(S));
+            P = Q + 2;
+            break;
+        }
+        case 'd':
+            emitInt(va_arg(VA, int));
+            P = Q + 2;
+            break;
+        case 'l':
+            assert(Q[2] == 'd');
+            emitInt(va_arg(VA, long));
+            P = Q + 3;
+            break;
+        case 'c':
+        {
+            char C = va_arg(VA, int);
+            emitStr(&C, 1);
+            P = Q + 2;
+            break;
+        }
+        default:
+            unreachable();
+        }
+    }
     va_end(VA);
 
-    fprintf(OutputFile, "\n");
+    emitStr("\n", 1);
+    if (!OptVerboseAsm)
+    {
+        stripLines(Start);
+    }
+}
+
+// 输出一行汇编代码：直接编码时调用汇编器的 Enc，否则按 writeln 的格式输出文本
+#define emit(Enc, ...) (Encode ? (void)(Enc) : writeln(__VA_ARGS__))
+
+// 开始生成一个函数或数据段。直接输出目标文件且不需要注释时直接编码，
+// 并行生成和增量编译记录的代码仍为文本（没有输出文件）。
+// 开始直接编码前先将缓冲区中的代码交给汇编器，保持代码的顺序
+static void beginSection(void)
+{
+    Encode = OptC && !OptVerboseAsm && OutputFile;
+    if (Encode)
+    {
+        flushOutput();
+    }
+}
+
+// 直接编码时的函数内标签名 .L.<Kind>.<函数名>[.<编号>]，与汇编代码中的相同，
+// 在下一次调用前有效
+static char *labelName(char *Kind, int Cnt)
+{
+    size_t Len = strlen(Kind) + strlen(CurrentFn->name) + 16;
+    if (Len > LabelBufCap)
+    {
+        LabelBufCap = Len;
+        LabelBuf = realloc(LabelBuf, LabelBufCap);
+    }
+    if (Cnt < 0)
+    {
+        snprintf(LabelBuf, Len, ".L.%s.%s", Kind, CurrentFn->name);
+    }
+    else
+    {
+        snprintf(LabelBuf, Len, ".L.%s.%s.%d", Kind, CurrentFn->name, Cnt);
+    }
+    return LabelBuf;
 }
 
 static int Count(void)
 {
-    static int cnt = 0;
-    return cnt++;
+    return LabelCnt++;
 }
 
 // 将 a0 压入栈
 static void push(void)
 {
     writeln("  # 压栈，将 a0 的值存入栈顶\n");
-    writeln("  addi sp, sp, -8\n");
+    emit(asmInsn(AI_ADDI, REG_SP, REG_SP, -8), "  addi sp, sp, -8\n");
     // sd rd, rs1, 将寄存器 rd 中的值存储到 rsq 上
-    writeln("  sd a0, 0(sp)\n");
+    emit(asmInsn(AI_SD, REG_A0, REG_SP, 0), "  sd a0, 0(sp)\n");
     Depth++;
 }
 
-// 从栈中取出元素并放到 Reg
-static void pop(char *Reg)
+// 从栈中取出元素并放到第 Reg 个参数寄存器
+static void pop(int Reg)
 {
-    writeln("  # 弹栈，将栈顶的值存入%s\n", Reg);
+    writeln("  # 弹栈，将栈顶的值存入%s\n", ArgReg[Reg]);
     // ld rd, rs1，从内存中加载一个 32 位或 64 位的 rs1(操作数) 到寄存器 rd 中
-    writeln("  ld %s, 0(sp)\n", Reg);
+    emit(asmInsn(AI_LD, REG_A0 + Reg, REG_SP, 0), "  ld %s, 0(sp)\n", ArgReg[Reg]);
     // addi rd, rs1, imm 表示 rd = rs1 + imm
-    writeln("  addi sp, sp, 8\n");
+    emit(asmInsn(AI_ADDI, REG_SP, REG_SP, 8), "  addi sp, sp, 8\n");
     Depth--;
 }
 
@@ -63,29 +300,29 @@ static void load(Type *type)
     if (type->size == 1)
     {
         // lb rd, rs1, 从内存中加载一个 8 位 (1 字节) 的操作数 rs1 到寄存器 rd 中
-        writeln("  lb a0, 0(a0)\n");
+        emit(asmInsn(AI_LB, REG_A0, REG_A0, 0), "  lb a0, 0(a0)\n");
     }
     else if (type->size == 2)
     {
         // lh rd, rs1, 从内存中加载一个 16 位（2 字节）的操作数 rs1 到寄存器 rd 中
-        writeln("  lh a0, 0(a0)\n");
+        emit(asmInsn(AI_LH, REG_A0, REG_A0, 0), "  lh a0, 0(a0)\n");
     }
     else if (type->size == 4)
     {
         // lw rd, rs1, 从内存中加载一个 32 位（4 字节）的操作数 rs1 到寄存器 rd 中
-        writeln("  lw a0,0(a0)\n");
+        emit(asmInsn(AI_LW, REG_A0, REG_A0, 0), "  lw a0,0(a0)\n");
     }
     else
     {
         // ld rd, rs1, 从内存中加载一个 64 位（8 字节）的操作数 rs1 到寄存器 rd 中
-        writeln("  ld a0, 0(a0)\n");
+        emit(asmInsn(AI_LD, REG_A0, REG_A0, 0), "  ld a0, 0(a0)\n");
     }
 }
 
 // 将栈顶值 (为一个地址) 存入 a0
 static void store(Type *type)
 {
-    pop("a1");
+    pop(1); // 取回地址，存入 a1
 
     if (type->kind == TY_STRUCT || type->kind == TY_UNION)
     {
@@ -93,13 +330,13 @@ static void store(Type *type)
 
         for (int i = 0; i < type->size; i++)
         {
-            writeln("li t0, %d", i);
-            writeln("add t0, a0, t0");
-            writeln("lb t1, 0(t0)");
+            emit(asmInsn(AI_LI, REG_T0, 0, i), "li t0, %d", i);
+            emit(asmInsn(AI_ADD, REG_T0, REG_A0, REG_T0), "add t0, a0, t0");
+            emit(asmInsn(AI_LB, REG_T1, REG_T0, 0), "lb t1, 0(t0)");
 
-            writeln("li t0, %d", i);
-            writeln("add t0, a1, t0");
-            writeln("sb t1, 0(t0)");
+            emit(asmInsn(AI_LI, REG_T0, 0, i), "li t0, %d", i);
+            emit(asmInsn(AI_ADD, REG_T0, REG_A1, REG_T0), "add t0, a1, t0");
+            emit(asmInsn(AI_SB, REG_T1, REG_T0, 0), "sb t1, 0(t0)");
         }
 
         return;
@@ -108,19 +345,19 @@ static void store(Type *type)
     writeln("  # 将 a0 的值，写入到 a1 中存放的地址\n");
     if (type->size == 1)
     {
-        writeln("  sb a0, 0(a1)\n"); // sb 代表 "store byte"，通常用于存储 1 个字节的数据
+        emit(asmInsn(AI_SB, REG_A0, REG_A1, 0), "  sb a0, 0(a1)\n"); // sb 代表 "store byte"，通常用于存储 1 个字节的数据
     }
     else if (type->size == 2)
     {
-        writeln("  sh a0, 0(a1)\n");
+        emit(asmInsn(AI_SH, REG_A0, REG_A1, 0), "  sh a0, 0(a1)\n");
     }
     else if (type->size == 4)
     {
-        writeln("  sw a0, 0(a1)");
+        emit(asmInsn(AI_SW, REG_A0, REG_A1, 0), "  sw a0, 0(a1)");
     }
     else
     {
-        writeln("  sd a0, 0(a1)\n"); // sd 代表 "store doubleword"，通常用于存储 4 字节或 8 字节的数据
+        emit(asmInsn(AI_SD, REG_A0, REG_A1, 0), "  sd a0, 0(a1)\n"); // sd 代表 "store doubleword"，通常用于存储 4 字节或 8 字节的数据
     }
 };
 
@@ -134,19 +371,20 @@ static void getAddr(Node *node)
         {
             writeln("  # 获取局部变量%s的栈内地址为%d(fp)\n", node->Var->name,
                     node->Var->offset);
-            writeln("  addi a0, fp, %d\n", node->Var->offset); // 取出变量相对于 fp 的偏移量
+            emit(asmInsn(AI_ADDI, REG_A0, REG_FP, node->Var->offset), "  addi a0, fp, %d\n",
+                 node->Var->offset); // 取出变量相对于 fp 的偏移量
         }
         else
         {
             writeln("  # 获取全局变量%s的栈内地址\n", node->Var->name);
-            writeln("  la a0, %s\n", node->Var->name);
+            emit(asmSymInsn(AI_LA, REG_A0, node->Var->name), "  la a0, %s\n", node->Var->name);
         }
         return;
     case ND_MEMBER:
         getAddr(node->LHS);
         // li 指令用于加载立即数到寄存器。
-        writeln("li t0, %d", node->Mem->offset);
-        writeln("add a0, a0, t0");
+        emit(asmInsn(AI_LI, REG_T0, 0, node->Mem->offset), "li t0, %d", node->Mem->offset);
+        emit(asmInsn(AI_ADD, REG_A0, REG_A0, REG_T0), "add a0, a0, t0");
         return;
     case ND_DEREF:
         genExpr(node->LHS);
@@ -222,14 +460,47 @@ static void cast(Type *From, Type *To)
     if (castTable[T1][T2])
     {
         writeln("  # 转换函数");
+        if (Encode)
+        {
+            // 与 castTable 中的指令相同，移位的位数为 64 减去目标类型的位数
+            int Shift = 64 - (8 << T2);
+            asmInsn(AI_SLLI, REG_A0, REG_A0, Shift);
+            asmInsn(AI_SRAI, REG_A0, REG_A0, Shift);
+            return;
+        }
         writeln("%s", castTable[T1][T2]);
     }
 }
 
-static void genExpr(Node *node)
+// 输出节点在源码中的行号
+static void emitLoc(Node *node)
 {
+    // 目标文件中不含行号信息
+    if (!OptDebugInfo || Encode)
+    {
+        return;
+    }
+    // 宏拼接产生的终结符不在任何源文件中，沿用之前的行号
+    File *F = getFile(node->Tok->Loc);
+    if (!F->FileNo)
+    {
+        return;
+    }
+    // 精简输出时只在行号变化时输出，.loc 对其后的指令一直有效
+    int Line = getLineNo(node->Tok->Loc);
+    if (!OptVerboseAsm && Line == LastLine && F->FileNo == LastFileNo)
+    {
+        return;
+    }
+    LastLine = Line;
+    LastFileNo = F->FileNo;
     // .loc 文件编号 行号，关联具体的汇编代码和源码中的行号，便于调试器将汇编代码行与源码行对应起来。
-    writeln("  .loc 1 %d", node->Tok->lineNo);
+    writeln("  .loc %d %d", F->FileNo, Line);
+}
+
+static void genExpr(Node *node)
+{
+    emitLoc(node);
 
     switch (node->kind)
     {
@@ -251,7 +522,8 @@ static void genExpr(Node *node)
         genExpr(node->LHS);
         writeln("  # 对 a0 值进行取反\n");
         // neg a0, a0 是 sub a0, x0, a0 的别名，即 a0=0-a0
-        writeln("  neg%s a0, a0", node->type->size <= 4 ? "w" : "");
+        emit(asmInsn(node->type->size <= 4 ? AI_NEGW : AI_NEG, REG_A0, REG_A0, 0), "  neg%s a0, a0",
+             node->type->size <= 4 ? "w" : "");
         return;
         // 逗号
     case ND_COMMA:
@@ -267,7 +539,7 @@ static void genExpr(Node *node)
     case ND_NUM: // 是整型
         writeln("  # 将%d加载到 a0 中\n", node->Val);
         // li 为 addi 别名指令，加载一个立即数到寄存器中
-        writeln("  li a0, %ld\n", node->Val);
+        emit(asmInsn(AI_LI, REG_A0, 0, node->Val), "  li a0, %ld\n", node->Val);
         return;
     case ND_CAST: // 是类型转换
         genExpr(node->LHS);
@@ -292,11 +564,11 @@ static void genExpr(Node *node)
         // 反向弹栈，a0->参数 1，a1->参数 2……
         for (int i = argsCnt - 1; i >= 0; i--)
         {
-            pop(ArgReg[i]);
+            pop(i);
         }
 
         writeln("  # 调用%s函数\n", node->FuncName);
-        writeln("  call %s\n", node->FuncName); // 调用函数
+        emit(asmSymInsn(AI_CALL, 0, node->FuncName), "  call %s\n", node->FuncName); // 调用函数
         return;
     }
     default:
@@ -307,52 +579,53 @@ static void genExpr(Node *node)
     genExpr(node->RHS);
     push();
     genExpr(node->LHS);
-    pop("a1"); // 取回右子树结果
+    pop(1); // 取回右子树结果，存入 a1
 
-    char *Suffix = node->LHS->type->kind == TY_LONG || node->LHS->type->base ? "" : "w";
+    bool Is64 = node->LHS->type->kind == TY_LONG || node->LHS->type->base;
+    char *Suffix = Is64 ? "" : "w";
     switch (node->kind)
     {
     case ND_EQ:
         // xor a, b, c，将 b 异或 c 的结果放入 a
         // 如果相同，异或后，a0=0，否则 a0=1
-        writeln("  xor a0, a0, a1\n");
+        emit(asmInsn(AI_XOR, REG_A0, REG_A0, REG_A1), "  xor a0, a0, a1\n");
         // seqz a, b 判断 b 是否等于 0 并将结果放入 a
-        writeln("  seqz a0, a0\n");
+        emit(asmInsn(AI_SEQZ, REG_A0, REG_A0, 0), "  seqz a0, a0\n");
         return;
     case ND_NE:
         // a0=a0^a1，异或指令
         // 异或后如果相同，a0=1，否则 a0=0
         writeln("  # 判断是否 a0%sa1\n", node->kind == ND_EQ ? "=" : "≠");
-        writeln("  xor a0, a0, a1\n");
+        emit(asmInsn(AI_XOR, REG_A0, REG_A0, REG_A1), "  xor a0, a0, a1\n");
         // snez a, b 判断 b 是否不等于 0 并将结果放入 a
-        writeln("  snez a0, a0\n");
+        emit(asmInsn(AI_SNEZ, REG_A0, REG_A0, 0), "  snez a0, a0\n");
         return;
     case ND_LT:
         writeln("  # 判断 a0<a1\n");
         // slt a, b, c，将 b < c 的结果放入 a
-        writeln("  slt a0, a0, a1\n");
+        emit(asmInsn(AI_SLT, REG_A0, REG_A0, REG_A1), "  slt a0, a0, a1\n");
         return;
     case ND_LE:
         writeln("  # 判断是否 a0≤a1\n");
-        writeln("  slt a0, a1, a0\n");
+        emit(asmInsn(AI_SLT, REG_A0, REG_A1, REG_A0), "  slt a0, a1, a0\n");
         // xori a, b, (立即数)，将 b 异或 (立即数) 的结果放入 a
-        writeln("  xori a0, a0, 1\n");
+        emit(asmInsn(AI_XORI, REG_A0, REG_A0, 1), "  xori a0, a0, 1\n");
         return;
     case ND_ADD:
         writeln("  # a0+a1，结果写入 a0\n");
-        writeln("  add%s a0, a0, a1", Suffix);
+        emit(asmInsn(Is64 ? AI_ADD : AI_ADDW, REG_A0, REG_A0, REG_A1), "  add%s a0, a0, a1", Suffix);
         return;
     case ND_SUB:
         writeln("  # a0-a1，结果写入 a0\n");
-        writeln("  sub%s a0, a0, a1", Suffix);
+        emit(asmInsn(Is64 ? AI_SUB : AI_SUBW, REG_A0, REG_A0, REG_A1), "  sub%s a0, a0, a1", Suffix);
         return;
     case ND_MUL:
         writeln("  # a0*a1，结果写入 a0\n");
-        writeln("  mul%s a0, a0, a1", Suffix);
+        emit(asmInsn(Is64 ? AI_MUL : AI_MULW, REG_A0, REG_A0, REG_A1), "  mul%s a0, a0, a1", Suffix);
         return;
     case ND_DIV:
         writeln("  # a0/a1，结果写入a0\n");
-        writeln("  div%s a0, a0, a1", Suffix);
+        emit(asmInsn(Is64 ? AI_DIV : AI_DIVW, REG_A0, REG_A0, REG_A1), "  div%s a0, a0, a1", Suffix);
         return;
     default:
         errorTok(node->Tok, "invalid expression");
@@ -362,8 +635,7 @@ static void genExpr(Node *node)
 
 static void genStmt(Node *node)
 {
-    // .loc 文件编号 行号，关联具体的汇编代码和源码中的行号，便于调试器将汇编代码行与源码行对应起来。
-    writeln("  .loc 1 %d", node->Tok->lineNo);
+    emitLoc(node);
 
     switch (node->kind)
     {
@@ -377,23 +649,26 @@ static void genStmt(Node *node)
 
         writeln("\n# Cond 表达式%d\n", cnt);
         genExpr(node->Cond);
-        writeln("  # 若 a0 为 0，则跳转到分支%d的.L.else.%d段\n", cnt, cnt);
-        writeln("  beqz a0, .L.else.%d\n", cnt); // 判断条件是否不成立（a0=0），条件不成立跳转到 .L.else. 标签
+        writeln("  # 若 a0 为 0，则跳转到分支%d的.L.else.%s.%d段\n", cnt, CurrentFn->name, cnt);
+        // 判断条件是否不成立（a0=0），条件不成立跳转到 .L.else. 标签
+        emit(asmSymInsn(AI_BEQZ, REG_A0, labelName("else", cnt)), "  beqz a0, .L.else.%s.%d\n",
+             CurrentFn->name, cnt);
         writeln("\n# Then 语句%d\n", cnt);
         genStmt(node->Then); // 条件成立，执行 then 语句
-        writeln("  # 跳转到分支%d的.L.end.%d段\n", cnt, cnt);
-        writeln("j .L.end.%d\n", cnt); // 执行完 then 语句后跳转到 .L.end. 标签
+        writeln("  # 跳转到分支%d的.L.end.%s.%d段\n", cnt, CurrentFn->name, cnt);
+        // 执行完 then 语句后跳转到 .L.end. 标签
+        emit(asmSymInsn(AI_J, 0, labelName("end", cnt)), "j .L.end.%s.%d\n", CurrentFn->name, cnt);
 
         writeln("\n# Else 语句%d\n", cnt);
-        writeln("# 分支%d的.L.else.%d段标签\n", cnt, cnt);
-        writeln(".L.else.%d:\n", cnt); // else 标记
+        writeln("# 分支%d的.L.else.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+        emit(asmLabel(labelName("else", cnt)), ".L.else.%s.%d:\n", CurrentFn->name, cnt); // else 标记
         if (node->Else)                // 存在 else 语句
         {
             genStmt(node->Else);
         }
 
-        writeln("\n# 分支%d的.L.end.%d段标签\n", cnt, cnt);
-        writeln(".L.end.%d:\n", cnt); // if 语句结束
+        writeln("\n# 分支%d的.L.end.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+        emit(asmLabel(labelName("end", cnt)), ".L.end.%s.%d:\n", CurrentFn->name, cnt); // if 语句结束
         return;
     }
     case ND_FOR:
@@ -407,15 +682,16 @@ static void genStmt(Node *node)
             genStmt(node->Init); // 初始化语句
         }
 
-        writeln("\n# 循环%d的.L.begin.%d段标签\n", cnt, cnt);
-        writeln(".L.begin.%d:\n", cnt);
+        writeln("\n# 循环%d的.L.begin.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+        emit(asmLabel(labelName("begin", cnt)), ".L.begin.%s.%d:\n", CurrentFn->name, cnt);
 
         writeln("# Cond 表达式%d\n", cnt);
         if (node->Cond) // 存在条件语句
         {
             genExpr(node->Cond);
-            writeln("  # 若 a0 为 0，则跳转到循环%d的.L.end.%d段\n", cnt, cnt);
-            writeln(" beqz a0, .L.end.%d\n", cnt);
+            writeln("  # 若 a0 为 0，则跳转到循环%d的.L.end.%s.%d段\n", cnt, CurrentFn->name, cnt);
+            emit(asmSymInsn(AI_BEQZ, REG_A0, labelName("end", cnt)), " beqz a0, .L.end.%s.%d\n",
+                 CurrentFn->name, cnt);
         }
 
         writeln("\n# Then 语句%d\n", cnt);
@@ -427,10 +703,10 @@ static void genStmt(Node *node)
             genExpr(node->Inc);
         }
 
-        writeln("  # 跳转到循环%d的.L.begin.%d段\n", cnt, cnt);
-        writeln("  j .L.begin.%d\n", cnt);
-        writeln("\n# 循环%d的.L.end.%d段标签\n", cnt, cnt);
-        writeln(".L.end.%d:\n", cnt);
+        writeln("  # 跳转到循环%d的.L.begin.%s.%d段\n", cnt, CurrentFn->name, cnt);
+        emit(asmSymInsn(AI_J, 0, labelName("begin", cnt)), "  j .L.begin.%s.%d\n", CurrentFn->name, cnt);
+        writeln("\n# 循环%d的.L.end.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+        emit(asmLabel(labelName("end", cnt)), ".L.end.%s.%d:\n", CurrentFn->name, cnt);
         return;
     }
     case ND_RETURN:
@@ -439,7 +715,7 @@ static void genStmt(Node *node)
         writeln("  # 跳转到.L.return.%s段\n", CurrentFn->name);
         // 无条件跳转语句，跳转到.L.return 段
         // j offset 是 jal x0, offset 的别名指令
-        writeln("  j .L.return.%s\n", CurrentFn->name);
+        emit(asmSymInsn(AI_J, 0, labelName("return", -1)), "  j .L.return.%s\n", CurrentFn->name);
         return;
     case ND_BLOCK:
         for (Node *n = node->Body; n; n = n->next)
@@ -460,31 +736,36 @@ int alignTo(int N, int Align)
     return (N + Align - 1) / Align * Align;
 }
 
+// 为函数计算其变量所用的栈空间
+static void assignFnLVarOffsets(Obj *Fn)
+{
+    int offset = 0;
+    for (Obj *var = Fn->locals; var; var = var->next)
+    {
+        offset += var->type->size;
+        // 对齐变量
+        offset = alignTo(offset, var->type->align);
+        var->offset = -offset;
+    }
+    Fn->stackSize = alignTo(offset, 16); // 将栈对齐到 16 字节（内存对齐），优化处理器访问
+}
+
 static void assignLVarOffsets(Obj *fn)
 {
-    // 为每个函数计算其变量所用的栈空间
     for (Obj *Fn = fn; Fn; Fn = Fn->next)
     {
         if (!Fn->isFunction)
         {
             continue; // 不是函数，跳过
         }
-
-        int offset = 0;
-        for (Obj *var = Fn->locals; var; var = var->next)
-        {
-            offset += var->type->size;
-            // 对齐变量
-            offset = alignTo(offset, var->type->align);
-            var->offset = -offset;
-        }
-        Fn->stackSize = alignTo(offset, 16); // 将栈对齐到 16 字节（内存对齐），优化处理器访问
+        assignFnLVarOffsets(Fn);
     }
 }
 
 // 生成数据段（数据段是存储程序数据的内存区域，包括全局变量、静态变量、常量和程序中分配的其他数据结构。）
 static void emitData(Obj *Prog)
 {
+    beginSection();
     for (Obj *Var = Prog; Var; Var = Var->next)
     {
         if (Var->isFunction)
@@ -493,10 +774,15 @@ static void emitData(Obj *Prog)
         }
 
         writeln("  # 数据段标签\n");
-        writeln("  .data\n"); // 指示汇编器接下来的代码属于数据段
+        emit(asmData(), "  .data\n"); // 指示汇编器接下来的代码属于数据段
         if (Var->InitData)
         {
-            writeln("%s:\n", Var->name);
+            emit(asmLabel(Var->name), "%s:\n", Var->name);
+            if (Encode)
+            {
+                asmBytes(Var->InitData, Var->type->size);
+                continue;
+            }
             for (int i = 0; i < Var->type->size; i++)
             {
                 char ch = Var->InitData[i];
@@ -514,11 +800,11 @@ static void emitData(Obj *Prog)
         else
         {
             writeln("  # 全局段%s\n", Var->name);
-            writeln("  .globl %s\n", Var->name); // 指示汇编器 Var->name 指定的符号是全局的，可以在其他地方被访问
+            emit(asmGlobal(Var->name), "  .globl %s\n", Var->name); // 指示汇编器 Var->name 指定的符号是全局的，可以在其他地方被访问
             writeln("  # 全局变量%s\n", Var->name);
-            writeln("%s:\n", Var->name);
+            emit(asmLabel(Var->name), "%s:\n", Var->name);
             writeln("  # 全局变量零填充%d位\n", Var->type->size);
-            writeln("  .zero %d\n", Var->type->size); // 为全局变量 Var->Name 分配 Var->type->Size 字节的内存空间，并将其初始化为零
+            emit(asmBytes(NULL, Var->type->size), "  .zero %d\n", Var->type->size); // 为全局变量 Var->Name 分配 Var->type->Size 字节的内存空间，并将其初始化为零
         }
     }
 }
@@ -531,102 +817,314 @@ static void storeGeneral(int Reg, int offset, int size)
     switch (size)
     {
     case 1:
-        writeln("   sb %s, %d(fp)", ArgReg[Reg], offset);
+        emit(asmInsn(AI_SB, REG_A0 + Reg, REG_FP, offset), "   sb %s, %d(fp)", ArgReg[Reg], offset);
         return;
     case 2:
-        writeln("   sh %s, %d(fp)", ArgReg[Reg], offset);
+        emit(asmInsn(AI_SH, REG_A0 + Reg, REG_FP, offset), "   sh %s, %d(fp)", ArgReg[Reg], offset);
         return;
     case 4:
-        writeln("   sw %s, %d(fp)", ArgReg[Reg], offset);
+        emit(asmInsn(AI_SW, REG_A0 + Reg, REG_FP, offset), "   sw %s, %d(fp)", ArgReg[Reg], offset);
         return;
     case 8:
-        writeln("   sd %s, %d(fp)", ArgReg[Reg], offset);
+        emit(asmInsn(AI_SD, REG_A0 + Reg, REG_FP, offset), "   sd %s, %d(fp)", ArgReg[Reg], offset);
         return;
     }
     unreachable();
 }
 
-// 生成文本段（数据段）
-void emitText(Obj *Prog)
+// 生成一个函数的文本段
+static void genFunction(Obj *Fn)
 {
-    for (Obj *Fn = Prog; Fn; Fn = Fn->next)
+    beginSection();
+    writeln("\n  # 定义全局%s段\n", Fn->name);
+    emit(asmGlobal(Fn->name), "  .globl %s\n", Fn->name); // 指示汇编器 Fn->name 指定的符号是全局的，可以在其他地方被访问
+    writeln("  # 文本段标签\n");
+    emit(asmText(), "  .text\n"); // 指示汇编器接下来的代码属于程序的文本段
+    writeln("# =====%s段开始===============\n", Fn->name);
+    writeln("# %s段标签\n", Fn->name);
+    emit(asmLabel(Fn->name), "%s:\n", Fn->name);
+    CurrentFn = Fn;
+    LabelCnt = 0;
+    LastFileNo = 0;
+    LastLine = 0;
+
+    // 栈布局
+    //-------------------------------// sp(原)
+    //              ra
+    //-------------------------------// ra = sp(原)-8
+    //              fp
+    //-------------------------------// fp = sp(原)-16
+    //             变量
+    //-------------------------------// sp = sp(原)-16-StackSize
+    //           表达式计算
+    //-------------------------------//
+
+    // Prologue, 预处理
+    // 将 fp 压入栈中，保存 fp 的值
+    emit(asmInsn(AI_ADDI, REG_SP, REG_SP, -16), "  addi sp, sp, -16\n");
+    writeln("  # 将 ra 寄存器压栈，保存 ra 的值\n");
+    emit(asmInsn(AI_SD, REG_RA, REG_SP, 8), "  sd ra, 8(sp)\n");
+    writeln("  # 将 fp 压栈，fp 属于“被调用者保存”的寄存器，需要恢复原值\n");
+    emit(asmInsn(AI_SD, REG_FP, REG_SP, 0), "  sd fp, 0(sp)\n");
+    // mv a, b. 将寄存器 b 中的值存储到寄存器 a 中
+    writeln("  # 将 sp 的值写入 fp\n");
+    emit(asmInsn(AI_MV, REG_FP, REG_SP, 0), "  mv fp, sp\n"); // 将 sp 写入 fp
+    // 26 个字母*8 字节=208 字节，栈腾出 208 字节的空间
+    writeln("  # sp 腾出 StackSize 大小的栈空间\n");
+    emit(asmInsn(AI_ADDI, REG_SP, REG_SP, -Fn->stackSize), "  addi sp, sp, -%d\n", Fn->stackSize);
+
+    int cnt = 0;
+    for (Obj *Var = Fn->Params; Var; Var = Var->next)
+    {
+        storeGeneral(cnt++, Var->offset, Var->type->size);
+    }
+
+    // 生成语句链表的代码
+    writeln("# =====%s段主体===============\n", Fn->name);
+    genStmt(Fn->body);
+    assert(Depth == 0);
+
+    // Epilogue，后处理
+    writeln("# =====%s段结束===============\n", Fn->name);
+    writeln("# return 段标签\n");
+    emit(asmLabel(labelName("return", -1)), ".L.return.%s:\n", Fn->name); // 输出 return 段标签
+
+    writeln("  # 将 fp 的值写回 sp\n");
+    emit(asmInsn(AI_MV, REG_SP, REG_FP, 0), "  mv sp, fp\n");
+    writeln("  # 将最早 fp 保存的值弹栈，恢复 fp 和 sp\n");
+    emit(asmInsn(AI_LD, REG_FP, REG_SP, 0), "  ld fp, 0(sp)\n"); // 将栈顶元素（fp）弹出并存储到 fp
+    writeln("  # 将 ra 寄存器弹栈，恢复 ra 的值\n");
+    emit(asmInsn(AI_LD, REG_RA, REG_SP, 8), "  ld ra, 8(sp)\n");   // 将 ra 寄存器弹栈，恢复 ra 的值
+    emit(asmInsn(AI_ADDI, REG_SP, REG_SP, 16), "  addi sp, sp, 16\n"); // 移动 sp 到初始态，消除 fp 的影响
+
+    writeln("  # 返回 a0 值给系统调用\n");
+    emit(asmInsn(AI_RET, 0, 0, 0), "  ret\n");
+}
+
+// 生成一个函数的文本段，增量编译时复用或记录函数的代码
+static void emitFunction(Obj *Fn)
+{
+    if (!Fn->Rec)
+    {
+        genFunction(Fn);
+        return;
+    }
+
+    if (fnCacheHit(Fn->Rec))
+    {
+        size_t Len;
+        char *Text = fnCacheText(Fn->Rec, &Len);
+        emitStr(Text, Len);
+        return;
+    }
+
+    // 生成期间不写出缓冲区，使函数的代码完整地留在缓冲区中
+    FILE *Out = OutputFile;
+    OutputFile = NULL;
+    size_t Start = OutLen;
+    genFunction(Fn);
+    fnCacheStore(Fn->Rec, OutBuf + Start, OutLen - Start);
+    OutputFile = Out;
+}
+
+// 并行生成文本段时，所有线程共享的任务列表
+typedef struct
+{
+    Obj **Fns;       // 需要生成代码的函数，按输出的顺序排列
+    char **Bufs;     // 每个函数各自的代码缓冲区
+    size_t *Lens;    // 每个函数的代码长度
+    int Cnt;         // 函数的数量
+    atomic_int Next; // 下一个未被领取的函数
+    File **Files;    // 创建工作线程的线程的文件列表，用于查询行号
+    int FileCnt;
+    bool VerboseAsm; // 创建工作线程的线程的选项
+    bool DebugInfo;
+    DiagHandler *OnDiag; // 创建工作线程的线程接收错误信息的函数及其参数
+    void *DiagCtx;
+    atomic_int Status;   // 出错时为结束编译的状态加一，只记录第一个错误
+} TextJobs;
+
+// 工作线程不断领取下一个函数，将其代码生成到私有的缓冲区中。
+// 出错时记录结束编译的状态，并使其他线程不再领取新的函数，
+// 由创建工作线程的线程在所有线程结束后结束编译
+static void *textWorker(void *Arg)
+{
+    TextJobs *J = Arg;
+    OutputFile = NULL;
+    shareFiles(J->Files, J->FileCnt);
+    OptVerboseAsm = J->VerboseAsm;
+    OptDebugInfo = J->DebugInfo;
+    setDiagHandler(J->OnDiag, J->DiagCtx);
+
+    // 当前线程也作为工作线程之一，结束后恢复其跳转位置
+    jmp_buf *Outer = getErrorJmp();
+    jmp_buf Buf;
+    int R = setjmp(Buf);
+    if (R)
     {
-        if (!Fn->isFunction || !Fn->isDefinition)
+        int None = 0;
+        atomic_compare_exchange_strong(&J->Status, &None, R);
+        atomic_store(&J->Next, J->Cnt);
+        free(OutBuf);
+    }
+    else
+    {
+        setErrorJmp(&Buf);
+        for (int I; (I = atomic_fetch_add(&J->Next, 1)) < J->Cnt;)
         {
-            continue;
+            // 没有输出文件，代码积累在缓冲区中，由主线程按顺序写出
+            OutBuf = NULL;
+            OutLen = OutCap = 0;
+            emitFunction(J->Fns[I]);
+            J->Bufs[I] = OutBuf;
+            J->Lens[I] = OutLen;
         }
+    }
+    OutBuf = NULL;
+    OutLen = OutCap = 0;
+    setErrorJmp(Outer);
+    return NULL;
+}
 
-        writeln("\n  # 定义全局%s段\n", Fn->name);
-        writeln("  .globl %s\n", Fn->name); // 指示汇编器 Fn->name 指定的符号是全局的，可以在其他地方被访问
-        writeln("  # 文本段标签\n");
-        writeln("  .text\n"); // 指示汇编器接下来的代码属于程序的文本段
-        writeln("# =====%s段开始===============\n", Fn->name);
-        writeln("# %s段标签\n", Fn->name);
-        writeln("%s:\n", Fn->name);
-        CurrentFn = Fn;
-
-        // 栈布局
-        //-------------------------------// sp(原)
-        //              ra
-        //-------------------------------// ra = sp(原)-8
-        //              fp
-        //-------------------------------// fp = sp(原)-16
-        //             变量
-        //-------------------------------// sp = sp(原)-16-StackSize
-        //           表达式计算
-        //-------------------------------//
-
-        // Prologue, 预处理
-        // 将 fp 压入栈中，保存 fp 的值
-        writeln("  addi sp, sp, -16\n");
-        writeln("  # 将 ra 寄存器压栈，保存 ra 的值\n");
-        writeln("  sd ra, 8(sp)\n");
-        writeln("  # 将 fp 压栈，fp 属于“被调用者保存”的寄存器，需要恢复原值\n");
-        writeln("  sd fp, 0(sp)\n");
-        // mv a, b. 将寄存器 b 中的值存储到寄存器 a 中
-        writeln("  # 将 sp 的值写入 fp\n");
-        writeln("  mv fp, sp\n"); // 将 sp 写入 fp
-        // 26 个字母*8 字节=208 字节，栈腾出 208 字节的空间
-        writeln("  # sp 腾出 StackSize 大小的栈空间\n");
-        writeln("  addi sp, sp, -%d\n", Fn->stackSize);
-
-        int cnt = 0;
-        for (Obj *Var = Fn->Params; Var; Var = Var->next)
+// 生成文本段，Jobs 大于 1 时由多个线程并行生成各个函数，
+// 再按函数的顺序拼接，输出与串行生成时完全相同
+static void emitText(Obj *Prog, int Jobs)
+{
+    if (Jobs <= 1)
+    {
+        for (Obj *Fn = Prog; Fn; Fn = Fn->next)
         {
-            storeGeneral(cnt++, Var->offset, Var->type->size);
+            if (Fn->isFunction && Fn->isDefinition)
+            {
+                emitFunction(Fn);
+            }
         }
+        return;
+    }
 
-        // 生成语句链表的代码
-        writeln("# =====%s段主体===============\n", Fn->name);
-        genStmt(Fn->body);
-        assert(Depth == 0);
+    TextJobs J = {.VerboseAsm = OptVerboseAsm, .DebugInfo = OptDebugInfo};
+    J.Files = getFiles(&J.FileCnt);
+    J.OnDiag = getDiagHandler(&J.DiagCtx);
+    for (Obj *Fn = Prog; Fn; Fn = Fn->next)
+    {
+        if (Fn->isFunction && Fn->isDefinition)
+        {
+            J.Cnt++;
+        }
+    }
+    J.Fns = calloc(J.Cnt, sizeof(Obj *));
+    J.Bufs = calloc(J.Cnt, sizeof(char *));
+    J.Lens = calloc(J.Cnt, sizeof(size_t));
+    int I = 0;
+    for (Obj *Fn = Prog; Fn; Fn = Fn->next)
+    {
+        if (Fn->isFunction && Fn->isDefinition)
+        {
+            J.Fns[I++] = Fn;
+        }
+    }
 
-        // Epilogue，后处理
-        writeln("# =====%s段结束===============\n", Fn->name);
-        writeln("# return 段标签\n");
-        writeln(".L.return.%s:\n", Fn->name); // 输出 return 段标签
+    // 当前线程也作为工作线程之一，先写出其缓冲区中的数据段
+    flushOutput();
+    free(OutBuf);
+    FILE *Out = OutputFile;
+    // 线程数不超过函数的数量，无法创建更多的线程时，由已创建的线程完成所有的函数
+    if (Jobs > J.Cnt)
+    {
+        Jobs = J.Cnt > 1 ? J.Cnt : 1;
+    }
+    pthread_t Threads[Jobs];
+    int NThreads = 1;
+    while (NThreads < Jobs && !pthread_create(&Threads[NThreads], NULL, textWorker, &J))
+    {
+        NThreads++;
+    }
+    textWorker(&J);
+    // 出错时也要等待所有线程结束，它们仍在使用任务列表和语法树
+    for (int T = 1; T < NThreads; T++)
+    {
+        pthread_join(Threads[T], NULL);
+    }
+    OutputFile = Out;
 
-        writeln("  # 将 fp 的值写回 sp\n");
-        writeln("  mv sp, fp\n");
-        writeln("  # 将最早 fp 保存的值弹栈，恢复 fp 和 sp\n");
-        writeln("  ld fp, 0(sp)\n"); // 将栈顶元素（fp）弹出并存储到 fp
-        writeln("  # 将 ra 寄存器弹栈，恢复 ra 的值\n");
-        writeln("  ld ra, 8(sp)\n");    // 将 ra 寄存器弹栈，恢复 ra 的值
-        writeln("  addi sp, sp, 16\n"); // 移动 sp 到初始态，消除 fp 的影响
+    int Status = atomic_load(&J.Status);
+    for (int I = 0; I < J.Cnt; I++)
+    {
+        if (!Status)
+        {
+            writeOutput(J.Bufs[I], J.Lens[I]);
+        }
+        free(J.Bufs[I]);
+    }
+    free(J.Fns);
+    free(J.Bufs);
+    free(J.Lens);
 
-        writeln("  # 返回 a0 值给系统调用\n");
-        writeln("  ret\n");
+    // 错误信息已由出错的线程报告，在当前线程中结束编译
+    if (Status)
+    {
+        exitCompile(Status - 1);
     }
 }
 
-void codegen(Obj *Prog, FILE *Out)
+// 输出文件头
+// .file 文件编号 文件名，设置文件的编号和名称，供后续 .loc 指令引用。
+// 包括预处理时读入的所有头文件，宏拼接产生的临时文本没有编号
+static void emitFiles(void)
+{
+    if (!OptDebugInfo || OptC)
+    {
+        return;
+    }
+    for (File **F = getInputFiles(); *F; F++)
+    {
+        if ((*F)->FileNo)
+        {
+            writeln(".file %d \"%s\"\n", (*F)->FileNo, (*F)->Name);
+        }
+    }
+}
+
+// 设置流式代码生成的输出文件
+void codegenBegin(FILE *Out)
+{
+    OutputFile = Out;
+    emitFiles();
+}
+
+// 流式生成一个刚解析完成的函数
+void codegenFunction(Obj *Fn)
+{
+    assignFnLVarOffsets(Fn);
+    emitFunction(Fn);
+}
+
+// 流式生成的最后，生成全局变量和字符串字面量的数据段
+void codegenEnd(Obj *Prog)
+{
+    emitData(Prog);
+    finishOutput();
+}
+
+void codegen(Obj *Prog, FILE *Out, int Jobs)
 {
     // 设置目标文件的文件流指针
     OutputFile = Out;
+    emitFiles();
     // 计算变量的偏移量
     assignLVarOffsets(Prog);
     // 生成数据段
     emitData(Prog);
     // 生成文本段
-    emitText(Prog);
-}
\ No newline at end of file
+    emitText(Prog, Jobs);
+    finishOutput();
+}
+// 清除代码生成的状态，出错中断时缓冲区中可能留有未写出的代码
+void codegenReset(void)
+{
+    OutputFile = NULL;
+    OutLen = 0;
+    Depth = 0;
+    CurrentFn = NULL;
+    Encode = false;
+}
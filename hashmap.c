@@ -0,0 +1,299 @@
+#include "rvcc.h"
+
+//
+// 哈希表
+//
+// 开放定址法（线性探测）实现的哈希表，键为字符串，值为任意指针。
+//
+
+// 初始的桶数量，桶数量始终为 2 的幂，以便用位与代替取模
+#define INIT_SIZE 16
+// 装载因子超过该百分比后扩容
+#define HIGH_WATERMARK 70
+// 扩容（重新散列）后的装载因子百分比
+#define LOW_WATERMARK 50
+
+// 被删除的键值对的标记
+#define TOMBSTONE ((void *)-1)
+// 以指针为键时，键值对中记录的键长
+#define PTR_KEY -1
+
+// FNV-1a 哈希函数
+static uint64_t fnvHash(char *S, int Len)
+{
+    uint64_t Hash = 0xcbf29ce484222325;
+    for (int I = 0; I < Len; I++)
+    {
+        Hash ^= (unsigned char)S[I];
+        Hash *= 0x100000001b3;
+    }
+    return Hash;
+}
+
+// 指针的哈希函数（取自 MurmurHash3 的混合步骤）
+static uint64_t ptrHash(void *P)
+{
+    uint64_t Hash = (uintptr_t)P;
+    Hash ^= Hash >> 33;
+    Hash *= 0xff51afd7ed558ccd;
+    Hash ^= Hash >> 33;
+    return Hash;
+}
+
+// 重新散列，将所有的键值对迁移到新的桶数组中
+static void rehash(HashMap *Map)
+{
+    // 计算新的桶数量
+    int NKeys = 0;
+    for (int I = 0; I < Map->Capacity; I++)
+    {
+        if (Map->Buckets[I].Key && Map->Buckets[I].Key != TOMBSTONE)
+        {
+            NKeys++;
+        }
+    }
+
+    int Cap = Map->Capacity;
+    while ((NKeys * 100) / Cap >= LOW_WATERMARK)
+    {
+        Cap = Cap * 2;
+    }
+    assert(Cap > 0);
+
+    // 迁移所有的键值对
+    HashMap Map2 = {};
+    Map2.Buckets = calloc(Cap, sizeof(HashEntry));
+    Map2.Capacity = Cap;
+
+    for (int I = 0; I < Map->Capacity; I++)
+    {
+        HashEntry *Ent = &Map->Buckets[I];
+        if (Ent->Key && Ent->Key != TOMBSTONE)
+        {
+            if (Ent->KeyLen == PTR_KEY)
+            {
+                hashmapPutPtr(&Map2, Ent->Key, Ent->Val);
+            }
+            else
+            {
+                hashmapPut2(&Map2, Ent->Key, Ent->KeyLen, Ent->Val);
+            }
+        }
+    }
+
+    assert(Map2.Used == NKeys);
+    free(Map->Buckets);
+    *Map = Map2;
+}
+
+// 判断键值对的键是否与 Key 相同
+static bool match(HashEntry *Ent, char *Key, int KeyLen)
+{
+    return Ent->Key && Ent->Key != TOMBSTONE && Ent->KeyLen == KeyLen &&
+           memcmp(Ent->Key, Key, KeyLen) == 0;
+}
+
+// 查找键对应的键值对
+static HashEntry *getEntry(HashMap *Map, char *Key, int KeyLen)
+{
+    if (!Map->Buckets)
+    {
+        return NULL;
+    }
+
+    uint64_t Hash = fnvHash(Key, KeyLen);
+
+    for (int I = 0; I < Map->Capacity; I++)
+    {
+        HashEntry *Ent = &Map->Buckets[(Hash + I) & (Map->Capacity - 1)];
+        if (match(Ent, Key, KeyLen))
+        {
+            return Ent;
+        }
+        // 遇到空桶说明键不存在
+        if (Ent->Key == NULL)
+        {
+            return NULL;
+        }
+    }
+    unreachable();
+    return NULL;
+}
+
+// 以指针为键查找键值对
+static HashEntry *getPtrEntry(HashMap *Map, void *Key)
+{
+    if (!Map->Buckets || !Key)
+    {
+        return NULL;
+    }
+
+    uint64_t Hash = ptrHash(Key);
+
+    for (int I = 0; I < Map->Capacity; I++)
+    {
+        HashEntry *Ent = &Map->Buckets[(Hash + I) & (Map->Capacity - 1)];
+        if (Ent->Key == Key)
+        {
+            return Ent;
+        }
+        if (Ent->Key == NULL)
+        {
+            return NULL;
+        }
+    }
+    unreachable();
+    return NULL;
+}
+
+// 在必要时分配或扩容桶数组
+static void reserve(HashMap *Map)
+{
+    if (!Map->Buckets)
+    {
+        Map->Buckets = calloc(INIT_SIZE, sizeof(HashEntry));
+        Map->Capacity = INIT_SIZE;
+    }
+    else if ((Map->Used * 100) / Map->Capacity >= HIGH_WATERMARK)
+    {
+        rehash(Map);
+    }
+}
+
+// 在哈希值对应的探测链上找到第一个可用的桶，并写入键
+static HashEntry *insertEntry(HashMap *Map, uint64_t Hash, char *Key, int KeyLen)
+{
+    for (int I = 0; I < Map->Capacity; I++)
+    {
+        HashEntry *Ent = &Map->Buckets[(Hash + I) & (Map->Capacity - 1)];
+
+        // 复用被删除的桶
+        if (Ent->Key == TOMBSTONE)
+        {
+            Ent->Key = Key;
+            Ent->KeyLen = KeyLen;
+            return Ent;
+        }
+
+        if (Ent->Key == NULL)
+        {
+            Ent->Key = Key;
+            Ent->KeyLen = KeyLen;
+            Map->Used++;
+            return Ent;
+        }
+    }
+    unreachable();
+    return NULL;
+}
+
+// 查找或插入键对应的键值对
+static HashEntry *getOrInsertEntry(HashMap *Map, char *Key, int KeyLen)
+{
+    reserve(Map);
+
+    // 键已存在时直接返回，避免在探测链前部的墓碑处插入重复的键
+    HashEntry *Ent = getEntry(Map, Key, KeyLen);
+    if (Ent)
+    {
+        return Ent;
+    }
+    return insertEntry(Map, fnvHash(Key, KeyLen), Key, KeyLen);
+}
+
+// 以指针为键查找或插入键值对
+static HashEntry *getOrInsertPtrEntry(HashMap *Map, void *Key)
+{
+    reserve(Map);
+
+    HashEntry *Ent = getPtrEntry(Map, Key);
+    if (Ent)
+    {
+        return Ent;
+    }
+    return insertEntry(Map, ptrHash(Key), Key, PTR_KEY);
+}
+
+// 获取键对应的值，不存在时返回 NULL
+void *hashmapGet(HashMap *Map, char *Key)
+{
+    return hashmapGet2(Map, Key, strlen(Key));
+}
+
+void *hashmapGet2(HashMap *Map, char *Key, int KeyLen)
+{
+    HashEntry *Ent = getEntry(Map, Key, KeyLen);
+    return Ent ? Ent->Val : NULL;
+}
+
+// 设置键对应的值，Key 指向的内存需要在哈希表的生命周期内有效
+void hashmapPut(HashMap *Map, char *Key, void *Val)
+{
+    hashmapPut2(Map, Key, strlen(Key), Val);
+}
+
+void hashmapPut2(HashMap *Map, char *Key, int KeyLen, void *Val)
+{
+    HashEntry *Ent = getOrInsertEntry(Map, Key, KeyLen);
+    Ent->Val = Val;
+}
+
+// 删除键值对
+void hashmapDelete(HashMap *Map, char *Key)
+{
+    hashmapDelete2(Map, Key, strlen(Key));
+}
+
+void hashmapDelete2(HashMap *Map, char *Key, int KeyLen)
+{
+    HashEntry *Ent = getEntry(Map, Key, KeyLen);
+    if (Ent)
+    {
+        Ent->Key = TOMBSTONE;
+    }
+}
+
+// 遍历哈希表，返回下标 *Iter 及之后的第一个键值对，并将 *Iter 移到其后，
+// 没有更多的键值对时返回 NULL。*Iter 初始为 0
+HashEntry *hashmapNext(HashMap *Map, int *Iter)
+{
+    for (; *Iter < Map->Capacity; (*Iter)++)
+    {
+        HashEntry *Ent = &Map->Buckets[*Iter];
+        if (Ent->Key && Ent->Key != TOMBSTONE)
+        {
+            (*Iter)++;
+            return Ent;
+        }
+    }
+    return NULL;
+}
+
+// 释放哈希表的桶数组
+void hashmapFree(HashMap *Map)
+{
+    free(Map->Buckets);
+    *Map = (HashMap){};
+}
+
+// 以指针为键（如驻留的字符串）的哈希表，只比较指针，不比较内容
+void *hashmapGetPtr(HashMap *Map, void *Key)
+{
+    HashEntry *Ent = getPtrEntry(Map, Key);
+    return Ent ? Ent->Val : NULL;
+}
+
+void hashmapPutPtr(HashMap *Map, void *Key, void *Val)
+{
+    HashEntry *Ent = getOrInsertPtrEntry(Map, Key);
+    Ent->Val = Val;
+}
+
+void hashmapDeletePtr(HashMap *Map, void *Key)
+{
+    HashEntry *Ent = getPtrEntry(Map, Key);
+    if (Ent)
+    {
+        Ent->Key = TOMBSTONE;
+    }
+}
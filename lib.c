@@ -0,0 +1,224 @@
+#include "rvcc.h"
+#include "librvcc.h"
+
+#include <pthread.h>
+
+//
+// librvcc：在进程内编译内存中的源代码
+//
+// 编译器各个模块的状态都属于正在编译的线程，相当于每个线程各有一个编译器实例。
+// 上下文只保存选项和结果，编译时交给调用的线程，编译结束后重置该线程的状态，
+// 出错时从 exitCompile 跳转回来，错误信息记录在上下文的诊断信息中
+//
+
+struct RvccContext
+{
+    // 编译选项
+    bool Object;
+    bool VerboseAsm;
+    bool DebugInfo;
+    int Jobs;
+    // #include 搜索的目录
+    char **IncludePaths;
+    int IncludePathCnt;
+
+    // 最近一次编译的输入文件名、输出和诊断信息
+    char *Name;
+    char *Out;
+    size_t OutLen;
+    RvccDiag *Diags;
+    RvccDiag **DiagEnd;
+    // 并行生成代码的线程可能同时报告错误
+    pthread_mutex_t DiagLock;
+};
+
+// 线程退出时释放其内存池
+static pthread_key_t ThreadKey;
+static pthread_once_t ThreadKeyOnce = PTHREAD_ONCE_INIT;
+
+// 丢弃本次编译的状态和内存池，缓存的头文件和驻留的名称跨编译保留
+void resetCompiler(void)
+{
+    cacheReset();
+    tokenizeReset();
+    preprocessReset();
+    typeReset();
+    parseReset();
+    codegenReset();
+    asmReset();
+    for (int K = 0; K < AK_COUNT; K++)
+    {
+        if (K != AK_HEADER && K != AK_PERM)
+        {
+            arenaReset(K);
+        }
+    }
+}
+
+// 编译过的线程退出时，释放其所有的内存池
+static void releaseThread(void *Arg)
+{
+    arenaFreeAll();
+}
+
+static void createThreadKey(void)
+{
+    pthread_key_create(&ThreadKey, releaseThread);
+}
+
+// 将错误信息记录到上下文 Ctx 的诊断信息中
+static void addDiag(void *Ctx, char *File, int Line, int Col, char *Msg)
+{
+    RvccContext *C = Ctx;
+    RvccDiag *D = calloc(1, sizeof(RvccDiag));
+    D->File = File ? strdup(File) : NULL;
+    D->Line = Line;
+    D->Col = Col;
+    D->Msg = Msg;
+    pthread_mutex_lock(&C->DiagLock);
+    *C->DiagEnd = D;
+    C->DiagEnd = &D->Next;
+    pthread_mutex_unlock(&C->DiagLock);
+}
+
+// 释放上一次编译的结果
+static void freeResult(RvccContext *C)
+{
+    for (RvccDiag *D = C->Diags; D;)
+    {
+        RvccDiag *Next = D->Next;
+        free(D->File);
+        free(D->Msg);
+        free(D);
+        D = Next;
+    }
+    C->Diags = NULL;
+    C->DiagEnd = &C->Diags;
+    free(C->Out);
+    C->Out = NULL;
+    C->OutLen = 0;
+    free(C->Name);
+    C->Name = NULL;
+}
+
+RvccContext *rvccCreate(void)
+{
+    RvccContext *C = calloc(1, sizeof(RvccContext));
+    C->DebugInfo = true;
+    C->Jobs = 1;
+    C->DiagEnd = &C->Diags;
+    pthread_mutex_init(&C->DiagLock, NULL);
+    return C;
+}
+
+void rvccDestroy(RvccContext *C)
+{
+    if (!C)
+    {
+        return;
+    }
+    freeResult(C);
+    for (int I = 0; I < C->IncludePathCnt; I++)
+    {
+        free(C->IncludePaths[I]);
+    }
+    free(C->IncludePaths);
+    pthread_mutex_destroy(&C->DiagLock);
+    free(C);
+}
+
+void rvccSetOption(RvccContext *C, RvccOption Opt, int Val)
+{
+    switch (Opt)
+    {
+    case RVCC_OPT_OBJECT:
+        C->Object = Val;
+        return;
+    case RVCC_OPT_VERBOSE_ASM:
+        C->VerboseAsm = Val;
+        return;
+    case RVCC_OPT_DEBUG_INFO:
+        C->DebugInfo = Val;
+        return;
+    case RVCC_OPT_JOBS:
+        C->Jobs = Val < 1 ? 1 : Val;
+        return;
+    }
+}
+
+void rvccAddIncludePath(RvccContext *C, const char *Dir)
+{
+    C->IncludePaths = realloc(C->IncludePaths, sizeof(char *) * (C->IncludePathCnt + 1));
+    C->IncludePaths[C->IncludePathCnt++] = strdup(Dir);
+}
+
+// 在当前线程中编译，出错时不返回
+static void compile(RvccContext *C, const char *Src, size_t Len, FILE *Out)
+{
+    OptC = C->Object;
+    OptVerboseAsm = C->VerboseAsm;
+    OptDebugInfo = C->DebugInfo;
+    for (int I = 0; I < C->IncludePathCnt; I++)
+    {
+        addIncludePath(C->IncludePaths[I]);
+    }
+
+    // 源代码只被读取，不需要复制
+    Token *Tok = tokenizeBuffer(C->Name, (char *)Src, Len, C->Jobs);
+    Tok = preprocess(Tok);
+    Obj *Prog = parse(Tok, NULL);
+    codegen(Prog, Out, C->Jobs);
+}
+
+int rvccCompile(RvccContext *C, const char *Name, const char *Src, size_t Len, char **Out,
+                size_t *OutLen)
+{
+    pthread_once(&ThreadKeyOnce, createThreadKey);
+    if (!pthread_getspecific(ThreadKey))
+    {
+        pthread_setspecific(ThreadKey, C);
+    }
+
+    freeResult(C);
+    C->Name = strdup(Name);
+    FILE *F = open_memstream(&C->Out, &C->OutLen);
+
+    setDiagHandler(addDiag, C);
+    jmp_buf Buf;
+    int Status = setjmp(Buf);
+    if (!Status)
+    {
+        setErrorJmp(&Buf);
+        compile(C, Src, Len, F);
+    }
+    else
+    {
+        Status -= 1;
+    }
+    setErrorJmp(NULL);
+    setDiagHandler(NULL, NULL);
+
+    fclose(F);
+    resetCompiler();
+    if (Status)
+    {
+        // 出错时丢弃不完整的输出
+        free(C->Out);
+        C->Out = NULL;
+        C->OutLen = 0;
+    }
+    if (Out)
+    {
+        *Out = C->Out;
+    }
+    if (OutLen)
+    {
+        *OutLen = C->OutLen;
+    }
+    return Status;
+}
+
+RvccDiag *rvccGetDiags(RvccContext *C)
+{
+    return C->Diags;
+}
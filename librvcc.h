@@ -0,0 +1,54 @@
+#ifndef LIBRVCC_H
+#define LIBRVCC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+//
+// librvcc：在进程内将源代码编译为内存中的汇编代码或目标文件
+//
+// 编译器的状态属于调用编译的线程，多个线程可以同时使用各自的上下文进行编译，
+// 同一个上下文不能同时在多个线程中使用。同一线程的多次编译之间保留读入的头文件，
+// 头文件变化后自动重新读入
+//
+
+// 诊断信息
+typedef struct RvccDiag RvccDiag;
+struct RvccDiag
+{
+    RvccDiag *Next;
+    char *File; // 出错的文件，没有位置时为 NULL
+    int Line;   // 行号，从 1 开始
+    int Col;    // 列号，从 1 开始
+    char *Msg;  // 错误信息
+};
+
+// 编译选项
+typedef enum
+{
+    RVCC_OPT_OBJECT,      // 是否输出 ELF 可重定位文件，默认输出汇编代码
+    RVCC_OPT_VERBOSE_ASM, // 是否输出解释每条指令的注释，默认不输出
+    RVCC_OPT_DEBUG_INFO,  // 是否输出行号信息，默认输出
+    RVCC_OPT_JOBS,        // 并行词法分析和生成代码的线程数，默认为 1
+} RvccOption;
+
+// 编译上下文，保存选项、#include 搜索的目录、最近一次编译的输出和诊断信息
+typedef struct RvccContext RvccContext;
+
+// 创建和销毁编译上下文
+RvccContext *rvccCreate(void);
+void rvccDestroy(RvccContext *C);
+// 设置编译选项
+void rvccSetOption(RvccContext *C, RvccOption Opt, int Val);
+// 添加 #include 搜索的目录
+void rvccAddIncludePath(RvccContext *C, const char *Dir);
+
+// 编译名为 Name 的源代码 Src，成功时返回 0，通过 Out 和 OutLen 返回输出，
+// 出错时返回非 0，错误通过 rvccGetDiags 获取。
+// 输出和诊断信息属于上下文，在下一次编译或销毁上下文之前有效
+int rvccCompile(RvccContext *C, const char *Name, const char *Src, size_t Len, char **Out,
+                size_t *OutLen);
+// 获取最近一次编译的诊断信息，没有时返回 NULL
+RvccDiag *rvccGetDiags(RvccContext *C);
+
+#endif
@@ -1,20 +1,89 @@
 #include "rvcc.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+
 //
 // 语义分析与代码生成
 //
 
 // 目标文件的路径
 static char *OptO;
+// 输出目录，各个输入文件的结果写入其中与输入文件同名的文件
+static char *OptOutputDir;
+// 所有输入文件的路径
+static char **InputPaths;
+static int InputCnt;
+// #include 搜索的目录，每次编译前加入预处理器
+static char **IncludeDirs;
+static int IncludeDirCnt;
+// 是否输出内存池的统计信息
+static bool OptMemReport;
+// 是否逐个函数地解析并生成代码
+static bool OptStream;
+// 并行编译的线程数：多个输入文件时为同时编译的文件数，
+// 单个输入文件时为并行词法分析和生成代码的线程数
+static int OptJobs;
+// 是否将输入中的声明保存为声明快照
+static bool OptEmitSnapshot;
+// 编译前载入的声明快照的路径
+static char *OptIncludeSnapshot;
+// 编译缓存的目录
+static char *OptCacheDir;
+// 编译缓存的大小上限
+static size_t OptCacheSize;
+// 是否输出编译缓存的统计信息
+static bool OptCacheStats;
+
+// 以下状态属于正在编译的输入文件，多个输入文件时每个编译线程各有一份
 // 输入文件的路径
-static char *InputPath;
+static _Thread_local char *InputPath;
+// 本次编译查找缓存的结果
+static _Thread_local CacheResult Cache;
+// 未命中缓存时写入编译结果的临时文件
+static _Thread_local FILE *CacheTmp;
+// 本次编译打开的输出文件
+static _Thread_local FILE *Output;
+
+// 关闭上次编译出错中断时没有关闭的文件
+static void closeLeftovers(void)
+{
+  if (CacheTmp)
+    fclose(CacheTmp);
+  if (Output)
+    fclose(Output);
+  CacheTmp = NULL;
+  Output = NULL;
+}
+
+// 恢复各个选项的默认值，服务器模式下每个请求都重新解析参数
+static void resetOptions(void)
+{
+  OptO = NULL;
+  OptOutputDir = NULL;
+  InputCnt = 0;
+  IncludeDirCnt = 0;
+  OptMemReport = false;
+  OptStream = false;
+  OptJobs = 1;
+  OptEmitSnapshot = false;
+  OptIncludeSnapshot = NULL;
+  OptCacheDir = NULL;
+  OptCacheSize = (size_t)1 << 30;
+  OptCacheStats = false;
+  OptVerboseAsm = false;
+  OptDebugInfo = true;
+  OptC = false;
+  closeLeftovers();
+}
 
 // 输出程序的使用说明
 static void usage(int Status)
 {
-  fprintf(stderr, "rvcc [ -o <path> ] <file>\n");
+  fprintf(stderr, "rvcc [ -o <path> | -output-dir <dir> ] [ -fmem-report ] [ -fstream ] [ -j <n> ] [ -fverbose-asm ] [ -g0 ] [ -c ] [ -I <dir> ] [ -emit-snapshot ] [ -include-snapshot <file> ] [ -fcache-dir=<dir> ] [ -fcache-size=<n>[KMG] ] [ -fcache-stats ] <file>...\n");
+  fprintf(stderr, "rvcc --server[=<socket>] [ --server-workers=<n> ]\n");
 
-  exit(Status);
+  exitCompile(Status);
 }
 
 // 解析传入程序的参数
@@ -26,6 +95,19 @@ static void parseArgs(int Argc, char **Argv)
     // 如果存在 help，则直接显示用法说明
     if (!strcmp(Argv[i], "--help"))
       usage(0);
+
+    // 解析-output-dir <dir>，每个输入文件的结果写入 dir 中与其同名、
+    // 扩展名为 .s（-c 时为 .o，-emit-snapshot 时为 .snap）的文件
+    if (!strcmp(Argv[i], "-output-dir"))
+    {
+      if (!Argv[++i])
+      {
+        usage(1);
+      }
+      OptOutputDir = Argv[i];
+      continue;
+    }
+
     // 解析-o XXX 的参数
     if (!strcmp(Argv[i], "-o"))
     {
@@ -48,6 +130,129 @@ static void parseArgs(int Argc, char **Argv)
       continue;
     }
 
+    // 解析-fmem-report，编译结束后输出内存池的统计信息
+    if (!strcmp(Argv[i], "-fmem-report"))
+    {
+      OptMemReport = true;
+      continue;
+    }
+
+    // 解析-j N 和-jN，多个输入文件时用 N 个线程同时编译 N 个文件，
+    // 单个输入文件时用 N 个线程并行进行词法分析和生成各个函数的代码
+    if (!strncmp(Argv[i], "-j", 2))
+    {
+      char *Arg = Argv[i][2] ? Argv[i] + 2 : Argv[++i];
+      if (!Arg)
+      {
+        usage(1);
+      }
+      OptJobs = atoi(Arg);
+      if (OptJobs < 1)
+      {
+        error("invalid number of jobs: %s", Arg);
+      }
+      continue;
+    }
+
+    // 解析-fstream，每个函数解析完成后立即生成代码并释放其语法树，
+    // 函数按声明顺序输出，全局变量和字符串字面量在最后输出。
+    // 整个输入的终结符数组仍然常驻到编译结束（类型和全局变量引用其中的终结符），
+    // 峰值内存只省去了语法树，仍随输入的大小增长
+    if (!strcmp(Argv[i], "-fstream"))
+    {
+      OptStream = true;
+      continue;
+    }
+
+    // 解析-c，由内置的汇编器直接输出 ELF 可重定位文件
+    if (!strcmp(Argv[i], "-c"))
+    {
+      OptC = true;
+      continue;
+    }
+
+    // 解析-fverbose-asm，输出解释每条指令的注释，并在每个语法树节点处输出 .loc
+    if (!strcmp(Argv[i], "-fverbose-asm"))
+    {
+      OptVerboseAsm = true;
+      continue;
+    }
+
+    // 解析-g0 和-g，是否输出源码的行号信息
+    if (!strcmp(Argv[i], "-g0"))
+    {
+      OptDebugInfo = false;
+      continue;
+    }
+    if (!strcmp(Argv[i], "-g"))
+    {
+      OptDebugInfo = true;
+      continue;
+    }
+
+    // 解析-I <dir> 和-I<dir>，添加 #include 搜索的目录
+    if (!strncmp(Argv[i], "-I", 2))
+    {
+      char *Arg = Argv[i][2] ? Argv[i] + 2 : Argv[++i];
+      if (!Arg)
+      {
+        usage(1);
+      }
+      IncludeDirs = realloc(IncludeDirs, sizeof(char *) * (IncludeDirCnt + 1));
+      IncludeDirs[IncludeDirCnt++] = Arg;
+      continue;
+    }
+
+    // 解析-emit-snapshot，将输入中的声明和宏保存为声明快照，而不生成代码
+    if (!strcmp(Argv[i], "-emit-snapshot"))
+    {
+      OptEmitSnapshot = true;
+      continue;
+    }
+
+    // 解析-include-snapshot <file>，编译前载入声明快照，代替对公共头文件的分析
+    if (!strcmp(Argv[i], "-include-snapshot"))
+    {
+      if (!Argv[++i])
+      {
+        usage(1);
+      }
+      OptIncludeSnapshot = Argv[i];
+      continue;
+    }
+
+    // 解析-fcache-dir=<dir>，将编译结果保存到缓存目录中，相同的输入直接使用缓存的结果
+    if (!strncmp(Argv[i], "-fcache-dir=", 12))
+    {
+      OptCacheDir = Argv[i] + 12;
+      continue;
+    }
+
+    // 解析-fcache-size=<n>[KMG]，缓存超过此大小时删除最久未使用的结果
+    if (!strncmp(Argv[i], "-fcache-size=", 13))
+    {
+      char *End;
+      OptCacheSize = strtoull(Argv[i] + 13, &End, 10);
+      if (*End == 'K' || *End == 'k')
+        OptCacheSize <<= 10, End++;
+      else if (*End == 'M' || *End == 'm')
+        OptCacheSize <<= 20, End++;
+      else if (*End == 'G' || *End == 'g')
+        OptCacheSize <<= 30, End++;
+      if (End == Argv[i] + 13 || *End)
+      {
+        error("invalid cache size: %s", Argv[i] + 13);
+      }
+      continue;
+    }
+
+    // 解析-fcache-stats，输出缓存的命中统计信息，没有输入文件时只输出统计信息
+    if (!strcmp(Argv[i], "-fcache-stats"))
+    {
+      OptCacheStats = true;
+      continue;
+    }
+
     // 解析为 - 的参数
     if (Argv[i][0] == '-' && Argv[i][1] != '\0')
     {
@@ -55,14 +260,37 @@ static void parseArgs(int Argc, char **Argv)
     }
 
     // 其他情况则匹配为输入文件
-    InputPath = Argv[i];
+    InputPaths = realloc(InputPaths, sizeof(char *) * (InputCnt + 1));
+    InputPaths[InputCnt++] = Argv[i];
+  }
+
+  if (OptCacheStats && !OptCacheDir)
+  {
+    error("-fcache-stats requires -fcache-dir");
   }
 
   // 不存在输入文件时报错
-  if (!InputPath)
+  if (!InputCnt && !OptCacheStats)
   {
     error("no input files");
   }
+
+  if (OptO && OptOutputDir)
+  {
+    error("cannot specify both -o and -output-dir");
+  }
+
+  // 多个输入文件时，各自的输出路径由输出目录或输入文件名得出
+  if (InputCnt > 1)
+  {
+    if (OptO)
+    {
+      error("cannot specify -o with multiple input files");
+    }
+    for (int i = 0; i < InputCnt; i++)
+      if (!strcmp(InputPaths[i], "-"))
+        error("cannot read standard input with multiple input files");
+  }
 }
 
 // 打开需要写入的文件
@@ -80,26 +308,263 @@ static FILE *openFile(char *Path)
   {
     error("cannot open output file: %s: %s", Path, strerror(errno));
   }
-  return Out;
+  return Output = Out;
 }
 
-int main(int Argc, char **Argv)
+// 关闭输出文件，写出缓冲区中的内容
+static void closeOutput(void)
+{
+  FILE *Out = Output ? Output : stdout;
+  Output = NULL;
+  if (fflush(Out) || ferror(Out) || (Out != stdout && fclose(Out)))
+  {
+    error("cannot write output: %s", strerror(errno));
+  }
+}
+
+// 打开输出文件
+static FILE *openOutput(char *Path)
 {
+  // 未命中缓存时先写入临时文件，完成后放入缓存
+  return Cache == CACHE_MISS ? (CacheTmp = cacheCreate()) : openFile(Path);
+}
+
+// 影响编译结果的选项，参与计算缓存的哈希值。
+// 只有输出行号信息时，输入文件的路径才会出现在汇编代码中
+static char *cacheOptions(void)
+{
+  return format("c=%d verbose-asm=%d g=%d stream=%d file=%s", OptC, OptVerboseAsm,
+                OptDebugInfo, OptStream, OptDebugInfo && !OptC ? InputPath : "");
+}
+
+// 编译输入文件，Jobs 为并行词法分析和生成代码的线程数
+static void compile(char *Buf, size_t Len, char *OutPath, int Jobs)
+{
+  // 载入声明快照，恢复公共头文件中的声明和宏
+  if (OptIncludeSnapshot)
+    loadSnapshot(OptIncludeSnapshot);
+
+  // 解析文件，生成终结符流
+  Token *Tok = tokenizeBuffer(InputPath, Buf, Len, Jobs);
+  // 预处理，展开宏并处理 #include 等指令
+  Tok = preprocess(Tok);
+
+  if (OptEmitSnapshot)
+  {
+    // 只解析声明，保存全局域的状态。解析成功后才打开输出文件，
+    // 出错时不会留下空的声明快照
+    Obj *Prog = parse(Tok, NULL);
+    writeSnapshot(Prog, openFile(OutPath));
+  }
+  else if (OptStream)
+  {
+    // 边解析边生成代码
+    codegenBegin(openOutput(OutPath));
+    Obj *Prog = parse(Tok, codegenFunction);
+    codegenEnd(Prog);
+  }
+  else
+  {
+    // 解析终结符流
+    Obj *Prog = parse(Tok, NULL);
+    // 生成代码
+    codegen(Prog, openOutput(OutPath), Jobs);
+  }
+}
+
+// 编译一个输入文件，将结果写入 OutPath，为 NULL 或"-"时写入标准输出
+static void compileFile(char *Path, char *OutPath, int Jobs)
+{
+  InputPath = Path;
+  Cache = CACHE_BYPASS;
+  for (int I = 0; I < IncludeDirCnt; I++)
+    addIncludePath(IncludeDirs[I]);
+
+  // 读入输入文件
+  size_t Len;
+  char *Buf = readFile(InputPath, &Len);
+
+  // 查找编译缓存，声明快照不放入缓存
+  if (OptCacheDir && !OptEmitSnapshot)
+    Cache = cacheLookup(OptCacheDir, OptCacheSize, Buf, Len, cacheOptions(),
+                        OptIncludeSnapshot);
+
+  if (Cache != CACHE_HIT)
+  {
+    // 未命中时进行增量编译，复用上次编译时没有变化的函数的代码
+    if (OptCacheDir && !OptEmitSnapshot)
+      fnCacheOpen(InputPath);
+    compile(Buf, Len, OutPath, Jobs);
+  }
+
+  // 将编译结果放入缓存，再复制到输出文件
+  if (Cache == CACHE_MISS)
+  {
+    cacheCommit(CacheTmp);
+    CacheTmp = NULL;
+  }
+  if (Cache != CACHE_BYPASS)
+    cacheCopy(openFile(OutPath));
+  // 保存本次编译的各个函数，供下次增量编译使用
+  fnCacheCommit();
+  closeOutput();
+}
+
+// 由输入文件的路径得出输出文件的路径：输出目录（默认为当前目录）中与输入文件同名，
+// 扩展名替换为输出的类型的文件
+static char *outputPath(char *Path)
+{
+  char *Base = strrchr(Path, '/');
+  Base = Base ? Base + 1 : Path;
+  char *Dot = strrchr(Base, '.');
+  int Len = Dot && Dot != Base ? Dot - Base : strlen(Base);
+  char *Ext = OptEmitSnapshot ? "snap" : OptC ? "o" : "s";
+  if (OptOutputDir)
+    return format("%s/%.*s.%s", OptOutputDir, Len, Base, Ext);
+  return format("%.*s.%s", Len, Base, Ext);
+}
+
+// 同时编译多个输入文件时，所有编译线程共享的任务列表
+typedef struct
+{
+  char **Outs;        // 每个输入文件的输出路径
+  atomic_int Next;    // 下一个未被领取的输入文件
+  atomic_bool Failed; // 是否有输入文件编译出错
+  bool C;             // 主线程解析得到的代码生成选项
+  bool VerboseAsm;
+  bool DebugInfo;
+} Batch;
+
+// 编译线程不断领取下一个输入文件，每个线程各有一份编译器的状态，
+// 出错时只结束当前文件的编译，丢弃其状态后继续编译其余的文件
+static void *compileWorker(void *Arg)
+{
+  Batch *B = Arg;
+  OptC = B->C;
+  OptVerboseAsm = B->VerboseAsm;
+  OptDebugInfo = B->DebugInfo;
+
+  for (int I; (I = atomic_fetch_add(&B->Next, 1)) < InputCnt;)
+  {
+    jmp_buf Buf;
+    if (setjmp(Buf))
+      atomic_store(&B->Failed, true);
+    else
+    {
+      setErrorJmp(&Buf);
+      compileFile(InputPaths[I], B->Outs[I], 1);
+    }
+    setErrorJmp(NULL);
+    closeLeftovers();
+    // 线程内缓存的头文件留给之后编译的文件
+    resetCompiler();
+  }
+
+  if (OptMemReport)
+  {
+    flockfile(stderr);
+    arenaPrintStats(stderr);
+    funlockfile(stderr);
+  }
+  arenaFreeAll();
+  return NULL;
+}
+
+// 用 OptJobs 个线程同时编译所有的输入文件，返回退出状态
+static int compileAll(void)
+{
+  Batch B = {.C = OptC, .VerboseAsm = OptVerboseAsm, .DebugInfo = OptDebugInfo};
+  B.Outs = calloc(InputCnt, sizeof(char *));
+  for (int I = 0; I < InputCnt; I++)
+    B.Outs[I] = outputPath(InputPaths[I]);
+
+  int Jobs = OptJobs < InputCnt ? OptJobs : InputCnt;
+  pthread_t Threads[Jobs];
+  for (int T = 0; T < Jobs; T++)
+    if (pthread_create(&Threads[T], NULL, compileWorker, &B))
+      error("cannot create thread: %s", strerror(errno));
+  for (int T = 0; T < Jobs; T++)
+    pthread_join(Threads[T], NULL);
+
+  for (int I = 0; I < InputCnt; I++)
+    free(B.Outs[I]);
+  free(B.Outs);
+  return B.Failed ? 1 : 0;
+}
+
+// 处理一次编译的命令行参数，返回退出状态
+static int run(int Argc, char **Argv)
+{
+  resetOptions();
   // 解析传入程序的参数
   parseArgs(Argc, Argv);
 
-  // 解析文件，生成终结符流
-  Token *Tok = tokenizeFile(InputPath);
+  int Status = 0;
+  if (InputCnt > 1)
+  {
+    Status = compileAll();
+  }
+  else if (InputCnt == 1)
+  {
+    // 单个输入文件在当前线程中编译，未指定输出目录时默认写入标准输出
+    char *Out = OptOutputDir ? outputPath(InputPaths[0]) : OptO;
+    compileFile(InputPaths[0], Out, OptJobs);
+  }
+
+  if (OptCacheStats)
+  {
+    cachePrintStats(OptCacheDir, stderr);
+  }
+  // 多个输入文件时，由各个编译线程分别输出
+  if (OptMemReport && InputCnt <= 1)
+  {
+    arenaPrintStats(stderr);
+  }
+  return Status;
+}
 
-  // 解析终结符流
-  Obj *Prog = parse(Tok);
+// 解析服务器模式的参数并开始处理请求
+static void runServer(int Argc, char **Argv)
+{
+  char *Path = NULL;
+  int Workers = 0;
+  for (int i = 1; i < Argc; i++)
+  {
+    // --server=<socket> 指定套接字的路径
+    if (!strncmp(Argv[i], "--server=", 9))
+    {
+      Path = Argv[i] + 9;
+      continue;
+    }
+    if (!strcmp(Argv[i], "--server"))
+      continue;
 
-  // 生成代码
-  FILE *Out = openFile(OptO);
-  // .file 文件编号 文件名，设置文件的编号和名称，供后续 .loc 指令引用。
-  fprintf(Out, ".file 1 \"%s\"\n", InputPath);
+    // --server-workers=<n> 处理请求的进程数，默认为处理器的数量
+    if (!strncmp(Argv[i], "--server-workers=", 17))
+    {
+      Workers = atoi(Argv[i] + 17);
+      if (Workers < 1)
+      {
+        error("invalid number of workers: %s", Argv[i] + 17);
+      }
+      continue;
+    }
+    usage(1);
+  }
+  serve(Path, Workers, run);
+}
 
-  codegen(Prog, Out);
+int main(int Argc, char **Argv)
+{
+  // --server 常驻在 Unix 套接字上，由 rvcc-client 发送编译请求
+  if (Argc > 1 && !strncmp(Argv[1], "--server", 8))
+  {
+    runServer(Argc, Argv);
+    return 0;
+  }
 
-  return 0;
+  int Status = run(Argc, Argv);
+  // 一次性释放编译过程中分配的所有对象
+  arenaFreeAll();
+  return Status;
 }
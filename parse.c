@@ -7,7 +7,8 @@ struct VarScope
     VarScope *next;
     char *name;
     Obj *Var;
-    Type *Typedef; // 别名
+    Type *Typedef;    // 别名
+    VarScope *Shadow; // 被遮蔽的外层同名变量
 };
 
 // 结构体标签和联合体标签的域
@@ -17,6 +18,7 @@ struct TagScope
     TagScope *next;
     char *name;
     Type *type;
+    TagScope *Shadow; // 被遮蔽的外层同名标签
 };
 
 // 块域
@@ -26,6 +28,7 @@ struct scope
     scope *next;
 
     // 有两种域，变量域（包括 func）和结构体标签域
+    // 链表记录了在该域中声明的名称，离开域时据此恢复哈希表
     VarScope *Vars;
     TagScope *Tags;
 };
@@ -36,15 +39,66 @@ typedef struct
     bool IsTypedef; // 是否为类型别名
 } VarAttr;
 
-// 存储当前解析中的变量
-Obj *Locals;  // 局部变量 (局部函数/嵌套函数)
-Obj *Globals; // 全局变量（全局函数）
+// 声明符中与类型无关的部分，类型是规范化的，不记录声明的名称
+typedef struct
+{
+    Token *Name;        // 变量名或函数名
+    Token **ParamNames; // 函数形参的名称，与函数类型的形参一一对应
+} Decl;
+
+// 声明符中推迟构造的一层类型
+typedef struct
+{
+    TypeKind kind;      // TY_PTR、TY_ARRAY 或 TY_FUNC
+    int ArrayLen;       // 数组的长度
+    Type **Params;      // 函数形参的类型
+    Token **ParamNames; // 函数形参的名称
+    int ParamCnt;       // 函数形参的数量
+} TypeOp;
+
+// 类型构造链，按从外层到内层的顺序记录，构造时从末尾开始依次作用于基类
+typedef struct
+{
+    TypeOp *Ops;
+    int Cnt;
+    int Cap;
+} TypeChain;
 
-// 域链表
-static scope *Scp = &(scope){};
+// 存储当前解析中的变量
+static _Thread_local Obj *Locals;  // 局部变量 (局部函数/嵌套函数)
+static _Thread_local Obj *Globals; // 全局变量（全局函数）
+
+// 全局域，位于域链表的末尾
+static _Thread_local scope GlobalScope;
+// 域链表，线程第一次解析之前为 NULL
+static _Thread_local scope *Scp;
+
+// 名称到最内层变量域的哈希表，所有的域共用一个哈希表
+// 名称都是驻留的字符串，因此以指针为键
+static _Thread_local HashMap VarMap;
+// 名称到最内层结构体标签域的哈希表
+static _Thread_local HashMap TagMap;
+
+// 表达式中运算符的优先级，数值越大结合越紧密
+enum
+{
+    PREC_NONE,       // 不是二元运算符
+    PREC_COMMA,      // ,
+    PREC_ASSIGN,     // =
+    PREC_EQUALITY,   // == !=
+    PREC_RELATIONAL, // < <= > >=
+    PREC_ADD,        // + -
+    PREC_MUL,        // * /
+    PREC_UNARY,      // 一元运算符和类型转换，不解析二元运算符
+};
 
 // 指向当前正在解析的函数
-static Obj *CurrentFn;
+static _Thread_local Obj *CurrentFn;
+// 当前函数中字符串字面量的数量
+static _Thread_local int StrLitCnt;
+
+// 流式模式下，函数定义解析完成后交由其生成代码
+static _Thread_local void (*OnFunction)(Obj *Fn);
 
 // 获取变量名
 static char *getIdent(Token *Tok)
@@ -54,7 +108,7 @@ static char *getIdent(Token *Tok)
         errorTok(Tok, "expected an identifier");
     }
 
-    return strndup(Tok->Loc, Tok->Len);
+    return Tok->Name;
 }
 
 static long getNum(Token *Tok)
@@ -67,9 +121,19 @@ static long getNum(Token *Tok)
 // 获取结构体成员
 static Member *getStructMember(Token *Tok, Type *type)
 {
+    if (type->MemMap)
+    {
+        Member *Mem = hashmapGetPtr(type->MemMap, Tok->Name);
+        if (!Mem)
+        {
+            errorTok(Tok, "no such member");
+        }
+        return Mem;
+    }
+
     for (Member *Mem = type->Mems; Mem; Mem = Mem->next)
     {
-        if (Mem->name->Len == Tok->Len && !strncmp(Mem->name->Loc, Tok->Loc, Tok->Len))
+        if (Tok->Name && Mem->name->Name == Tok->Name)
         {
             return Mem;
         }
@@ -84,7 +148,7 @@ static Member *getStructMember(Token *Tok, Type *type)
 // declspec = ("void" | "char" | "short" | "int" | "long"
 //             | "typedef"
 //             | structDecl | unionDecl | typedefName)+
-// declarator = "*"* ("(" ident ")" | "(" declarator ")" | ident) typeSuffix
+// declarator = "*"* ("(" declarator ")" | ident) typeSuffix
 // typeSuffix = "(" funcParams | "[" num "]" typeSuffix | ε
 // funcParams = (param ("," param)*)? ")"
 // param = declspec declarator
@@ -105,6 +169,7 @@ static Member *getStructMember(Token *Tok, Type *type)
 // mul = cast ("*" cast | "/" cast)*
 // cast = "(" typeName ")" cast | unary
 // unary = ("+" | "-" | "*" | "&") cast | postfix
+// 从 expr 到 unary 的各层由 exprPrec 以优先级爬升的方式解析
 // structMembers = (declspec declarator (","  declarator)* ";")*
 // structDecl = structUnionDecl
 // unionDecl = structUnionDecl
@@ -120,13 +185,14 @@ static Member *getStructMember(Token *Tok, Type *type)
 // typeName = declspec abstractDeclarator
 // abstractDeclarator = "*"* ("(" abstractDeclarator ")")? typeSuffix
 // Funcall = ident "(" (assign ("," assign)*)? ")"
-static Token *function(Token *Tok, Type *declspec);
-static Token *globalVariable(Token *Tok, Type *declspec);
+static Token *function(Token *Tok, Type *Ty, Decl *D);
+static Token *globalVariable(Token *Tok, Type *declspec, Type *Ty, Decl *D);
 static bool isTypename(Token *Tok);
 static Type *declspec(Token **Rest, Token *Tok, VarAttr *Attr);
-static Type *declarator(Token **Rest, Token *Tok, Type *Ty);
-static Type *typeSuffix(Token **Rest, Token *Tok, Type *Ty);
-static Type *funcParams(Token **Rest, Token *Tok, Type *Ty);
+static Type *declarator(Token **Rest, Token *Tok, Type *Ty, Decl *D);
+static void declaratorChain(Token **Rest, Token *Tok, TypeChain *C, Decl *D);
+static void typeSuffix(Token **Rest, Token *Tok, TypeChain *C);
+static void funcParams(Token **Rest, Token *Tok, TypeOp *Op);
 static Token *parseTypedef(Token *Tok, Type *BaseTy);
 static Node *compoundStmt(Token **Rest, Token *Tok);
 static Node *declaration(Token **Rest, Token *Tok, Type *BaseTy);
@@ -134,25 +200,28 @@ static Node *stmt(Token **Rest, Token *Tok);
 static Node *exprStmt(Token **Rest, Token *Tok);
 static Node *expr(Token **Rest, Token *Tok);
 static Node *assign(Token **Rest, Token *Tok);
-static Node *equality(Token **Rest, Token *Tok);
-static Node *relational(Token **Rest, Token *Tok);
-static Node *add(Token **Rest, Token *Tok);
-static Node *mul(Token **Rest, Token *Tok);
-static Node *cast(Token **Rest, Token *Tok);
 static Node *unary(Token **Rest, Token *Tok);
+static Node *exprPrec(Token **Rest, Token *Tok, int MinPrec);
 static void structMembers(Token **Rest, Token *Tok, Type *Ty);
 static Type *structDecl(Token **Rest, Token *Tok);
 static Type *unionDecl(Token **Rest, Token *Tok);
 static Node *postfix(Token **Rest, Token *Tok);
+static Node *postfixOps(Token **Rest, Token *Tok, Node *node);
 static Node *primary(Token **Rest, Token *Tok);
 static Type *abstractDeclarator(Token **Rest, Token *Tok, Type *Ty);
 static Type *typename(Token **Rest, Token *Tok);
 static Node *Funcall(Token **Rest, Token *Tok);
 
+// 全局域中的名称在整个编译过程中有效，函数内的域随函数一起释放
+static ArenaKind scopeArena(void)
+{
+    return Scp->next ? AK_LOCAL : AK_SCOPE;
+}
+
 // 进入域
 static void enterScope(void)
 {
-    scope *S = calloc(1, sizeof(scope));
+    scope *S = arenaAlloc(AK_LOCAL, sizeof(scope));
     // 模拟栈，栈顶对应最近的域
     S->next = Scp;
     Scp = S;
@@ -161,41 +230,45 @@ static void enterScope(void)
 // 结束当前域
 static void leaveScope(void)
 {
+    // 按声明的逆序撤销当前域中的名称，恢复被遮蔽的外层名称
+    for (VarScope *S = Scp->Vars; S; S = S->next)
+    {
+        if (S->Shadow)
+        {
+            hashmapPutPtr(&VarMap, S->name, S->Shadow);
+        }
+        else
+        {
+            hashmapDeletePtr(&VarMap, S->name);
+        }
+    }
+    for (TagScope *S = Scp->Tags; S; S = S->next)
+    {
+        if (S->Shadow)
+        {
+            hashmapPutPtr(&TagMap, S->name, S->Shadow);
+        }
+        else
+        {
+            hashmapDeletePtr(&TagMap, S->name);
+        }
+    }
+
     Scp = Scp->next;
 }
 
 // 通过 Token 查找变量
 static VarScope *FindVarByName(Token *Tok)
 {
-    // 从最深层的域向上寻找
-    for (scope *ScoPtr = Scp; ScoPtr; ScoPtr = ScoPtr->next)
-    {
-        for (VarScope *varPtr = ScoPtr->Vars; varPtr; varPtr = varPtr->next)
-        {
-            if (equal(Tok, varPtr->name))
-            {
-                return varPtr;
-            }
-        }
-    }
-    return NULL;
+    // 哈希表中存放的总是最深层的域中的变量
+    return hashmapGetPtr(&VarMap, Tok->Name);
 }
 
 // 通过 Token 查找结构体标签
 static Type *FindTag(Token *Tok)
 {
-    // 从最深层的域向上寻找
-    for (scope *ScoPtr = Scp; ScoPtr; ScoPtr = ScoPtr->next)
-    {
-        for (TagScope *tagPtr = ScoPtr->Tags; tagPtr; tagPtr = tagPtr->next)
-        {
-            if (equal(Tok, tagPtr->name))
-            {
-                return tagPtr->type;
-            }
-        }
-    }
-    return NULL;
+    TagScope *S = hashmapGetPtr(&TagMap, Tok->Name);
+    return S ? S->type : NULL;
 }
 
 // 查找类型别名
@@ -215,55 +288,57 @@ static Type *findTypedef(Token *Tok)
 // 将变量存入当前的域中
 static VarScope *pushVarScope(char *Name)
 {
-    VarScope *S = calloc(1, sizeof(VarScope));
+    VarScope *S = arenaAlloc(scopeArena(), sizeof(VarScope));
     S->name = Name;
 
     S->next = Scp->Vars;
     Scp->Vars = S;
 
+    // 遮蔽外层的同名变量
+    S->Shadow = hashmapGetPtr(&VarMap, Name);
+    hashmapPutPtr(&VarMap, Name, S);
+
     return S;
 }
 
 // 将结构体标签存入当前的域中
-static void *pushTagScope(Token *NameTok, Type *Type)
+static void pushTagScope(char *Name, Type *Type)
 {
-    TagScope *S = calloc(1, sizeof(TagScope));
-    S->name = strndup(NameTok->Loc, NameTok->Len);
+    TagScope *S = arenaAlloc(scopeArena(), sizeof(TagScope));
+    S->name = Name;
     S->type = Type;
 
     S->next = Scp->Tags;
     Scp->Tags = S;
+
+    // 遮蔽外层的同名标签
+    S->Shadow = hashmapGetPtr(&TagMap, S->name);
+    hashmapPutPtr(&TagMap, S->name, S);
 }
 
 // 判断是否为类型名
 static bool isTypename(Token *Tok)
 {
-    static char *Kw[] = {
-        "void",
-        "char",
-        "short",
-        "int",
-        "long",
-        "struct",
-        "union",
-        "typedef",
-    };
-
-    for (int i = 0; i < sizeof(Kw) / sizeof(*Kw); ++i)
-    {
-        if (equal(Tok, Kw[i]))
-        {
-            return true;
-        }
+    switch (Tok->Id)
+    {
+    case KW_VOID:
+    case KW_CHAR:
+    case KW_SHORT:
+    case KW_INT:
+    case KW_LONG:
+    case KW_STRUCT:
+    case KW_UNION:
+    case KW_TYPEDEF:
+        return true;
+    default:
+        // 查找是否为类型别名
+        return findTypedef(Tok);
     }
-
-    // 查找是否为类型别名
-    return findTypedef(Tok);
 }
 
-static Obj *newVar(char *name, Type *type)
+static Obj *newVar(char *name, Type *type, ArenaKind Kind)
 {
-    Obj *Var = calloc(1, sizeof(Obj));
+    Obj *Var = arenaAlloc(Kind, sizeof(Obj));
     Var->name = name;
     Var->type = type;
 
@@ -274,7 +349,7 @@ static Obj *newVar(char *name, Type *type)
 
 static Obj *newLocalVar(char *name, Type *type)
 {
-    Obj *var = newVar(name, type);
+    Obj *var = newVar(name, type, AK_LOCAL);
     var->isLocal = true;
 
     // 将新变量插入到 Locals 的头部
@@ -286,7 +361,7 @@ static Obj *newLocalVar(char *name, Type *type)
 
 static Obj *newGlobalVar(char *name, Type *type)
 {
-    Obj *var = newVar(name, type);
+    Obj *var = newVar(name, type, AK_OBJ);
 
     // 将新变量插入到 Globals 的头部
     var->next = Globals;
@@ -295,11 +370,11 @@ static Obj *newGlobalVar(char *name, Type *type)
     return var;
 }
 
-// 生成唯一名称
+// 生成唯一名称，名称中含有函数名，每个函数从 0 开始编号，
+// 使函数的代码不受其他函数的影响，增量编译时可以单独复用
 static char *newUniqueName(void)
 {
-    static int Id = 0;
-    return format(".L..%d", Id++); // 创建唯一的标签（变量名）
+    return format(".L..%s.%d", CurrentFn->name, StrLitCnt++); // 创建唯一的标签（变量名）
 }
 
 // 生成匿名全局变量
@@ -313,23 +388,56 @@ static Obj *newStringLiteral(char *Str, Type *Ty)
 {
     Obj *Var = newAnonGVar(Ty);
     Var->InitData = Str;
+    // 增量编译时随函数的代码一起保存
+    if (CurrentFn->Rec)
+    {
+        fnCacheAddString(CurrentFn->Rec, Str, Ty->size);
+    }
     return Var;
 }
 
-static void createParamVars(Type *Param)
+static void createParamVars(Type *FnTy, Token **Names)
 {
-    if (Param)
+    // 先将最后一个形参加入 Locals 中，之后逐个加入到顶部，保持顺序不变
+    for (int I = FnTy->ParamCnt - 1; I >= 0; I--)
     {
-        // 先将最底部的加入 Locals 中，之后逐个加入到顶部，保持顺序不变
-        createParamVars(Param->next);
-        // 添加到 Locals 中
-        newLocalVar(getIdent(Param->name), Param);
+        newLocalVar(getIdent(Names[I]), FnTy->Params[I]);
+    }
+}
+
+// 各种类的节点实际需要的大小，即节点头加上该种类用到的字段
+static size_t nodeSize(NodeKind kind)
+{
+    switch (kind)
+    {
+    case ND_NUM:
+        return offsetof(Node, Val) + sizeof(int64_t);
+    case ND_VAR:
+        return offsetof(Node, Var) + sizeof(Obj *);
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        return offsetof(Node, Body) + sizeof(Node *);
+    case ND_FUNCALL:
+        return offsetof(Node, Args) + sizeof(Node *);
+    case ND_IF:
+        return offsetof(Node, Else) + sizeof(Node *);
+    case ND_FOR:
+        return offsetof(Node, Inc) + sizeof(Node *);
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+    case ND_CAST:
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+        return offsetof(Node, LHS) + sizeof(Node *);
+    default: // 二元运算和结构体成员访问
+        return offsetof(Node, RHS) + sizeof(Node *);
     }
 }
 
 static Node *newNode(NodeKind kind, Token *Tok)
 {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arenaAlloc(AK_NODE, nodeSize(kind));
     node->kind = kind;
     node->Tok = Tok;
     return node;
@@ -431,11 +539,9 @@ static Node *newSubBinary(Token *Tok, Node *LHS, Node *RHS)
 Node *newCast(Node *Expr, Type *type)
 {
     addType(Expr);
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_CAST;
-    node->Tok = Expr->Tok;
+    Node *node = newNode(ND_CAST, Expr->Tok);
     node->LHS = Expr;
-    node->type = copyType(type);
+    node->type = type;
     return node;
 }
 
@@ -469,25 +575,16 @@ static Node *structRef(Node *LHS, Token *Tok)
     return node;
 }
 
-// 区分 函数还是全局变量
-static bool isFunction(Token *Tok)
-{
-    if (equal(Tok, ";"))
-    {
-        return false;
-    }
-
-    // 虚设变量，用于调用 declarator 以确定是否为函数
-    Type Dummy = {};
-    Type *Ty = declarator(&Tok, Tok, &Dummy);
-    return Ty->kind == TY_FUNC;
-}
-
 // 语法解析入口函数
 // program = (typedef | functionDefinition | globalVariable)*
-Obj *parse(Token *Tok)
+// 全局变量中可能已有从声明快照中载入的声明
+Obj *parse(Token *Tok, void (*OnFn)(Obj *Fn))
 {
-    Globals = NULL;
+    OnFunction = OnFn;
+    if (!Scp)
+    {
+        Scp = &GlobalScope;
+    }
 
     while (Tok->kind != TK_EOF)
     {
@@ -501,47 +598,293 @@ Obj *parse(Token *Tok)
             continue;
         }
 
-        if (isFunction(Tok))
+        // 只声明了类型，如 "struct T {...};"
+        if (consume(&Tok, Tok, ';'))
         {
-            Tok = function(Tok, baseType);
+            continue;
+        }
+
+        // 由第一个声明符的类型区分函数和全局变量
+        Decl D = {};
+        Type *Ty = declarator(&Tok, Tok, baseType, &D);
+        if (Ty->kind == TY_FUNC)
+        {
+            Tok = function(Tok, Ty, &D);
         }
         else
         {
-            Tok = globalVariable(Tok, baseType);
+            Tok = globalVariable(Tok, baseType, Ty, &D);
         }
     }
     return Globals;
 }
 
+// 按声明的顺序获取全局域中的所有名称，用于保存声明快照
+GlobalName *getGlobalNames(int *Cnt)
+{
+    scope *Global = &GlobalScope;
+    int N = 0;
+    for (VarScope *S = Global->Vars; S; S = S->next)
+    {
+        N++;
+    }
+    for (TagScope *S = Global->Tags; S; S = S->next)
+    {
+        N++;
+    }
+
+    // 域中的链表是逆序的，从末尾开始填充
+    GlobalName *Names = calloc(N, sizeof(GlobalName));
+    int I = N;
+    for (TagScope *S = Global->Tags; S; S = S->next)
+    {
+        Names[--I] = (GlobalName){.Name = S->name, .Tag = S->type};
+    }
+    for (VarScope *S = Global->Vars; S; S = S->next)
+    {
+        Names[--I] = (GlobalName){.Name = S->name, .Var = S->Var, .Typedef = S->Typedef};
+    }
+
+    *Cnt = N;
+    return Names;
+}
+
+// 在全局域中声明一个名称，用于载入声明快照，全局变量和函数同时加入 Globals
+void declareGlobalName(GlobalName *G)
+{
+    if (!Scp)
+    {
+        Scp = &GlobalScope;
+    }
+    assert(!Scp->next);
+    if (G->Tag)
+    {
+        pushTagScope(G->Name, G->Tag);
+        return;
+    }
+
+    VarScope *S = pushVarScope(G->Name);
+    S->Typedef = G->Typedef;
+    S->Var = G->Var;
+    if (G->Var)
+    {
+        G->Var->next = Globals;
+        Globals = G->Var;
+    }
+}
+
 // globalVariable = declspec ( declarator ",")* ";"
-static Token *globalVariable(Token *Tok, Type *declspec)
+// 第一个声明符已经由调用者解析，其类型为 Ty
+static Token *globalVariable(Token *Tok, Type *declspec, Type *Ty, Decl *D)
 {
-    bool isFirst = true;
+    newGlobalVar(getIdent(D->Name), Ty);
 
-    while (!consume(&Tok, Tok, ";"))
+    while (!consume(&Tok, Tok, ';'))
     {
-        if (!isFirst)
+        Tok = skip(Tok, ',');
+
+        Decl D2 = {};
+        Type *Ty2 = declarator(&Tok, Tok, declspec, &D2);
+        newGlobalVar(getIdent(D2.Name), Ty2);
+    }
+    return Tok;
+}
+
+//
+// 增量编译
+//
+// 函数的指纹由函数名、函数类型、形参名、函数体的终结符，以及函数体中的标识符在全局域中
+// 指向的声明（变量和函数的类型、类型别名、结构体的布局）组成。
+// 输出行号信息时也计入终结符的行号，函数所在文件中的行号相对于函数体的开头计算，
+// 函数整体移动位置时指纹不变，复用代码时再修正 .loc 的行号。
+//
+
+// 计算指纹的缓冲区
+static _Thread_local char *FpBuf;
+static _Thread_local size_t FpLen;
+static _Thread_local size_t FpCap;
+// 已计入指纹的类型（值为编号）和名称
+static _Thread_local HashMap FpSeen;
+static _Thread_local int FpTypeCnt;
+
+static void fpAdd(void *Data, size_t Len)
+{
+    if (FpLen + Len > FpCap)
+    {
+        FpCap = (FpLen + Len) * 2;
+        FpBuf = realloc(FpBuf, FpCap);
+    }
+    memcpy(FpBuf + FpLen, Data, Len);
+    FpLen += Len;
+}
+
+static void fpInt(int64_t Val)
+{
+    fpAdd(&Val, sizeof(Val));
+}
+
+static void fpStr(char *S)
+{
+    fpAdd(S, strlen(S) + 1);
+}
+
+// 计入类型，同一类型再次出现时只计入其编号
+static void fpType(Type *Ty)
+{
+    if (!Ty)
+    {
+        fpInt(-1);
+        return;
+    }
+    intptr_t Id = (intptr_t)hashmapGetPtr(&FpSeen, Ty);
+    if (Id)
+    {
+        fpInt(-1 - Id);
+        return;
+    }
+    hashmapPutPtr(&FpSeen, Ty, (void *)(intptr_t)++FpTypeCnt);
+
+    fpInt(Ty->kind);
+    fpInt(Ty->size);
+    fpInt(Ty->align);
+    switch (Ty->kind)
+    {
+    case TY_PTR:
+        fpType(Ty->base);
+        break;
+    case TY_ARRAY:
+        fpInt(Ty->ArrayLen);
+        fpType(Ty->base);
+        break;
+    case TY_FUNC:
+        fpType(Ty->ReturnTy);
+        fpInt(Ty->ParamCnt);
+        for (int I = 0; I < Ty->ParamCnt; I++)
         {
-            Tok = skip(Tok, ",");
+            fpType(Ty->Params[I]);
         }
-        else
+        break;
+    case TY_STRUCT:
+    case TY_UNION:
+        for (Member *Mem = Ty->Mems; Mem; Mem = Mem->next)
         {
-            isFirst = false;
+            fpStr(Mem->name->Name);
+            fpInt(Mem->offset);
+            fpType(Mem->type);
         }
+        fpStr("");
+        break;
+    default:
+        break;
+    }
+}
 
-        Type *Ty = declarator(&Tok, Tok, declspec);
-        Obj *obj = newGlobalVar(getIdent(Ty->name), Ty);
+// 计入标识符在全局域中指向的声明，每个名称只计入一次。
+// 函数体中的局部变量也会查到同名的全局声明，只会使指纹更保守
+static void fpName(Token *Tok)
+{
+    if (hashmapGetPtr(&FpSeen, Tok->Name))
+    {
+        return;
     }
-    return Tok;
+    hashmapPutPtr(&FpSeen, Tok->Name, Tok->Name);
+
+    VarScope *S = FindVarByName(Tok);
+    fpInt(S && S->Var ? S->Var->isFunction : -1);
+    fpType(S && S->Var ? S->Var->type : NULL);
+    fpType(S ? S->Typedef : NULL);
+    fpType(FindTag(Tok));
+}
+
+// 跳过函数体，返回函数体之后的终结符，括号不匹配时返回 NULL
+static Token *skipBody(Token *Tok)
+{
+    int Depth = 0;
+    for (; Tok->kind != TK_EOF; Tok++)
+    {
+        if (equal(Tok, '{'))
+        {
+            Depth++;
+        }
+        else if (equal(Tok, '}') && --Depth == 0)
+        {
+            return Tok + 1;
+        }
+    }
+    return NULL;
+}
+
+// 计算函数的指纹，查找函数在缓存中的记录，函数体为 [Tok, End)
+static FnRecord *lookupFunction(Obj *Fn, Decl *D, Token *Tok, Token *End)
+{
+    // 宏拼接产生的函数体没有行号
+    File *F = getFile(Tok->Loc);
+    if (!F->FileNo)
+    {
+        return NULL;
+    }
+    int Line = getLineNo(Tok->Loc);
+
+    FpLen = 0;
+    FpTypeCnt = 0;
+    fpStr(Fn->name);
+    fpType(Fn->type);
+    for (int I = 0; I < Fn->type->ParamCnt; I++)
+    {
+        Token *Name = D->ParamNames[I];
+        fpStr(Name && Name->kind == TK_IDENT ? Name->Name : "");
+    }
+
+    File *LastF = NULL;
+    int LastLine = 0;
+    for (Token *T = Tok; T < End; T++)
+    {
+        if (OptDebugInfo)
+        {
+            File *TF = getFile(T->Loc);
+            int L = TF->FileNo ? getLineNo(T->Loc) : 0;
+            if (TF != LastF || L != LastLine)
+            {
+                // 行号的标记不是合法的终结符种类
+                uint8_t Mark = 0xFF;
+                fpAdd(&Mark, 1);
+                fpInt(TF->FileNo);
+                fpInt(TF == F ? L - Line : L);
+                LastF = TF;
+                LastLine = L;
+            }
+        }
+
+        fpAdd(&T->kind, 1);
+        fpAdd(&T->Id, 1);
+        if (T->kind == TK_IDENT)
+        {
+            fpStr(T->Name);
+            fpName(T);
+        }
+        else if (T->kind == TK_NUM)
+        {
+            fpInt(T->Val);
+        }
+        else if (T->kind == TK_STR)
+        {
+            StrLiteral *Lit = getStrLiteral(T);
+            fpInt(Lit->Len);
+            fpAdd(Lit->Str, Lit->Len);
+        }
+    }
+    hashmapFree(&FpSeen);
+
+    return fnCacheLookup(FpBuf, FpLen, F->FileNo, Line);
 }
 
 // functionDefinition = declspec declarator "{" compoundStmt*
-static Token *function(Token *Tok, Type *declspec)
+// 声明符已经由调用者解析，其类型为 Ty
+static Token *function(Token *Tok, Type *Ty, Decl *D)
 {
-    Type *Ty = declarator(&Tok, Tok, declspec);
-    Obj *fn = newGlobalVar(getIdent(Ty->name), Ty); // 全局函数是一种特殊的全局变量
+    Obj *fn = newGlobalVar(getIdent(D->Name), Ty); // 全局函数是一种特殊的全局变量
     fn->isFunction = true;
-    fn->isDefinition = !consume(&Tok, Tok, ";");
+    fn->isDefinition = !consume(&Tok, Tok, ';');
 
     // 如果不是函数定义，直接返回
     if (!fn->isDefinition)
@@ -550,17 +893,37 @@ static Token *function(Token *Tok, Type *declspec)
     }
 
     CurrentFn = fn;
+    StrLitCnt = 0;
     // 清空上一个函数的 Locals
     Locals = NULL;
 
+    // 增量编译：函数的指纹没有变化时复用上次编译的代码，不再解析函数体，
+    // 只恢复函数用到的字符串字面量
+    Token *End;
+    if (fnCacheEnabled() && (End = skipBody(Tok)) &&
+        (fn->Rec = lookupFunction(fn, D, Tok, End)) && fnCacheHit(fn->Rec))
+    {
+        char *Str;
+        int Len;
+        for (int I = 0; (Str = fnCacheString(fn->Rec, I, &Len)); I++)
+        {
+            newAnonGVar(arrayOf(TyChar, Len))->InitData = Str;
+        }
+        if (OnFunction)
+        {
+            OnFunction(fn);
+        }
+        return End;
+    }
+
     // 进入新的域
     enterScope();
 
     // 函数参数
-    createParamVars(Ty->Params);
+    createParamVars(Ty, D->ParamNames);
     fn->Params = Locals;
 
-    Tok = skip(Tok, "{");
+    Tok = skip(Tok, '{');
     // 函数体存储语句的 AST，Locals 存储变量
     fn->body = compoundStmt(&Tok, Tok);
     fn->locals = Locals;
@@ -568,6 +931,18 @@ static Token *function(Token *Tok, Type *declspec)
     // 结束当前域
     leaveScope();
 
+    // 流式模式下立即生成代码，然后释放函数的语法树、局部变量和域
+    if (OnFunction)
+    {
+        OnFunction(fn);
+        fn->body = NULL;
+        fn->Params = NULL;
+        fn->locals = NULL;
+        Locals = NULL;
+        arenaReset(AK_NODE);
+        arenaReset(AK_LOCAL);
+    }
+
     return Tok;
 }
 
@@ -592,39 +967,38 @@ static Type *declspec(Token **Rest, Token *Tok, VarAttr *Attr)
     while (isTypename(Tok))
     {
         // 处理 typedef 关键字
-        if (equal(Tok, "typedef"))
+        if (Tok->Id == KW_TYPEDEF)
         {
             if (!Attr)
             {
                 errorTok(Tok, "storage class specifier is not allowed in this context");
             }
             Attr->IsTypedef = true;
-            Tok = Tok->next;
+            Tok++;
             continue;
         }
 
-        // 处理用户定义的类型
-        Type *Ty = findTypedef(Tok);
-        if (equal(Tok, "struct") || equal(Tok, "union") || Ty)
+        // 处理用户定义的类型，标识符通过了 isTypename 的检查，一定是类型别名
+        if (Tok->Id == KW_STRUCT || Tok->Id == KW_UNION || Tok->kind == TK_IDENT)
         {
             if (Counter)
             {
                 break;
             }
 
-            if (equal(Tok, "struct"))
+            if (Tok->Id == KW_STRUCT)
             {
-                type = structDecl(&Tok, Tok->next);
+                type = structDecl(&Tok, Tok + 1);
             }
-            else if (equal(Tok, "union"))
+            else if (Tok->Id == KW_UNION)
             {
-                type = unionDecl(&Tok, Tok->next);
+                type = unionDecl(&Tok, Tok + 1);
             }
             else
             {
                 // 将类型设为类型别名指向的类型
-                type = Ty;
-                Tok = Tok->next;
+                type = findTypedef(Tok);
+                Tok++;
             }
 
             Counter += OTHER;
@@ -632,28 +1006,24 @@ static Type *declspec(Token **Rest, Token *Tok, VarAttr *Attr)
         }
 
         // 对于出现的类型名加入 Counter
-        if (equal(Tok, "void"))
+        switch (Tok->Id)
         {
+        case KW_VOID:
             Counter += VOID;
-        }
-        else if (equal(Tok, "char"))
-        {
+            break;
+        case KW_CHAR:
             Counter += CHAR;
-        }
-        else if (equal(Tok, "short"))
-        {
+            break;
+        case KW_SHORT:
             Counter += SHORT;
-        }
-        else if (equal(Tok, "int"))
-        {
+            break;
+        case KW_INT:
             Counter += INT;
-        }
-        else if (equal(Tok, "long"))
-        {
+            break;
+        case KW_LONG:
             Counter += LONG;
-        }
-        else // 每一步的 Counter 都需要有合法值
-        {
+            break;
+        default: // 每一步的 Counter 都需要有合法值
             unreachable();
         }
 
@@ -685,92 +1055,151 @@ static Type *declspec(Token **Rest, Token *Tok, VarAttr *Attr)
             errorTok(Tok, "invalid type");
         }
 
-        Tok = Tok->next;
+        Tok++;
     }
 
     *Rest = Tok;
     return type;
 }
 
-// declarator = "*"* ("(" ident ")" | "(" declarator ")" | ident) typeSuffix
-static Type *declarator(Token **Rest, Token *Tok, Type *type)
+// 在类型构造链的末尾记录一层类型
+static TypeOp *pushTypeOp(TypeChain *C, TypeKind Kind)
 {
-    // "*"*
-    while (consume(&Tok, Tok, "*"))
+    if (C->Cnt == C->Cap)
     {
-        type = pointerTo(type);
+        C->Cap = C->Cap ? C->Cap * 2 : 8;
+        C->Ops = realloc(C->Ops, sizeof(TypeOp) * C->Cap);
     }
+    C->Ops[C->Cnt] = (TypeOp){.kind = Kind};
+    return &C->Ops[C->Cnt++];
+}
 
-    // "(" declarator ")" | "( ident ")"
-    if (equal(Tok, "("))
+// 将类型构造链从内到外作用于基类 Ty，得到声明的类型，并释放构造链
+static Type *applyTypeChain(TypeChain *C, Type *Ty, Decl *D)
+{
+    for (int I = C->Cnt - 1; I >= 0; I--)
     {
-        Token *start = Tok;
-        Type Dummy = {};
-        // 使 Tok 前进到")"后面的位置
-        declarator(&Tok, start->next, &Dummy);
-        Tok = skip(Tok, ")");
-        // 获取到括号后面的类型后缀，Ty 为解析完的类型，Rest 指向分号
-        type = typeSuffix(Rest, Tok, type);
-        // 解析 type 整体作为 Base 去构造，返回 Type 的值
-        return declarator(&Tok, start->next, type);
+        TypeOp *Op = &C->Ops[I];
+        switch (Op->kind)
+        {
+        case TY_PTR:
+            Ty = pointerTo(Ty);
+            break;
+        case TY_ARRAY:
+            Ty = arrayOf(Ty, Op->ArrayLen);
+            break;
+        default: // TY_FUNC
+            Ty = funcType(Ty, Op->Params, Op->ParamCnt);
+            // 最外层的函数类型即为所声明的函数，其形参名单独传递
+            if (I == 0 && D)
+            {
+                D->ParamNames = arenaAlloc(AK_SCOPE, sizeof(Token *) * Op->ParamCnt);
+                memcpy(D->ParamNames, Op->ParamNames, sizeof(Token *) * Op->ParamCnt);
+            }
+            free(Op->Params);
+            free(Op->ParamNames);
+            break;
+        }
     }
+    free(C->Ops);
+    return Ty;
+}
 
-    if (Tok->kind != TK_IDENT)
+// 声明符只解析一遍：先记录类型构造链，再一次性作用于基类
+static Type *declarator(Token **Rest, Token *Tok, Type *type, Decl *D)
+{
+    TypeChain C = {};
+    declaratorChain(Rest, Tok, &C, D);
+    return applyTypeChain(&C, type, D);
+}
+
+// declarator = "*"* ("(" declarator ")" | ident) typeSuffix
+// 抽象声明符没有名称，此时 D 为 NULL
+static void declaratorChain(Token **Rest, Token *Tok, TypeChain *C, Decl *D)
+{
+    // "*"*，指针最先作用于基类，因此最后记录
+    int PtrCnt = 0;
+    while (consume(&Tok, Tok, '*'))
     {
-        errorTok(Tok, "expected a variable name");
+        PtrCnt++;
     }
 
-    // typeSuffix
-    type = typeSuffix(Rest, Tok->next, type);
+    if (equal(Tok, '('))
+    {
+        // "(" declarator ")"，括号内的部分最后作用于基类，因此最先记录
+        declaratorChain(&Tok, Tok + 1, C, D);
+        Tok = skip(Tok, ')');
+    }
+    else if (D)
+    {
+        // ident
+        if (Tok->kind != TK_IDENT)
+        {
+            errorTok(Tok, "expected a variable name");
+        }
+        D->Name = Tok; // 变量名或函数名
+        Tok++;
+    }
 
-    // ident
-    type->name = Tok; // 变量名或函数名
+    // typeSuffix
+    typeSuffix(&Tok, Tok, C);
 
-    return type;
+    for (int I = 0; I < PtrCnt; I++)
+    {
+        pushTypeOp(C, TY_PTR);
+    }
+    *Rest = Tok;
 }
 
 // typeSuffix = "(" funcParams | "[" num "]" typeSuffix | ε
-static Type *typeSuffix(Token **Rest, Token *Tok, Type *type)
+static void typeSuffix(Token **Rest, Token *Tok, TypeChain *C)
 {
-    // ("(" funcParams? ")")?
-    if (equal(Tok, "("))
-    {
-        return funcParams(Rest, Tok->next, type);
-    }
-    else if (equal(Tok, "["))
+    while (true)
     {
-        int size = getNum(Tok->next);
-        Tok = skip(Tok->next->next, "]");
-        type = typeSuffix(Rest, Tok, type);
-        return arrayOf(type, size);
+        // ("(" funcParams? ")")?
+        if (equal(Tok, '('))
+        {
+            funcParams(Rest, Tok + 1, pushTypeOp(C, TY_FUNC));
+            return;
+        }
+        if (!equal(Tok, '['))
+        {
+            *Rest = Tok;
+            return;
+        }
+        // 靠左的维度在外层
+        pushTypeOp(C, TY_ARRAY)->ArrayLen = getNum(Tok + 1);
+        Tok = skip(Tok + 2, ']');
     }
-    *Rest = Tok;
-    return type;
 }
 
 // funcParams = (param ("," param)*)? ")"
 // param = declspec declarator
-static Type *funcParams(Token **Rest, Token *Tok, Type *Ty)
+static void funcParams(Token **Rest, Token *Tok, TypeOp *Op)
 {
-    Type Head = {};
-    Type *Cur = &Head;
+    int Cap = 0;
 
-    while (!equal(Tok, ")"))
+    while (!equal(Tok, ')'))
     {
         // funcParams = param ("," param)*
         // param = declspec declarator
-        if (Cur != &Head)
-            Tok = skip(Tok, ",");
+        if (Op->ParamCnt)
+            Tok = skip(Tok, ',');
         Type *BaseTy = declspec(&Tok, Tok, NULL);
-        Type *DeclarTy = declarator(&Tok, Tok, BaseTy);
-        Cur->next = copyType(DeclarTy); // 将类型复制到形参链表一份
-        Cur = Cur->next;
+        Decl ParamD = {};
+        Type *DeclarTy = declarator(&Tok, Tok, BaseTy, &ParamD);
+
+        if (Op->ParamCnt == Cap)
+        {
+            Cap = Cap ? Cap * 2 : 8;
+            Op->Params = realloc(Op->Params, sizeof(Type *) * Cap);
+            Op->ParamNames = realloc(Op->ParamNames, sizeof(Token *) * Cap);
+        }
+        Op->Params[Op->ParamCnt] = DeclarTy;
+        Op->ParamNames[Op->ParamCnt++] = ParamD.Name;
     }
 
-    Ty = funcType(Ty);
-    Ty->Params = Head.next; // 传递形参
-    *Rest = Tok->next;
-    return Ty;
+    *Rest = Tok + 1;
 }
 
 // 解析类型别名
@@ -778,16 +1207,17 @@ static Token *parseTypedef(Token *Tok, Type *BaseTy)
 {
     bool First = true;
 
-    while (!consume(&Tok, Tok, ";"))
+    while (!consume(&Tok, Tok, ';'))
     {
         if (!First)
         {
-            Tok = skip(Tok, ",");
+            Tok = skip(Tok, ',');
         }
         First = false;
-        Type *Ty = declarator(&Tok, Tok, BaseTy);
+        Decl D = {};
+        Type *Ty = declarator(&Tok, Tok, BaseTy, &D);
         // 类型别名的变量名存入变量域中，并设置类型
-        pushVarScope(getIdent(Ty->name))->Typedef = Ty;
+        pushVarScope(getIdent(D.Name))->Typedef = Ty;
     }
 
     return Tok;
@@ -803,7 +1233,7 @@ static Node *compoundStmt(Token **Rest, Token *Tok)
     // 进入新的域
     enterScope();
 
-    while (!equal(Tok, "}"))
+    while (!equal(Tok, '}'))
     {
         if (isTypename(Tok)) // declaration
         {
@@ -827,7 +1257,7 @@ static Node *compoundStmt(Token **Rest, Token *Tok)
         Cur = Cur->next;
         addType(Cur); // 为节点添加类型信息
     }
-    *Rest = skip(Tok, "}");
+    *Rest = skip(Tok, '}');
 
     // 结束当前域
     leaveScope();
@@ -847,30 +1277,31 @@ static Node *declaration(Token **Rest, Token *Tok, Type *BaseTy)
     int i = 0; // 处理连续变量申明
 
     // (declarator ("=" expr)? ("," declarator ("=" expr)?)*)?
-    while (!equal(Tok, ";"))
+    while (!equal(Tok, ';'))
     {
         // 第 1 个变量不必匹配 ","
         if (i++ > 0)
         {
-            Tok = skip(Tok, ",");
+            Tok = skip(Tok, ',');
         }
 
-        Type *type = declarator(&Tok, Tok, BaseTy);
+        Decl D = {};
+        Type *type = declarator(&Tok, Tok, BaseTy, &D);
         if (type == TY_VOID)
         {
             errorTok(Tok, "variable declared void");
         }
 
-        Obj *Var = newLocalVar(getIdent(type->name), type);
+        Obj *Var = newLocalVar(getIdent(D.Name), type);
 
         // 如果不存在"="则为变量声明，不需要生成节点，已经存储在 Locals 中了
-        if (!equal(Tok, "="))
+        if (!equal(Tok, '='))
         {
             continue;
         }
 
-        Node *LHS = newVarNode(type->name, Var);
-        Node *RHS = assign(&Tok, Tok->next);
+        Node *LHS = newVarNode(D.Name, Var);
+        Node *RHS = assign(&Tok, Tok + 1);
         Node *node = newBinary(ND_ASSIGN, Tok, LHS, RHS);
 
         Cur->next = newUnary(ND_EXPR_STMT, Tok, node);
@@ -880,7 +1311,7 @@ static Node *declaration(Token **Rest, Token *Tok, Type *BaseTy)
     // 将所有表达式语句，存放在代码块中
     Node *node = newNode(ND_BLOCK, Tok);
     node->Body = head.next;
-    *Rest = Tok->next;
+    *Rest = Tok + 1;
     return node;
 }
 
@@ -892,87 +1323,88 @@ static Node *declaration(Token **Rest, Token *Tok, Type *BaseTy)
 //        | exprStmt
 static Node *stmt(Token **Rest, Token *T)
 {
-    if (equal(T, "if"))
+    switch (T->Id)
+    {
+    case KW_IF:
     {
         Node *node = newNode(ND_IF, T);
 
-        T = skip(T->next, "(");
+        T = skip(T + 1, '(');
         node->Cond = expr(&T, T);
-        T = skip(T, ")");
+        T = skip(T, ')');
         node->Then = stmt(&T, T);
 
-        if (equal(T, "else"))
+        if (equal(T, KW_ELSE))
         {
-            node->Else = stmt(&T, T->next);
+            node->Else = stmt(&T, T + 1);
         }
 
         *Rest = T;
         return node;
     }
-    else if (equal(T, "for"))
+    case KW_FOR:
     {
-        T = T->next;
+        T++;
         Node *node = newNode(ND_FOR, T);
 
-        T = skip(T, "(");
+        T = skip(T, '(');
         node->Init = exprStmt(&T, T);
-        if (!equal(T, ";"))
+        if (!equal(T, ';'))
         {
             node->Cond = expr(&T, T);
         }
-        T = skip(T, ";");
-        if (!equal(T, ")"))
+        T = skip(T, ';');
+        if (!equal(T, ')'))
         {
             node->Inc = expr(&T, T);
         }
-        T = skip(T, ")");
+        T = skip(T, ')');
 
         node->Then = stmt(Rest, T);
         return node;
     }
-    else if (equal(T, "while")) // 处理 while 语句，不与 for 共用是为了处理两种语法不同的报错情况
+    case KW_WHILE: // 处理 while 语句，不与 for 共用是为了处理两种语法不同的报错情况
     {
-        T = T->next;
+        T++;
         Node *node = newNode(ND_FOR, T);
 
-        T = skip(T, "(");
+        T = skip(T, '(');
         node->Cond = expr(&T, T);
-        T = skip(T, ")");
+        T = skip(T, ')');
 
         node->Then = stmt(Rest, T);
         return node;
     }
-    else if (equal(T, "return")) // return expr;
+    case KW_RETURN: // return expr;
     {
         Node *node = newNode(ND_RETURN, T);
-        Node *Exp = expr(&T, T->next);
+        Node *Exp = expr(&T, T + 1);
         addType(Exp);
         // 对于返回值进行类型转换
         node->LHS = newCast(Exp, CurrentFn->type->ReturnTy);
 
-        *Rest = skip(T, ";");
+        *Rest = skip(T, ';');
         return node;
     }
-    else if (equal(T, "{"))
-    {
-        return compoundStmt(Rest, T->next);
+    case '{':
+        return compoundStmt(Rest, T + 1);
+    default:
+        // expr;
+        return exprStmt(Rest, T);
     }
-
-    // expr;
-    return exprStmt(Rest, T);
 }
 
 // exprStmt = expr? ";"
 static Node *exprStmt(Token **Rest, Token *Tok)
 {
-    if (equal(Tok, ";")) // 处理空语句
+    if (equal(Tok, ';')) // 处理空语句
     {
-        *Rest = skip(Tok, ";");
+        *Rest = skip(Tok, ';');
         return newNode(ND_BLOCK, Tok);
     }
 
     Node *node = newUnary(ND_EXPR_STMT, Tok, expr(&Tok, Tok));
-    *Rest = skip(Tok, ";");
+    *Rest = skip(Tok, ';');
     return node;
 }
 
@@ -981,174 +1413,260 @@ static Node *exprStmt(Token **Rest, Token *Tok)
 // @param Tok 当前正在解析的 Token
 static Node *expr(Token **Rest, Token *Tok)
 {
-    Node *node = assign(&Tok, Tok);
-    if (equal(Tok, ","))
-    {
-        node = newBinary(ND_COMMA, Tok, node, expr(&Tok, Tok->next));
-    }
-    *Rest = Tok;
-    return node;
+    return exprPrec(Rest, Tok, PREC_COMMA);
 }
 
 // assign = equality ("=" assign)?
-// @param Rest 用于向上传递仍需要解析的 Token 的首部
-// @param Tok 当前正在解析的 Token
 static Node *assign(Token **Rest, Token *Tok)
 {
-    Node *node = equality(&Tok, Tok);
-    if (equal(Tok, "=")) // 处理递归赋值，如："a=b=1;"
+    return exprPrec(Rest, Tok, PREC_ASSIGN);
+}
+
+// unary = ("+" | "-" | "*" | "&") cast  | postfix
+static Node *unary(Token **Rest, Token *Tok)
+{
+    return exprPrec(Rest, Tok, PREC_UNARY);
+}
+
+// 二元运算符的优先级，不是二元运算符的为 PREC_NONE
+static uint8_t BinaryPrec[TID_COUNT] = {
+    [','] = PREC_COMMA,
+    ['='] = PREC_ASSIGN,
+    [TID_EQ] = PREC_EQUALITY,
+    [TID_NE] = PREC_EQUALITY,
+    ['<'] = PREC_RELATIONAL,
+    ['>'] = PREC_RELATIONAL,
+    [TID_LE] = PREC_RELATIONAL,
+    [TID_GE] = PREC_RELATIONAL,
+    ['+'] = PREC_ADD,
+    ['-'] = PREC_ADD,
+    ['*'] = PREC_MUL,
+    ['/'] = PREC_MUL,
+};
+
+// 运算符栈中的项
+typedef enum
+{
+    EOP_BINARY, // 二元运算符
+    EOP_PREFIX, // 一元运算符 "-"、"*"、"&"
+    EOP_CAST,   // 类型转换
+    EOP_PAREN,  // 左括号
+} ExprOpKind;
+
+typedef struct
+{
+    ExprOpKind kind;
+    Token *Tok; // 运算符，类型转换和括号则为 "("
+    Type *Ty;   // 类型转换的目标类型
+} ExprOp;
+
+// 表达式解析的运算符栈和操作数栈，嵌套的解析（如下标、实参）在栈顶继续使用
+static _Thread_local ExprOp *OpStack;
+static _Thread_local int OpCnt;
+static _Thread_local int OpCap;
+static _Thread_local Node **ValStack;
+static _Thread_local int ValCnt;
+static _Thread_local int ValCap;
+
+static void pushOp(ExprOpKind Kind, Token *Tok, Type *Ty)
+{
+    if (OpCnt == OpCap)
     {
-        node = newBinary(ND_ASSIGN, Tok, node, assign(&Tok, Tok->next));
+        OpCap = OpCap ? OpCap * 2 : 64;
+        OpStack = realloc(OpStack, sizeof(ExprOp) * OpCap);
     }
-    *Rest = Tok;
-    return node;
+    OpStack[OpCnt++] = (ExprOp){Kind, Tok, Ty};
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-// @param Rest 用于向上传递仍需要解析的 Token 的首部
-// @param Tok 当前正在解析的 Token
-static Node *equality(Token **Rest, Token *Tok)
+static void pushVal(Node *node)
 {
-    Node *node = relational(&Tok, Tok);
-    while (true)
+    if (ValCnt == ValCap)
     {
-        if (equal(Tok, "=="))
-        {
-            node = newBinary(ND_EQ, Tok, node, relational(&Tok, Tok->next));
-        }
-        else if (equal(Tok, "!="))
-        {
-            node = newBinary(ND_NE, Tok, node, relational(&Tok, Tok->next));
-        }
-        else
-        {
-            *Rest = Tok;
-            return node;
-        }
+        ValCap = ValCap ? ValCap * 2 : 64;
+        ValStack = realloc(ValStack, sizeof(Node *) * ValCap);
     }
+    ValStack[ValCnt++] = node;
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-// @param Rest 用于向上传递仍需要解析的 Token 的首部
-// @param Tok 当前正在解析的 Token
-static Node *relational(Token **Rest, Token *Tok)
+// 构建二元运算节点
+static Node *newBinaryOp(Token *Tok, Node *LHS, Node *RHS)
 {
-    Node *node = add(&Tok, Tok);
-    while (true)
-    {
-        if (equal(Tok, "<"))
-        {
-            node = newBinary(ND_LT, Tok, node, add(&Tok, Tok->next));
-        }
-        else if (equal(Tok, ">"))
-        {
-            node = newBinary(ND_LT, Tok, add(&Tok, Tok->next), node); // a > b 等价于 b < a
-        }
-        else if (equal(Tok, "<="))
-        {
-            node = newBinary(ND_LE, Tok, node, add(&Tok, Tok->next));
-        }
-        else if (equal(Tok, ">="))
-        {
-            node = newBinary(ND_LE, Tok, add(&Tok, Tok->next), node); // a >= b 等价于 b <= a
-        }
-        else
-        {
-            *Rest = Tok;
-            return node;
-        }
+    switch (Tok->Id)
+    {
+    case ',':
+        return newBinary(ND_COMMA, Tok, LHS, RHS);
+    case '=':
+        return newBinary(ND_ASSIGN, Tok, LHS, RHS);
+    case TID_EQ:
+        return newBinary(ND_EQ, Tok, LHS, RHS);
+    case TID_NE:
+        return newBinary(ND_NE, Tok, LHS, RHS);
+    case '<':
+        return newBinary(ND_LT, Tok, LHS, RHS);
+    case '>':
+        return newBinary(ND_LT, Tok, RHS, LHS); // a > b 等价于 b < a
+    case TID_LE:
+        return newBinary(ND_LE, Tok, LHS, RHS);
+    case TID_GE:
+        return newBinary(ND_LE, Tok, RHS, LHS); // a >= b 等价于 b <= a
+    case '+':
+        return newAddBinary(Tok, LHS, RHS);
+    case '-':
+        return newSubBinary(Tok, LHS, RHS);
+    case '*':
+        return newBinary(ND_MUL, Tok, LHS, RHS);
+    case '/':
+        return newBinary(ND_DIV, Tok, LHS, RHS);
+    default:
+        unreachable();
+        return NULL;
     }
 }
 
-// add = mul ("+" mul | "-" mul)*
-// @param Rest 用于向上传递仍需要解析的 Token 的首部
-// @param Tok 当前正在解析的 Token
-static Node *add(Token **Rest, Token *Tok)
+// 弹出栈顶的运算符，作用于操作数栈顶的操作数
+static void reduce(void)
 {
-    Node *node = mul(&Tok, Tok);
-    while (true)
+    ExprOp *Op = &OpStack[--OpCnt];
+    Node **Top = &ValStack[ValCnt - 1];
+
+    switch (Op->kind)
     {
-        if (equal(Tok, "+"))
+    case EOP_CAST:
+        *Top = newCast(*Top, Op->Ty);
+        (*Top)->Tok = Op->Tok;
+        return;
+    case EOP_PREFIX:
+        if (equal(Op->Tok, '-'))
         {
-            node = newAddBinary(Tok, node, mul(&Tok, Tok->next));
+            *Top = newUnary(ND_NEG, Op->Tok, *Top);
         }
-        else if (equal(Tok, "-"))
+        else if (equal(Op->Tok, '*'))
         {
-            node = newSubBinary(Tok, node, mul(&Tok, Tok->next));
+            *Top = newUnary(ND_DEREF, Op->Tok, *Top);
         }
         else
         {
-            *Rest = Tok;
-            return node;
+            *Top = newUnary(ND_ADDR, Op->Tok, *Top);
         }
+        return;
+    case EOP_BINARY:
+    {
+        Node *RHS = ValStack[--ValCnt];
+        Top = &ValStack[ValCnt - 1];
+        *Top = newBinaryOp(Op->Tok, *Top, RHS);
+        return;
+    }
+    default:
+        unreachable();
     }
 }
 
-// mul = cast  ("*" cast  | "/" cast )*
-// @param Rest 用于向上传递仍需要解析的 Token 的首部
-// @param Tok 当前正在解析的 Token
-static Node *mul(Token **Rest, Token *Tok)
+// 优先级爬升：以运算符栈和操作数栈解析二元运算、一元运算、类型转换和括号，
+// 调用深度不随表达式的长度和括号的嵌套层数增长，
+// 括号外只解析优先级不低于 MinPrec 的二元运算符
+static Node *exprPrec(Token **Rest, Token *Tok, int MinPrec)
 {
-    Node *node = cast(&Tok, Tok);
+    // 栈中低于此处的部分属于外层的解析
+    int OpBase = OpCnt;
+    int ValBase = ValCnt;
+    int ParenDepth = 0;
+
     while (true)
     {
-        if (equal(Tok, "*"))
+        // 操作数前的类型转换、一元运算符和左括号
+        while (true)
         {
-            node = newBinary(ND_MUL, Tok, node, cast(&Tok, Tok->next));
+            // "(" typeName ")" cast
+            if (equal(Tok, '(') && isTypename(Tok + 1))
+            {
+                Token *Start = Tok;
+                Type *Ty = typename(&Tok, Tok + 1);
+                Tok = skip(Tok, ')');
+                pushOp(EOP_CAST, Start, Ty);
+                continue;
+            }
+            // "(" expr ")"，语句表达式 "(" "{" 由 primary 解析
+            if (equal(Tok, '(') && !equal(Tok + 1, '{'))
+            {
+                pushOp(EOP_PAREN, Tok, NULL);
+                ParenDepth++;
+                Tok++;
+                continue;
+            }
+            // "+" cast 等价于 cast
+            if (equal(Tok, '+'))
+            {
+                Tok++;
+                continue;
+            }
+            if (equal(Tok, '-') || equal(Tok, '*') || equal(Tok, '&'))
+            {
+                pushOp(EOP_PREFIX, Tok, NULL);
+                Tok++;
+                continue;
+            }
+            break;
         }
-        else if (equal(Tok, "/"))
+
+        pushVal(postfix(&Tok, Tok));
+
+        while (true)
         {
-            node = newBinary(ND_DIV, Tok, node, cast(&Tok, Tok->next));
+            // 一元运算符和类型转换作用于紧随其后的操作数
+            while (OpCnt > OpBase && (OpStack[OpCnt - 1].kind == EOP_PREFIX ||
+                                      OpStack[OpCnt - 1].kind == EOP_CAST))
+            {
+                reduce();
+            }
+
+            if (!ParenDepth || !equal(Tok, ')'))
+            {
+                break;
+            }
+
+            // ")"，括号内的运算全部完成后，括号整体作为 postfix 的操作数
+            while (OpStack[OpCnt - 1].kind != EOP_PAREN)
+            {
+                reduce();
+            }
+            OpCnt--;
+            ParenDepth--;
+            // 下标中的表达式递归解析时可能扩大操作数栈，所以先保存结果再写回栈顶
+            Node *node = postfixOps(&Tok, Tok + 1, ValStack[ValCnt - 1]);
+            ValStack[ValCnt - 1] = node;
         }
-        else
+
+        int Prec = BinaryPrec[Tok->Id];
+        if (!Prec || (!ParenDepth && Prec < MinPrec))
         {
-            *Rest = Tok;
-            return node;
+            if (ParenDepth)
+            {
+                skip(Tok, ')'); // 报错：括号未闭合
+            }
+            break;
         }
-    }
-}
 
-// 解析类型转换
-// cast = "(" typeName ")" cast | unary
-static Node *cast(Token **Rest, Token *Tok)
-{
-    // cast = "(" typeName ")" cast
-    if (equal(Tok, "(") && isTypename(Tok->next))
-    {
-        Token *start = Tok;
-        Type *Ty = typename(&Tok, Tok->next);
-        Tok = skip(Tok, ")");
-        // 解析嵌套的类型转换
-        Node *node = newCast(cast(Rest, Tok), Ty);
-        node->Tok = start;
-        return node;
+        // 优先级更高的运算符先完成，同级时左结合的先完成，"," 和 "=" 右结合
+        while (OpCnt > OpBase && OpStack[OpCnt - 1].kind == EOP_BINARY)
+        {
+            int TopPrec = BinaryPrec[OpStack[OpCnt - 1].Tok->Id];
+            if (TopPrec < Prec || (TopPrec == Prec && (Prec == PREC_COMMA || Prec == PREC_ASSIGN)))
+            {
+                break;
+            }
+            reduce();
+        }
+        pushOp(EOP_BINARY, Tok, NULL);
+        Tok++;
     }
-    // unary
-    return unary(Rest, Tok);
-}
 
-// unary = ("+" | "-" | "*" | "&") cast  | postfix
-// @param Rest 用于向上传递仍需要解析的 Token 的首部
-// @param Tok 当前正在解析的 Token
-static Node *unary(Token **Rest, Token *T)
-{
-    if (equal(T, "+"))
-    {
-        return cast(Rest, T->next);
-    }
-    else if (equal(T, "-"))
-    {
-        return newUnary(ND_NEG, T, cast(Rest, T->next));
-    }
-    else if (equal(T, "*"))
+    while (OpCnt > OpBase)
     {
-        return newUnary(ND_DEREF, T, cast(Rest, T->next));
+        reduce();
     }
-    else if (equal(T, "&"))
-    {
-        return newUnary(ND_ADDR, T, cast(Rest, T->next));
-    }
-    return postfix(Rest, T); // Tok 未进行运算，需要解析首部仍为 Rest
+    assert(ValCnt == ValBase + 1);
+    *Rest = Tok;
+    return ValStack[--ValCnt];
 }
 
 // structMembers = (declspec declarator (","  declarator)* ";")* "}"
@@ -1157,17 +1675,17 @@ static void structMembers(Token **Rest, Token *Tok, Type *type)
     Member Head = {};
     Member *Cur = &Head;
 
-    while (!equal(Tok, "}"))
+    while (!equal(Tok, '}'))
     {
         // declspec
         Type *BaseTy = declspec(&Tok, Tok, NULL);
 
         bool isFirst = true;
-        while (!consume(&Tok, Tok, ";"))
+        while (!consume(&Tok, Tok, ';'))
         {
             if (!isFirst)
             {
-                Tok = skip(Tok, ",");
+                Tok = skip(Tok, ',');
             }
             else
             {
@@ -1175,16 +1693,18 @@ static void structMembers(Token **Rest, Token *Tok, Type *type)
             }
 
             // declarator
-            Member *Mem = calloc(1, sizeof(Member));
-            Mem->type = declarator(&Tok, Tok, BaseTy);
-            Mem->name = Mem->type->name;
+            Member *Mem = arenaAlloc(AK_TYPE, sizeof(Member));
+            Decl D = {};
+            Mem->type = declarator(&Tok, Tok, BaseTy, &D);
+            Mem->name = D.Name;
             Cur->next = Mem;
             Cur = Mem;
         }
     }
 
-    *Rest = Tok->next;
+    *Rest = Tok + 1;
     type->Mems = Head.next;
+    indexMembers(type);
 }
 
 // structUnionDecl = ident? ("{" structMembers)?
@@ -1195,11 +1715,11 @@ static Type *structUnionDecl(Token **Rest, Token *Tok)
     if (Tok->kind == TK_IDENT)
     {
         Tag = Tok;
-        Tok = Tok->next;
+        Tok++;
     }
 
     // 构造已定义标签的结构体
-    if (Tag && !equal(Tok, "{"))
+    if (Tag && !equal(Tok, '{'))
     {
         Type *type = FindTag(Tag);
         if (!type)
@@ -1211,15 +1731,15 @@ static Type *structUnionDecl(Token **Rest, Token *Tok)
     }
 
     // 定义结构体标签或构造未定义结构体标签的结构体
-    Type *type = calloc(1, sizeof(Type));
+    Type *type = arenaAlloc(AK_TYPE, sizeof(Type));
     type->kind = TY_STRUCT;
-    structMembers(Rest, Tok->next, type);
+    structMembers(Rest, Tok + 1, type);
     type->align = 1;
 
     // 如果是非匿名结构体，注册标签
     if (Tag)
     {
-        pushTagScope(Tag, type);
+        pushTagScope(Tag->Name, type);
     }
 
     return type;
@@ -1276,29 +1796,34 @@ static Type *unionDecl(Token **Rest, Token *Tok)
 static Node *postfix(Token **Rest, Token *Tok)
 {
     Node *node = primary(&Tok, Tok);
+    return postfixOps(Rest, Tok, node);
+}
 
+// 解析 node 之后的 ("[" expr "]" | "." ident | "->" ident)*
+static Node *postfixOps(Token **Rest, Token *Tok, Node *node)
+{
     while (true)
     {
-        if (equal(Tok, "["))
+        if (equal(Tok, '['))
         {
             // x[y] 等价于 *(x+y)
-            Token *start = Tok->next;
-            Node *Idx = expr(&Tok, Tok->next);
-            Tok = skip(Tok, "]");
+            Token *start = Tok + 1;
+            Node *Idx = expr(&Tok, Tok + 1);
+            Tok = skip(Tok, ']');
             node = newUnary(ND_DEREF, start, newAddBinary(start, node, Idx));
             continue;
         }
-        else if (equal(Tok, ".")) // "." ident
+        else if (equal(Tok, '.')) // "." ident
         {
-            node = structRef(node, Tok->next);
-            Tok = Tok->next->next;
+            node = structRef(node, Tok + 1);
+            Tok += 2;
             continue;
         }
-        else if (equal(Tok, "->")) // "->" ident
+        else if (equal(Tok, TID_ARROW)) // "->" ident
         {
             node = newUnary(ND_DEREF, Tok, node);
-            node = structRef(node, Tok->next);
-            Tok = Tok->next->next;
+            node = structRef(node, Tok + 1);
+            Tok += 2;
             continue;
         }
 
@@ -1311,7 +1836,7 @@ static Node *postfix(Token **Rest, Token *Tok)
 }
 
 // primary = "(" "{" stmt+ "}" ")" [GNU]
-//         | "(" expr ")"
+//         | "(" expr ")"（由 exprPrec 解析）
 //         | "sizeof" unary
 //         | "sizeof" "(" typeName ")"
 //         | ident funcArgs?
@@ -1323,37 +1848,29 @@ static Node *primary(Token **Rest, Token *Tok)
 {
     Token *start = Tok;
 
-    if (equal(Tok, "("))
+    // "(" "{" stmt+ "}" ")" [GNU]
+    if (equal(Tok, '(') && equal(Tok + 1, '{'))
     {
-        // "(" "{" stmt+ "}" ")" [GNU]
-        if (equal(Tok->next, "{"))
-        {
-            Node *node = newNode(ND_STMT_EXPR, Tok);
-            node->Body = compoundStmt(&Tok, Tok->next->next)->Body;
-            *Rest = skip(Tok, ")");
-            return node;
-        }
-
-        // "(" expr ")"
-        Node *node = expr(&Tok, Tok->next);
-        *Rest = skip(Tok, ")");
+        Node *node = newNode(ND_STMT_EXPR, Tok);
+        node->Body = compoundStmt(&Tok, Tok + 2)->Body;
+        *Rest = skip(Tok, ')');
         return node;
     }
-    else if (equal(Tok, "sizeof") && equal(Tok->next, "(") && isTypename(Tok->next->next)) // "sizeof" "(" typeName ")"
+    else if (equal(Tok, KW_SIZEOF) && equal(Tok + 1, '(') && isTypename(Tok + 2)) // "sizeof" "(" typeName ")"
     {
-        Type *Ty = typename(&Tok, Tok->next->next);
-        *Rest = skip(Tok, ")");
+        Type *Ty = typename(&Tok, Tok + 2);
+        *Rest = skip(Tok, ')');
         return newNumNode(start, Ty->size);
     }
-    else if (equal(Tok, "sizeof"))
+    else if (equal(Tok, KW_SIZEOF))
     {
-        Node *node = unary(Rest, Tok->next);
+        Node *node = unary(Rest, Tok + 1);
         addType(node);
         return newNumNode(Tok, node->type->size);
     }
     else if (Tok->kind == TK_IDENT)
     {
-        if (equal(Tok->next, "("))
+        if (equal(Tok + 1, '('))
         {
             return Funcall(Rest, Tok);
         }
@@ -1364,19 +1881,20 @@ static Node *primary(Token **Rest, Token *Tok)
             errorTok(Tok, "undefined variable");
         }
         Node *node = newVarNode(Tok, S->Var);
-        *Rest = Tok->next;
+        *Rest = Tok + 1;
         return node;
     }
     else if (Tok->kind == TK_STR)
     {
-        Obj *Var = newStringLiteral(Tok->Str, Tok->type);
-        *Rest = Tok->next;
+        StrLiteral *Lit = getStrLiteral(Tok);
+        Obj *Var = newStringLiteral(Lit->Str, arrayOf(TyChar, Lit->Len));
+        *Rest = Tok + 1;
         return newVarNode(Tok, Var);
     }
     else if (Tok->kind == TK_NUM)
     {
         Node *node = newNumNode(Tok, Tok->Val);
-        *Rest = Tok->next;
+        *Rest = Tok + 1;
         return node;
     }
     else
@@ -1399,35 +1917,16 @@ static Type *typename(Token **Rest, Token *Tok)
 // abstractDeclarator = "*"* ("(" abstractDeclarator ")")? typeSuffix
 static Type *abstractDeclarator(Token **Rest, Token *Tok, Type *Ty)
 {
-    // "*"*
-    while (equal(Tok, "*"))
-    {
-        Ty = pointerTo(Ty);
-        Tok = Tok->next;
-    }
-
-    if (equal(Tok, "("))
-    {
-        Token *Start = Tok;
-        Type Dummy = {};
-        // 使 Tok 前进到")"后面的位置
-        abstractDeclarator(&Tok, Start->next, &Dummy);
-        Tok = skip(Tok, ")");
-        // 获取到括号后面的类型后缀，Ty 为解析完的类型，Rest 指向分号
-        Ty = typeSuffix(Rest, Tok, Ty);
-        // 解析 Ty 整体作为 Base 去构造，返回 Type 的值
-        return abstractDeclarator(&Tok, Start->next, Ty);
-    }
-
-    // typeSuffix
-    return typeSuffix(Rest, Tok, Ty);
+    TypeChain C = {};
+    declaratorChain(Rest, Tok, &C, NULL);
+    return applyTypeChain(&C, Ty, NULL);
 }
 
 // Funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *Funcall(Token **Rest, Token *Tok)
 {
     Token *Start = Tok;
-    Tok = Tok->next->next;
+    Tok += 2;
 
     VarScope *S = FindVarByName(Start); // 用函数名查找
     if (!S)
@@ -1441,31 +1940,30 @@ static Node *Funcall(Token **Rest, Token *Tok)
 
     // 函数名的类型
     Type *type = S->Var->type;
-    // 函数形参的类型
-    Type *ParamTy = type->Params;
+    // 下一个形参的下标
+    int ParamIdx = 0;
     Node head = {};
     Node *Cur = &head;
 
-    while (!equal(Tok, ")"))
+    while (!equal(Tok, ')'))
     {
         if (Cur != &head)
         {
-            Tok = skip(Tok, ",");
+            Tok = skip(Tok, ',');
         }
 
         // assign
         Node *Arg = assign(&Tok, Tok);
         addType(Arg);
 
-        if (ParamTy)
+        if (ParamIdx < type->ParamCnt)
         {
+            Type *ParamTy = type->Params[ParamIdx++];
             if (ParamTy->kind == TY_STRUCT || ParamTy->kind == TY_UNION)
             {
                 errorTok(Arg->Tok, "passing struct or union is not supported yet");
             }
             Arg = newCast(Arg, ParamTy); // 将参数节点的类型进行转换
-
-            ParamTy = ParamTy->next; // 前进到下一个形参类型
         }
 
         Cur->next = Arg;
@@ -1473,13 +1971,30 @@ static Node *Funcall(Token **Rest, Token *Tok)
         addType(Cur);
     }
 
-    *Rest = skip(Tok, ")");
+    *Rest = skip(Tok, ')');
 
     Node *node = newNode(ND_FUNCALL, Start);
-    node->FuncName = strndup(Start->Loc, Start->Len);
+    node->FuncName = Start->Name;
     node->FuncType = type;     // 函数类型
     node->type = type->ReturnTy; // 读取的返回类型
     node->Args = head.next;
 
     return node;
 }
+
+// 清除全局域和解析的状态，出错中断时局部域和表达式的栈中可能有残留
+void parseReset(void)
+{
+    Locals = NULL;
+    Globals = NULL;
+    Scp = &GlobalScope;
+    GlobalScope.Vars = NULL;
+    GlobalScope.Tags = NULL;
+    hashmapFree(&VarMap);
+    hashmapFree(&TagMap);
+    CurrentFn = NULL;
+    StrLitCnt = 0;
+    OpCnt = 0;
+    ValCnt = 0;
+    hashmapFree(&FpSeen);
+}
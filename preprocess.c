@@ -0,0 +1,1383 @@
+#include "rvcc.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// 预处理
+//
+// 在词法分析产生的终结符数组上处理预处理指令并展开宏，结果写入新的终结符数组。
+// 待处理的终结符组织为帧的栈：文件（主文件和被包含的头文件）和宏展开的结果各为一帧。
+// 宏展开采用 Prosser 算法，每个终结符带有一个隐藏集，记录产生它的宏，
+// 展开时跳过隐藏集中的宏，以免宏递归地展开自身。
+//
+
+// 隐藏集，宏名称的链表，名称为驻留的字符串，直接比较指针
+typedef struct Hideset Hideset;
+struct Hideset
+{
+    Hideset *next;
+    char *Name;
+};
+
+// 宏
+typedef struct
+{
+    char *Name;     // 名称
+    bool FuncLike;  // 是否为函数式宏
+    bool Variadic;  // 是否有可变参数，可变参数为最后一个形参 __VA_ARGS__
+    char **Params;  // 形参的名称
+    int ParamCnt;   // 形参的数量
+    Token *Body;    // 宏体，指向定义所在文件的终结符数组
+    int BodyLen;    // 宏体的终结符数
+} Macro;
+
+// 宏表，以驻留的名称为键
+static _Thread_local HashMap Macros;
+
+// 头文件，每个头文件在进程内只读入和分析一次，
+// 服务器模式下之后的编译第一次包含它时，文件没有变化则继续使用
+typedef struct
+{
+    Token *Toks;   // 终结符，不含 TK_EOF
+    Token *End;    // 终结符的末尾，即 TK_EOF
+    File *F;       // 所在的输入文件
+    char *Guard;   // 包含保护的宏名称：整个文件包在 #ifndef Guard ... #endif 中
+    bool Once;     // 是否含有 #pragma once
+    bool Included; // 本次编译中是否已被包含过
+
+    // 读入时文件的状态，用于判断文件是否变化
+    dev_t Dev;
+    ino_t Ino;
+    off_t Size;
+    struct timespec MTime;
+} Header;
+
+// 头文件的缓存，以绝对路径为键
+static _Thread_local HashMap Headers;
+// 当前目录，用于将相对路径转换为绝对路径
+static _Thread_local char *Cwd;
+
+// #include 搜索的目录
+static _Thread_local char **IncludePaths;
+static _Thread_local int IncludePathCnt;
+
+// 条件编译所处的分支
+typedef enum
+{
+    IN_THEN, // #if、#ifdef 或 #ifndef 之后
+    IN_ELIF, // #elif 之后
+    IN_ELSE, // #else 之后
+} CondCtx;
+
+// 条件编译的栈
+typedef struct
+{
+    CondCtx Ctx;   // 所处的分支
+    bool Included; // 是否已有分支被选中
+    Token *Tok;    // 开始条件编译的指令，用于报告未结束的条件编译
+} CondIncl;
+
+static _Thread_local CondIncl *Conds;
+static _Thread_local int CondCnt;
+static _Thread_local int CondCap;
+
+// 帧，一段待处理的终结符
+typedef struct
+{
+    Token *Cur;   // 下一个终结符
+    Token *End;   // 末尾
+    Hideset **HS; // 宏展开的结果中各终结符的隐藏集，与 Cur 同步前进，文件的终结符为 NULL
+    char *Path;   // 文件的路径，宏展开的结果为 NULL
+    Header *H;    // 头文件的缓存项，主文件为 NULL
+    int CondBase; // 进入文件时条件编译栈的深度
+} Frame;
+
+static _Thread_local Frame *Frames;
+static _Thread_local int FrameCnt;
+static _Thread_local int FrameCap;
+
+// 终结符及其隐藏集的可变长数组，用于收集宏的实参和展开的结果
+typedef struct
+{
+    Token *Toks;
+    Hideset **HS;
+    int Cnt;
+    int Cap;
+} TokVec;
+
+// 添加 #include 搜索的目录
+void addIncludePath(char *Dir)
+{
+    IncludePaths = realloc(IncludePaths, sizeof(char *) * (IncludePathCnt + 1));
+    IncludePaths[IncludePathCnt++] = Dir;
+}
+
+//
+// 隐藏集
+//
+
+static Hideset *newHideset(char *Name, Hideset *Next)
+{
+    Hideset *HS = arenaAlloc(AK_MACRO, sizeof(Hideset));
+    HS->Name = Name;
+    HS->next = Next;
+    return HS;
+}
+
+static bool hidesetContains(Hideset *HS, char *Name)
+{
+    for (; HS; HS = HS->next)
+    {
+        if (HS->Name == Name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 两个隐藏集的并集，B 作为结果的尾部共享
+static Hideset *hidesetUnion(Hideset *A, Hideset *B)
+{
+    if (!B)
+    {
+        return A;
+    }
+    for (; A; A = A->next)
+    {
+        if (!hidesetContains(B, A->Name))
+        {
+            B = newHideset(A->Name, B);
+        }
+    }
+    return B;
+}
+
+// 两个隐藏集的交集
+static Hideset *hidesetIntersect(Hideset *A, Hideset *B)
+{
+    Hideset *HS = NULL;
+    for (; A; A = A->next)
+    {
+        if (hidesetContains(B, A->Name))
+        {
+            HS = newHideset(A->Name, HS);
+        }
+    }
+    return HS;
+}
+
+//
+// 帧和终结符数组
+//
+
+static void pushTok(TokVec *V, Token *Tok, Hideset *HS)
+{
+    if (V->Cnt == V->Cap)
+    {
+        V->Cap = V->Cap ? V->Cap * 2 : 16;
+        V->Toks = realloc(V->Toks, sizeof(Token) * V->Cap);
+        V->HS = realloc(V->HS, sizeof(Hideset *) * V->Cap);
+    }
+    V->Toks[V->Cnt] = *Tok;
+    V->HS[V->Cnt++] = HS;
+}
+
+static void freeTokVec(TokVec *V)
+{
+    free(V->Toks);
+    free(V->HS);
+    *V = (TokVec){};
+}
+
+static void pushFrame(Frame F)
+{
+    if (FrameCnt == FrameCap)
+    {
+        FrameCap = FrameCap ? FrameCap * 2 : 16;
+        Frames = realloc(Frames, sizeof(Frame) * FrameCap);
+    }
+    Frames[FrameCnt++] = F;
+}
+
+// 将宏展开的结果作为新的一帧，Origin 为被展开的宏名
+static void pushExpansion(TokVec *V, Token *Origin)
+{
+    if (V->Cnt == 0)
+    {
+        return;
+    }
+
+    Token *Toks = arenaAlloc(AK_MACRO, sizeof(Token) * V->Cnt);
+    Hideset **HS = arenaAlloc(AK_MACRO, sizeof(Hideset *) * V->Cnt);
+    memcpy(Toks, V->Toks, sizeof(Token) * V->Cnt);
+    memcpy(HS, V->HS, sizeof(Hideset *) * V->Cnt);
+    // 展开的结果不会构成预处理指令，开头的空白与宏名相同
+    for (int I = 0; I < V->Cnt; I++)
+    {
+        Toks[I].AtBOL = false;
+    }
+    Toks[0].HasSpace = Origin->HasSpace;
+
+    pushFrame((Frame){.Cur = Toks, .End = Toks + V->Cnt, .HS = HS});
+}
+
+// 弹出已读完的宏展开的帧，返回栈顶的帧，不弹出 Depth 以下的帧，没有帧时返回 NULL。
+// 读完的文件由 expand 弹出，因为需要检查其中的条件编译是否都已结束
+static Frame *topFrame(int Depth)
+{
+    while (FrameCnt > Depth)
+    {
+        Frame *F = &Frames[FrameCnt - 1];
+        if (F->Cur < F->End || F->Path)
+        {
+            return F;
+        }
+        FrameCnt--;
+    }
+    return NULL;
+}
+
+// 读取帧中的下一个终结符，通过 HS 返回其隐藏集
+static Token *nextTok(Frame *F, Hideset **HS)
+{
+    *HS = F->HS ? *F->HS++ : NULL;
+    return F->Cur++;
+}
+
+//
+// 宏展开
+//
+
+// 判断终结符的拼写是否为 S，预处理指令的名称可能是标识符或关键字，因此比较拼写
+static bool isName(Token *Tok, char *S)
+{
+    return (Tok->kind == TK_IDENT || Tok->kind == TK_KEYWORD) &&
+           (int)strlen(S) == Tok->Len && !strncmp(Tok->Loc, S, Tok->Len);
+}
+
+// 形参的下标，不是形参时返回 -1
+static int paramIndex(Macro *M, Token *Tok)
+{
+    if (Tok->kind != TK_IDENT)
+    {
+        return -1;
+    }
+    for (int I = 0; I < M->ParamCnt; I++)
+    {
+        if (M->Params[I] == Tok->Name)
+        {
+            return I;
+        }
+    }
+    return -1;
+}
+
+// 将实参的各终结符的拼写连接为字符串字面量，Hash 为 # 操作符
+static Token stringize(Token *Hash, TokVec *Arg)
+{
+    // 终结符之间有空白时以一个空格分隔，双引号和反斜杠需要转义
+    int Len = 2;
+    for (int I = 0; I < Arg->Cnt; I++)
+    {
+        Len += Arg->Toks[I].Len * 2 + 1;
+    }
+
+    char *Buf = malloc(Len + 1);
+    int N = 0;
+    Buf[N++] = '"';
+    for (int I = 0; I < Arg->Cnt; I++)
+    {
+        Token *Tok = &Arg->Toks[I];
+        if (I > 0 && Tok->HasSpace)
+        {
+            Buf[N++] = ' ';
+        }
+        for (int J = 0; J < Tok->Len; J++)
+        {
+            char C = Tok->Loc[J];
+            if (C == '"' || C == '\\')
+            {
+                Buf[N++] = '\\';
+            }
+            Buf[N++] = C;
+        }
+    }
+    Buf[N++] = '"';
+
+    Token Tok;
+    if (!tokenizeOne(Buf, N, &Tok))
+    {
+        errorTok(Hash, "cannot stringize macro argument");
+    }
+    free(Buf);
+    Tok.HasSpace = Hash->HasSpace;
+    return Tok;
+}
+
+// 将 RHS 拼接到 LHS 上，结果必须构成一个终结符
+static void paste(Token *LHS, Token *RHS)
+{
+    char *Buf = format("%.*s%.*s", LHS->Len, LHS->Loc, RHS->Len, RHS->Loc);
+    Token Tok;
+    if (!tokenizeOne(Buf, strlen(Buf), &Tok))
+    {
+        errorTok(LHS, "pasting forms '%s', an invalid token", Buf);
+    }
+    free(Buf);
+    Tok.HasSpace = LHS->HasSpace;
+    *LHS = Tok;
+}
+
+static void expand(TokVec *Out, int Depth);
+
+// 将实参完全展开，实参单独作为一帧，展开时不会读取到实参之后的终结符
+static TokVec expandArg(TokVec *Arg)
+{
+    TokVec V = {};
+    int Depth = FrameCnt;
+    pushFrame((Frame){.Cur = Arg->Toks, .End = Arg->Toks + Arg->Cnt, .HS = Arg->HS});
+    expand(&V, Depth);
+    return V;
+}
+
+// 将实参的终结符加上隐藏集 HS 后加入 V，Param 为宏体中的形参
+static void copyArg(TokVec *V, TokVec *Arg, Token *Param, Hideset *HS)
+{
+    for (int I = 0; I < Arg->Cnt; I++)
+    {
+        pushTok(V, &Arg->Toks[I], hidesetUnion(Arg->HS[I], HS));
+        if (I == 0)
+        {
+            V->Toks[V->Cnt - 1].HasSpace = Param->HasSpace;
+        }
+    }
+}
+
+// 用实参替换宏体中的形参，处理 # 和 ## 操作符，结果的终结符都加上隐藏集 HS
+static void subst(TokVec *V, Macro *M, TokVec *Args, Hideset *HS)
+{
+    Token *Body = M->Body;
+    int N = M->BodyLen;
+
+    for (int I = 0; I < N; I++)
+    {
+        Token *Tok = &Body[I];
+
+        // "#" 形参，替换为实参的拼写组成的字符串
+        if (M->FuncLike && equal(Tok, '#'))
+        {
+            int P = I + 1 < N ? paramIndex(M, &Body[I + 1]) : -1;
+            if (P < 0)
+            {
+                errorTok(Tok, "'#' is not followed by a macro parameter");
+            }
+            Token Str = stringize(Tok, &Args[P]);
+            pushTok(V, &Str, HS);
+            I++;
+            continue;
+        }
+
+        // "##" 将前后两个终结符拼接为一个，两侧的形参替换为未展开的实参
+        if (equal(Tok, TID_HASHHASH))
+        {
+            if (V->Cnt == 0)
+            {
+                errorTok(Tok, "'##' cannot appear at either end of macro expansion");
+            }
+            if (I + 1 == N)
+            {
+                errorTok(Tok, "'##' cannot appear at either end of macro expansion");
+            }
+
+            Token *RHS = &Body[++I];
+            int P = paramIndex(M, RHS);
+            if (P < 0)
+            {
+                paste(&V->Toks[V->Cnt - 1], RHS);
+                continue;
+            }
+
+            TokVec *Arg = &Args[P];
+            if (Arg->Cnt > 0)
+            {
+                paste(&V->Toks[V->Cnt - 1], &Arg->Toks[0]);
+                for (int J = 1; J < Arg->Cnt; J++)
+                {
+                    pushTok(V, &Arg->Toks[J], hidesetUnion(Arg->HS[J], HS));
+                }
+            }
+            continue;
+        }
+
+        int P = paramIndex(M, Tok);
+        if (P >= 0)
+        {
+            TokVec *Arg = &Args[P];
+
+            // 形参 "##"，实参不展开
+            if (I + 1 < N && equal(&Body[I + 1], TID_HASHHASH))
+            {
+                if (Arg->Cnt > 0)
+                {
+                    copyArg(V, Arg, Tok, HS);
+                    continue;
+                }
+
+                // 实参为空时，"##" 直接取右侧的终结符，右侧为形参时取其未展开的实参
+                int P2 = I + 2 < N ? paramIndex(M, &Body[I + 2]) : -1;
+                if (P2 >= 0)
+                {
+                    copyArg(V, &Args[P2], &Body[I + 2], HS);
+                    I += 2;
+                }
+                else
+                {
+                    I++;
+                }
+                continue;
+            }
+
+            // 其他情况下，实参完全展开后再替换
+            TokVec Expanded = expandArg(Arg);
+            copyArg(V, &Expanded, Tok, HS);
+            freeTokVec(&Expanded);
+            continue;
+        }
+
+        pushTok(V, Tok, HS);
+    }
+}
+
+// 读取函数式宏的实参，左括号已被读取，通过 RParenHS 返回右括号的隐藏集
+static TokVec *readArgs(Macro *M, Token *Name, int Depth, Hideset **RParenHS)
+{
+    // 至少分配一个实参，以便无形参的宏调用时括号内为空
+    int Cap = M->ParamCnt > 0 ? M->ParamCnt : 1;
+    TokVec *Args = calloc(Cap, sizeof(TokVec));
+    int Cnt = 1;
+    int Level = 0;
+
+    while (true)
+    {
+        Frame *F = topFrame(Depth);
+        if (!F || F->Cur == F->End)
+        {
+            errorTok(Name, "unterminated argument list invoking macro");
+        }
+
+        Hideset *HS;
+        Token *Tok = nextTok(F, &HS);
+
+        if (Level == 0 && equal(Tok, ')'))
+        {
+            *RParenHS = HS;
+            break;
+        }
+
+        // 逗号分隔实参，可变参数的逗号属于实参本身
+        if (Level == 0 && equal(Tok, ',') && !(M->Variadic && Cnt == M->ParamCnt))
+        {
+            if (Cnt == Cap)
+            {
+                errorTok(Name, "too many arguments");
+            }
+            Cnt++;
+            continue;
+        }
+
+        if (equal(Tok, '('))
+        {
+            Level++;
+        }
+        else if (equal(Tok, ')'))
+        {
+            Level--;
+        }
+        pushTok(&Args[Cnt - 1], Tok, HS);
+    }
+
+    // 可变参数可以省略
+    if (M->Variadic && Cnt == M->ParamCnt - 1)
+    {
+        Cnt++;
+    }
+    if (Cnt < Cap)
+    {
+        errorTok(Name, "too few arguments");
+    }
+    if (M->ParamCnt == 0 && Args[0].Cnt > 0)
+    {
+        errorTok(Name, "too many arguments");
+    }
+    return Args;
+}
+
+// 如果 Tok 是需要展开的宏，展开并将结果作为新的一帧，返回 true
+static bool expandMacro(Token *Tok, Hideset *HS, int Depth)
+{
+    if (Tok->kind != TK_IDENT)
+    {
+        return false;
+    }
+    Macro *M = hashmapGetPtr(&Macros, Tok->Name);
+    if (!M || hidesetContains(HS, M->Name))
+    {
+        return false;
+    }
+
+    TokVec V = {};
+    if (!M->FuncLike)
+    {
+        subst(&V, M, NULL, newHideset(M->Name, HS));
+        pushExpansion(&V, Tok);
+        freeTokVec(&V);
+        return true;
+    }
+
+    // 函数式宏的宏名之后不是左括号时，不展开
+    Frame *F = topFrame(Depth);
+    if (!F || F->Cur == F->End || !equal(F->Cur, '('))
+    {
+        return false;
+    }
+    Hideset *Ignored;
+    nextTok(F, &Ignored);
+
+    Hideset *RParenHS;
+    TokVec *Args = readArgs(M, Tok, Depth, &RParenHS);
+    // 展开的结果带有宏名和右括号共同的隐藏集
+    subst(&V, M, Args, newHideset(M->Name, hidesetIntersect(HS, RParenHS)));
+    for (int I = 0; I < (M->ParamCnt > 0 ? M->ParamCnt : 1); I++)
+    {
+        freeTokVec(&Args[I]);
+    }
+    free(Args);
+
+    pushExpansion(&V, Tok);
+    freeTokVec(&V);
+    return true;
+}
+
+//
+// 预处理指令
+//
+
+// 判断 Tok 是否为名称为 Name 的预处理指令的 #，End 为所在文件的末尾
+static bool isDirective(Token *Tok, Token *End, char *Name)
+{
+    return Tok + 1 < End && Tok->AtBOL && equal(Tok, '#') && !Tok[1].AtBOL && isName(&Tok[1], Name);
+}
+
+// 判断 Tok 是否为开始条件编译的预处理指令的 #
+static bool isIfDirective(Token *Tok, Token *End)
+{
+    return isDirective(Tok, End, "if") || isDirective(Tok, End, "ifdef") ||
+           isDirective(Tok, End, "ifndef");
+}
+
+// 跳过条件不成立的分支，停在对应的 #elif、#else 或 #endif 处
+static void skipCondIncl(Frame *F)
+{
+    int Level = 0;
+    Token *Tok = F->Cur;
+    for (; Tok < F->End; Tok++)
+    {
+        if (isIfDirective(Tok, F->End))
+        {
+            Level++;
+            continue;
+        }
+        if (isDirective(Tok, F->End, "endif"))
+        {
+            if (Level == 0)
+            {
+                break;
+            }
+            Level--;
+            continue;
+        }
+        if (Level == 0 && (isDirective(Tok, F->End, "elif") || isDirective(Tok, F->End, "else")))
+        {
+            break;
+        }
+    }
+    F->Cur = Tok;
+}
+
+// 检查头文件是否整个包在 #ifndef X ... #endif 中，是则返回 X
+static char *detectGuard(Token *Toks, Token *End)
+{
+    if (!isDirective(Toks, End, "ifndef") || Toks + 2 >= End || Toks[2].kind != TK_IDENT ||
+        !Toks[3].AtBOL)
+    {
+        return NULL;
+    }
+
+    // 与 #ifndef 对应的 #endif 必须是文件的最后一行
+    int Level = 0;
+    for (Token *Tok = Toks; Tok < End; Tok++)
+    {
+        if (isIfDirective(Tok, End))
+        {
+            Level++;
+        }
+        else if (isDirective(Tok, End, "endif") && --Level == 0)
+        {
+            return Tok + 2 == End ? Toks[2].Name : NULL;
+        }
+    }
+    return NULL;
+}
+
+// 判断文件是否存在
+static bool fileExists(char *Path)
+{
+    struct stat St;
+    return !stat(Path, &St) && S_ISREG(St.st_mode);
+}
+
+// 查找被包含的文件，"..." 先在当前文件所在的目录中查找，再在 -I 指定的目录中查找
+static char *searchInclude(char *Name, bool Quote, char *Includer)
+{
+    if (Name[0] == '/')
+    {
+        return fileExists(Name) ? Name : NULL;
+    }
+
+    if (Quote)
+    {
+        char *Slash = strrchr(Includer, '/');
+        char *Path = Slash ? format("%.*s/%s", (int)(Slash - Includer), Includer, Name) : Name;
+        if (fileExists(Path))
+        {
+            return Path;
+        }
+    }
+
+    for (int I = 0; I < IncludePathCnt; I++)
+    {
+        char *Path = format("%s/%s", IncludePaths[I], Name);
+        if (fileExists(Path))
+        {
+            return Path;
+        }
+    }
+    return NULL;
+}
+
+// 头文件在缓存中的键，相对路径按当前目录转换为绝对路径，
+// 服务器模式下不同请求的当前目录可能不同
+static char *headerKey(char *Path)
+{
+    if (Path[0] == '/')
+    {
+        return strdup(Path);
+    }
+    if (!Cwd)
+    {
+        Cwd = getcwd(NULL, 0);
+        if (!Cwd)
+        {
+            error("cannot get current directory: %s", strerror(errno));
+        }
+    }
+    return format("%s/%s", Cwd, Path);
+}
+
+// 缓存的头文件是否仍与磁盘上的文件相同
+static bool headerValid(Header *H, char *Path)
+{
+    struct stat St;
+    return stat(Path, &St) == 0 && St.st_dev == H->Dev && St.st_ino == H->Ino &&
+           St.st_size == H->Size && St.st_mtim.tv_sec == H->MTime.tv_sec &&
+           St.st_mtim.tv_nsec == H->MTime.tv_nsec;
+}
+
+// 读入头文件并进行词法分析，记录读入时文件的状态。
+// 先取得文件的状态再读入，读入前文件发生的变化在下次编译时能被发现
+static void readHeader(Header *H, char *Path)
+{
+    struct stat St = {};
+    stat(Path, &St);
+    File *F;
+    Token *Toks = tokenizeFile(Path, 1, &F);
+
+    *H = (Header){.Toks = Toks, .End = Toks, .F = F};
+    while (H->End->kind != TK_EOF)
+    {
+        H->End++;
+    }
+    H->Guard = detectGuard(H->Toks, H->End);
+    H->Dev = St.st_dev;
+    H->Ino = St.st_ino;
+    H->Size = St.st_size;
+    H->MTime = St.st_mtim;
+}
+
+// #include 嵌套的最大层数，与 gcc 相同
+#define MAX_INCLUDE_DEPTH 200
+
+// 处理 #include，Tok 为指令名，End 为行尾
+static void includeFile(int Fi, Token *Tok, Token *End)
+{
+    Token *Start = Tok + 1;
+    char *Name;
+    bool Quote;
+
+    if (Start < End && Start->kind == TK_STR)
+    {
+        // #include "foo.h"
+        Name = getStrLiteral(Start)->Str;
+        Quote = true;
+        Start++;
+    }
+    else if (Start < End && equal(Start, '<'))
+    {
+        // #include <foo.h>，文件名为尖括号之间的原始文本
+        Token *Close = Start + 1;
+        while (Close < End && !equal(Close, '>'))
+        {
+            Close++;
+        }
+        if (Close == End)
+        {
+            errorTok(Start, "expected '>'");
+        }
+        Name = strndup(Start->Loc + 1, Close->Loc - Start->Loc - 1);
+        Quote = false;
+        Start = Close + 1;
+    }
+    else
+    {
+        errorTok(Tok, "expected a filename");
+    }
+    if (Start < End)
+    {
+        errorTok(Start, "extra token");
+    }
+
+    char *Path = searchInclude(Name, Quote, Frames[Fi].Path);
+    if (!Path)
+    {
+        errorTok(Tok + 1, "%s: cannot open file", Name);
+    }
+
+    // 没有包含保护的头文件包含自身时，嵌套的层数会无限增长
+    int Depth = 0;
+    for (int I = 0; I < FrameCnt; I++)
+    {
+        Depth += Frames[I].H != NULL;
+    }
+    if (Depth >= MAX_INCLUDE_DEPTH)
+    {
+        errorTok(Tok + 1, "#include nested depth %d exceeds maximum of %d", Depth + 1,
+                 MAX_INCLUDE_DEPTH);
+    }
+
+    // 头文件只在第一次被包含时读入和分析，之后直接使用缓存的终结符，
+    // 已包含过的 #pragma once 的文件和包含保护的宏已定义的文件直接跳过
+    char *Key = headerKey(Path);
+    Header *H = hashmapGet(&Headers, Key);
+    if (H)
+    {
+        // 哈希表中已有的键不会被替换
+        free(Key);
+        if (!H->Included && !headerValid(H, Path))
+        {
+            // 上次编译之后文件发生了变化，重新读入，原来的终结符不再使用
+            readHeader(H, Path);
+        }
+        else if (H->Included && (H->Once || (H->Guard && hashmapGetPtr(&Macros, H->Guard))))
+        {
+            return;
+        }
+    }
+    else
+    {
+        H = calloc(1, sizeof(Header));
+        readHeader(H, Path);
+        hashmapPut(&Headers, Key, H);
+    }
+
+    // 本次编译第一次包含时分配文件编号，文件名为本次搜索到的路径
+    if (!H->Included)
+    {
+        H->F->Name = Path;
+        numberFile(H->F);
+    }
+    H->Included = true;
+
+    pushFrame((Frame){.Cur = H->Toks, .End = H->End, .Path = Path, .H = H, .CondBase = CondCnt});
+}
+
+// 处理 #define，Tok 为宏名，End 为行尾
+static void readDefine(Token *Dir, Token *Tok, Token *End)
+{
+    if (Tok == End || Tok->kind != TK_IDENT)
+    {
+        errorTok(Tok == End ? Dir : Tok, "macro name must be an identifier");
+    }
+
+    Macro *M = arenaAlloc(AK_MACRO, sizeof(Macro));
+    M->Name = Tok->Name;
+    Tok++;
+
+    // 宏名之后紧跟着左括号的为函数式宏
+    if (Tok < End && equal(Tok, '(') && !Tok->HasSpace)
+    {
+        M->FuncLike = true;
+        M->Params = arenaAlloc(AK_MACRO, sizeof(char *) * (End - Tok));
+        Tok++;
+
+        while (!(Tok < End && equal(Tok, ')')))
+        {
+            if (M->ParamCnt > 0)
+            {
+                if (!(Tok < End && equal(Tok, ',')))
+                {
+                    errorTok(Tok < End ? Tok : Dir, "expected ',' or ')'");
+                }
+                Tok++;
+            }
+
+            // "..." 为可变参数，必须是最后一个形参
+            if (Tok + 2 < End && equal(Tok, '.') && equal(Tok + 1, '.') && equal(Tok + 2, '.'))
+            {
+                M->Variadic = true;
+                M->Params[M->ParamCnt++] = intern("__VA_ARGS__", 11);
+                Tok += 3;
+                if (!(Tok < End && equal(Tok, ')')))
+                {
+                    errorTok(Tok < End ? Tok : Dir, "expected ')'");
+                }
+                break;
+            }
+
+            if (!(Tok < End && Tok->kind == TK_IDENT))
+            {
+                errorTok(Tok < End ? Tok : Dir, "expected a parameter name");
+            }
+            M->Params[M->ParamCnt++] = Tok->Name;
+            Tok++;
+        }
+        Tok++;
+    }
+
+    M->Body = Tok;
+    M->BodyLen = End - Tok;
+    hashmapPutPtr(&Macros, M->Name, M);
+}
+
+//
+// #if 的常量表达式
+//
+// 宏展开之后，标识符都视为 0，然后按 C 的运算符优先级求值
+//
+
+static int64_t evalExpr(Token **Rest, Token *Tok);
+
+// primary = "(" expr ")" | num | ident
+// unary = ("+" | "-" | "!" | "~") unary | primary
+static int64_t evalUnary(Token **Rest, Token *Tok)
+{
+    if (equal(Tok, '+'))
+    {
+        return evalUnary(Rest, Tok + 1);
+    }
+    if (equal(Tok, '-'))
+    {
+        return -evalUnary(Rest, Tok + 1);
+    }
+    if (equal(Tok, '!'))
+    {
+        return !evalUnary(Rest, Tok + 1);
+    }
+    if (equal(Tok, '~'))
+    {
+        return ~evalUnary(Rest, Tok + 1);
+    }
+    if (equal(Tok, '('))
+    {
+        int64_t Val = evalExpr(&Tok, Tok + 1);
+        *Rest = skip(Tok, ')');
+        return Val;
+    }
+    if (Tok->kind == TK_NUM)
+    {
+        *Rest = Tok + 1;
+        return Tok->Val;
+    }
+    if (Tok->kind == TK_IDENT)
+    {
+        *Rest = Tok + 1;
+        return 0;
+    }
+    errorTok(Tok, "invalid expression in #if");
+    return 0;
+}
+
+// 二元运算符的优先级，数值越大结合越紧，不是二元运算符时返回 0
+static int binaryPrec(Token *Tok)
+{
+    if (Tok->kind != TK_PUNCT)
+    {
+        return 0;
+    }
+    switch (Tok->Id)
+    {
+    case TID_LOGOR:
+        return 1;
+    case TID_LOGAND:
+        return 2;
+    case '|':
+        return 3;
+    case '^':
+        return 4;
+    case '&':
+        return 5;
+    case TID_EQ:
+    case TID_NE:
+        return 6;
+    case '<':
+    case '>':
+    case TID_LE:
+    case TID_GE:
+        return 7;
+    case TID_SHL:
+    case TID_SHR:
+        return 8;
+    case '+':
+    case '-':
+        return 9;
+    case '*':
+    case '/':
+    case '%':
+        return 10;
+    default:
+        return 0;
+    }
+}
+
+// 按优先级爬升法解析优先级不低于 MinPrec 的二元运算
+static int64_t evalBinary(Token **Rest, Token *Tok, int MinPrec)
+{
+    int64_t LHS = evalUnary(&Tok, Tok);
+
+    for (int Prec; (Prec = binaryPrec(Tok)) >= MinPrec;)
+    {
+        Token *Op = Tok;
+        int64_t RHS = evalBinary(&Tok, Tok + 1, Prec + 1);
+
+        switch (Op->Id)
+        {
+        case TID_LOGOR:
+            LHS = LHS || RHS;
+            break;
+        case TID_LOGAND:
+            LHS = LHS && RHS;
+            break;
+        case '|':
+            LHS |= RHS;
+            break;
+        case '^':
+            LHS ^= RHS;
+            break;
+        case '&':
+            LHS &= RHS;
+            break;
+        case TID_EQ:
+            LHS = LHS == RHS;
+            break;
+        case TID_NE:
+            LHS = LHS != RHS;
+            break;
+        case '<':
+            LHS = LHS < RHS;
+            break;
+        case '>':
+            LHS = LHS > RHS;
+            break;
+        case TID_LE:
+            LHS = LHS <= RHS;
+            break;
+        case TID_GE:
+            LHS = LHS >= RHS;
+            break;
+        case TID_SHL:
+            LHS <<= RHS;
+            break;
+        case TID_SHR:
+            LHS >>= RHS;
+            break;
+        case '+':
+            LHS += RHS;
+            break;
+        case '-':
+            LHS -= RHS;
+            break;
+        case '*':
+            LHS *= RHS;
+            break;
+        case '/':
+        case '%':
+            if (RHS == 0)
+            {
+                errorTok(Op, "division by zero in #if");
+            }
+            LHS = Op->Id == '/' ? LHS / RHS : LHS % RHS;
+            break;
+        }
+    }
+
+    *Rest = Tok;
+    return LHS;
+}
+
+// expr = binary ("?" expr ":" expr)?
+static int64_t evalExpr(Token **Rest, Token *Tok)
+{
+    int64_t Cond = evalBinary(&Tok, Tok, 1);
+    if (!equal(Tok, '?'))
+    {
+        *Rest = Tok;
+        return Cond;
+    }
+    int64_t Then = evalExpr(&Tok, Tok + 1);
+    Tok = skip(Tok, ':');
+    int64_t Else = evalExpr(Rest, Tok);
+    return Cond ? Then : Else;
+}
+
+// 计算 #if 和 #elif 的条件，Tok 为条件的开头，End 为行尾
+static int64_t evalCondition(Token *Dir, Token *Tok, Token *End)
+{
+    // 先将 defined X 和 defined(X) 替换为 1 或 0，再展开宏
+    TokVec Raw = {};
+    for (; Tok < End; Tok++)
+    {
+        if (!isName(Tok, "defined"))
+        {
+            pushTok(&Raw, Tok, NULL);
+            continue;
+        }
+
+        Token *Start = Tok++;
+        bool Paren = Tok < End && equal(Tok, '(');
+        if (Paren)
+        {
+            Tok++;
+        }
+        if (!(Tok < End && Tok->kind == TK_IDENT))
+        {
+            errorTok(Start, "macro name must be an identifier");
+        }
+        Token Num = {.kind = TK_NUM, .Loc = Start->Loc, .Len = Start->Len};
+        Num.Val = hashmapGetPtr(&Macros, Tok->Name) != NULL;
+        if (Paren)
+        {
+            Tok++;
+            if (!(Tok < End && equal(Tok, ')')))
+            {
+                errorTok(Start, "expected ')'");
+            }
+        }
+        pushTok(&Raw, &Num, NULL);
+    }
+
+    TokVec Expr = expandArg(&Raw);
+    freeTokVec(&Raw);
+
+    // 以 TK_EOF 结尾，表达式不完整时在指令处报错
+    Token Eof = {.kind = TK_EOF, .Loc = Dir->Loc, .Len = Dir->Len};
+    pushTok(&Expr, &Eof, NULL);
+
+    Token *Rest;
+    int64_t Val = evalExpr(&Rest, Expr.Toks);
+    if (Rest->kind != TK_EOF)
+    {
+        errorTok(Rest, "extra token");
+    }
+    freeTokVec(&Expr);
+    return Val;
+}
+
+static void pushCondIncl(Token *Tok, bool Included)
+{
+    if (CondCnt == CondCap)
+    {
+        CondCap = CondCap ? CondCap * 2 : 16;
+        Conds = realloc(Conds, sizeof(CondIncl) * CondCap);
+    }
+    Conds[CondCnt++] = (CondIncl){IN_THEN, Included, Tok};
+}
+
+// 获取当前文件中最内层的条件编译，没有时报错
+static CondIncl *currentCondIncl(Frame *F, Token *Tok)
+{
+    if (CondCnt == F->CondBase)
+    {
+        errorTok(Tok, "stray #%.*s", Tok->Len, Tok->Loc);
+    }
+    return &Conds[CondCnt - 1];
+}
+
+// 处理文件帧中当前位置的预处理指令，Fi 为文件帧的下标
+static void directive(int Fi)
+{
+    Frame *F = &Frames[Fi];
+    Token *Hash = F->Cur;
+    Token *Tok = Hash + 1;
+
+    // 指令到行尾结束
+    Token *End = Tok;
+    while (End < F->End && !End->AtBOL)
+    {
+        End++;
+    }
+    F->Cur = End;
+
+    // 只有 # 的空指令
+    if (Tok == End)
+    {
+        return;
+    }
+
+    if (isName(Tok, "include"))
+    {
+        includeFile(Fi, Tok, End);
+        return;
+    }
+
+    if (isName(Tok, "define"))
+    {
+        readDefine(Tok, Tok + 1, End);
+        return;
+    }
+
+    if (isName(Tok, "undef"))
+    {
+        if (Tok + 1 == End || Tok[1].kind != TK_IDENT)
+        {
+            errorTok(Tok, "macro name must be an identifier");
+        }
+        hashmapDeletePtr(&Macros, Tok[1].Name);
+        return;
+    }
+
+    if (isName(Tok, "if"))
+    {
+        int64_t Val = evalCondition(Tok, Tok + 1, End);
+        pushCondIncl(Tok, Val);
+        if (!Val)
+        {
+            skipCondIncl(&Frames[Fi]);
+        }
+        return;
+    }
+
+    if (isName(Tok, "ifdef") || isName(Tok, "ifndef"))
+    {
+        if (Tok + 1 == End || Tok[1].kind != TK_IDENT)
+        {
+            errorTok(Tok, "macro name must be an identifier");
+        }
+        bool Defined = hashmapGetPtr(&Macros, Tok[1].Name) != NULL;
+        bool Included = isName(Tok, "ifdef") ? Defined : !Defined;
+        pushCondIncl(Tok, Included);
+        if (!Included)
+        {
+            skipCondIncl(F);
+        }
+        return;
+    }
+
+    if (isName(Tok, "elif"))
+    {
+        CondIncl *C = currentCondIncl(F, Tok);
+        if (C->Ctx == IN_ELSE)
+        {
+            errorTok(Tok, "#elif after #else");
+        }
+        C->Ctx = IN_ELIF;
+        // 已有分支被选中时不再计算条件
+        if (!C->Included && evalCondition(Tok, Tok + 1, End))
+        {
+            C->Included = true;
+        }
+        else
+        {
+            skipCondIncl(&Frames[Fi]);
+        }
+        return;
+    }
+
+    if (isName(Tok, "else"))
+    {
+        CondIncl *C = currentCondIncl(F, Tok);
+        if (C->Ctx == IN_ELSE)
+        {
+            errorTok(Tok, "#else after #else");
+        }
+        C->Ctx = IN_ELSE;
+        if (C->Included)
+        {
+            skipCondIncl(F);
+        }
+        C->Included = true;
+        return;
+    }
+
+    if (isName(Tok, "endif"))
+    {
+        currentCondIncl(F, Tok);
+        CondCnt--;
+        return;
+    }
+
+    if (isName(Tok, "pragma"))
+    {
+        // 只支持 #pragma once，其他的 #pragma 忽略
+        if (Tok + 1 < End && isName(&Tok[1], "once") && F->H)
+        {
+            F->H->Once = true;
+        }
+        return;
+    }
+
+    if (isName(Tok, "error"))
+    {
+        if (Tok + 1 == End)
+        {
+            errorTok(Tok, "#error");
+        }
+        char *Last = End[-1].Loc + End[-1].Len;
+        errorTok(Tok, "#error %.*s", (int)(Last - Tok[1].Loc), Tok[1].Loc);
+    }
+
+    errorTok(Tok, "invalid preprocessor directive");
+}
+
+// 读取帧栈中 Depth 以上的所有终结符，处理预处理指令、展开宏，结果写入 Out
+static void expand(TokVec *Out, int Depth)
+{
+    while (true)
+    {
+        Frame *F = topFrame(Depth);
+        if (!F)
+        {
+            return;
+        }
+
+        // 文件结束时，其中的条件编译必须都已结束
+        if (F->Cur == F->End)
+        {
+            if (CondCnt > F->CondBase)
+            {
+                errorTok(Conds[CondCnt - 1].Tok, "unterminated conditional directive");
+            }
+            FrameCnt--;
+            continue;
+        }
+
+        // 文件中位于行首的 # 开始预处理指令
+        if (F->Path && F->Cur->AtBOL && equal(F->Cur, '#'))
+        {
+            directive(F - Frames);
+            continue;
+        }
+
+        Hideset *HS;
+        Token *Tok = nextTok(F, &HS);
+        if (!expandMacro(Tok, HS, Depth))
+        {
+            pushTok(Out, Tok, HS);
+        }
+    }
+}
+
+// 按原来的拼写输出终结符，终结符之间有空白时以一个空格分隔
+static void writeTokens(FILE *Out, Token *Toks, int Cnt)
+{
+    for (int I = 0; I < Cnt; I++)
+    {
+        if (I > 0 && Toks[I].HasSpace)
+        {
+            fputc(' ', Out);
+        }
+        fwrite(Toks[I].Loc, 1, Toks[I].Len, Out);
+    }
+}
+
+// 将当前定义的所有宏以 #define 指令的形式输出，每个宏一行，
+// 用于将宏保存到声明快照中，重新预处理这些指令即可恢复宏表
+void writeMacros(FILE *Out)
+{
+    int Iter = 0;
+    for (HashEntry *Ent; (Ent = hashmapNext(&Macros, &Iter));)
+    {
+        Macro *M = Ent->Val;
+        fprintf(Out, "#define %s", M->Name);
+        if (M->FuncLike)
+        {
+            fputc('(', Out);
+            for (int J = 0; J < M->ParamCnt; J++)
+            {
+                bool VaArgs = M->Variadic && J == M->ParamCnt - 1;
+                fprintf(Out, "%s%s", J ? ", " : "", VaArgs ? "..." : M->Params[J]);
+            }
+            fputc(')', Out);
+        }
+        fputc(' ', Out);
+        writeTokens(Out, M->Body, M->BodyLen);
+        fputc('\n', Out);
+    }
+}
+
+// 预处理入口函数，展开宏并处理预处理指令，返回新的终结符数组
+Token *preprocess(Token *Tok)
+{
+    // 没有预处理指令的文件不会定义任何宏，直接返回原来的终结符数组
+    bool HasDirective = false;
+    Token *Eof = Tok;
+    for (; Eof->kind != TK_EOF; Eof++)
+    {
+        if (Eof->AtBOL && equal(Eof, '#'))
+        {
+            HasDirective = true;
+        }
+    }
+    if (!HasDirective && !Macros.Used)
+    {
+        return Tok;
+    }
+
+    pushFrame((Frame){.Cur = Tok, .End = Eof, .Path = getFile(Eof->Loc)->Name});
+    TokVec Out = {};
+    expand(&Out, 0);
+
+    // 复制到终结符的内存池中，以 TK_EOF 结尾
+    Token *Toks = arenaAlloc(AK_TOKEN, sizeof(Token) * (Out.Cnt + 1));
+    memcpy(Toks, Out.Toks, sizeof(Token) * Out.Cnt);
+    Toks[Out.Cnt] = *Eof;
+    freeTokVec(&Out);
+    return Toks;
+}
+
+// 清除本次编译定义的宏、#include 搜索的目录和出错时残留的帧，
+// 缓存的头文件保留，下次编译第一次包含时检查文件是否变化
+void preprocessReset(void)
+{
+    hashmapFree(&Macros);
+    int Iter = 0;
+    for (HashEntry *Ent; (Ent = hashmapNext(&Headers, &Iter));)
+    {
+        ((Header *)Ent->Val)->Included = false;
+    }
+    IncludePathCnt = 0;
+    CondCnt = 0;
+    FrameCnt = 0;
+    free(Cwd);
+    Cwd = NULL;
+}
@@ -4,8 +4,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +22,75 @@
 //
 
 char *format(char *Fmt, ...);
+char *vformat(char *Fmt, va_list VA);
+// 驻留字符串，相同内容的字符串返回同一个指针
+char *intern(char *S, int Len);
+
+//
+// 内存分配
+//
+
+// 内存池的种类，每类对象从各自的内存池中分配
+typedef enum
+{
+    AK_TOKEN,  // 终结符
+    AK_NODE,   // 语法树节点
+    AK_TYPE,   // 类型与结构体成员
+    AK_OBJ,    // 变量与函数
+    AK_SCOPE,  // 域
+    AK_LOCAL,  // 函数内的局部变量和域，函数解析完成后不再使用
+    AK_STR,    // 字符串
+    AK_MACRO,  // 宏展开的中间结果
+    AK_HEADER, // 被包含的头文件的终结符，跨编译保留
+    AK_PERM,   // 驻留的名称和头文件中的字符串字面量，跨编译保留
+    AK_COUNT,  // 内存池的数量
+} ArenaKind;
+
+// 从内存池中分配清零的内存
+void *arenaAlloc(ArenaKind Kind, size_t Size);
+// 将最近一次从内存池中分配的对象缩小为 Size 字节
+// 在内存池中复制字符串
+char *arenaStrndup(ArenaKind Kind, char *S, size_t N);
+// 重置内存池，之前分配的对象全部失效
+void arenaReset(ArenaKind Kind);
+// 释放所有内存池
+void arenaFreeAll(void);
+// 输出内存池的统计信息
+void arenaPrintStats(FILE *Out);
+
+//
+// 哈希表
+//
+
+// 哈希表的键值对
+typedef struct
+{
+    char *Key;  // 键
+    int KeyLen; // 键的长度
+    void *Val;  // 值
+} HashEntry;
+
+// 哈希表
+typedef struct
+{
+    HashEntry *Buckets; // 桶数组
+    int Capacity;       // 桶的数量
+    int Used;           // 已使用的桶的数量（包含被删除的）
+} HashMap;
+
+void *hashmapGet(HashMap *Map, char *Key);
+void *hashmapGet2(HashMap *Map, char *Key, int KeyLen);
+void hashmapPut(HashMap *Map, char *Key, void *Val);
+void hashmapPut2(HashMap *Map, char *Key, int KeyLen, void *Val);
+void hashmapDelete(HashMap *Map, char *Key);
+void hashmapDelete2(HashMap *Map, char *Key, int KeyLen);
+void hashmapFree(HashMap *Map);
+// 遍历哈希表中的键值对
+HashEntry *hashmapNext(HashMap *Map, int *Iter);
+// 以指针为键的哈希表操作，用于驻留的字符串等规范化的键
+void *hashmapGetPtr(HashMap *Map, void *Key);
+void hashmapPutPtr(HashMap *Map, void *Key, void *Val);
+void hashmapDeletePtr(HashMap *Map, void *Key);
 
 //
 // 词法分析
@@ -37,37 +108,149 @@ typedef enum
     TK_EOF,     // 终止符
 } TokenKind;    // 终结符
 
+// 关键字和操作符的编号，单字符操作符的编号即为其 ASCII 码
+typedef enum
+{
+    TID_NONE = 0, // 不是关键字或操作符
+
+    // 多字符操作符
+    TID_EQ = 128, // ==
+    TID_NE,       // !=
+    TID_LE,       // <=
+    TID_GE,       // >=
+    TID_ARROW,    // ->
+    TID_LOGAND,   // &&
+    TID_LOGOR,    // ||
+    TID_SHL,      // <<
+    TID_SHR,      // >>
+    TID_HASHHASH, // ##
+
+    // 关键字
+    KW_RETURN,  // return
+    KW_IF,      // if
+    KW_ELSE,    // else
+    KW_FOR,     // for
+    KW_WHILE,   // while
+    KW_INT,     // int
+    KW_LONG,    // long
+    KW_SHORT,   // short
+    KW_CHAR,    // char
+    KW_STRUCT,  // struct
+    KW_UNION,   // union
+    KW_SIZEOF,  // sizeof
+    KW_VOID,    // void
+    KW_TYPEDEF, // typedef
+
+    TID_COUNT, // 编号的数量
+} TokenId;
+
 typedef struct Token Token;
 
+// 终结符，一个文件的所有终结符连续存放在同一个数组中，以 TK_EOF 结尾，
+// 语法分析通过指针加减在数组中前进和回溯
 struct Token
 {
-    TokenKind kind;
-    Token *next;
-
-    int64_t Val; // TK_NUM 的值
-    char *Loc;   // 在字符串中的位置
+    char *Loc; // 在字符串中的位置
+
+    union
+    {
+        int64_t Val; // TK_NUM 的值
+        char *Name;  // TK_IDENT 的驻留名称，名称相同则指针相同
+        int StrIdx;  // TK_STR 在字符串字面量表中的下标
+    };
+
+    int Len;       // 长度
+    uint8_t kind;  // 种类（TokenKind）
+    uint8_t Id;    // TK_KEYWORD 和 TK_PUNCT 的编号（TokenId）
+    bool AtBOL;    // 是否为行首的终结符，用于识别预处理指令
+    bool HasSpace; // 前面是否有空白，用于区分函数式宏和字符串化
+};
 
-    int Len; // 长度
+// 编号需要能存入 Token 的 Id 字段
+_Static_assert(TID_COUNT <= 256, "TokenId does not fit in uint8_t");
 
-    // 字符串字面量
-    Type *type;
-    char *Str;
+// 字符串字面量，不常用的内容单独存放，使 Token 保持紧凑
+typedef struct
+{
+    char *Str; // 转义后的内容
+    int Len;   // 内容的长度，包含结尾的 '\0'
+} StrLiteral;
 
-    int lineNo; // 行号
-};
+// 输入文件，包括主文件、被包含的头文件和宏拼接产生的临时文本
+typedef struct
+{
+    char *Name;           // 文件名
+    int FileNo;           // 文件编号，对应汇编中的 .file，临时文本为 0
+    char *Contents;       // 文件的内容，不要求以 '\0' 结尾
+    char *End;            // 内容的末尾
+    uint32_t *LineStarts; // 行首偏移量表，第 I 项为第 I+1 行的行首相对于 Contents 的偏移量
+    int LineCnt;          // 已记录的行数
+    int LineCap;          // 行首偏移量表的容量
+    bool Keep;            // 是否跨编译保留，被包含的头文件在服务器模式下缓存
+} File;
 
 // 错误信息提示函数
 void error(char *Fmt, ...);
 void errorAt(char *Loc, char *Fmt, ...);
 void errorTok(Token *Tok, char *Fmt, ...);
+// 以状态 Status 结束编译，设置了跳转位置时跳转回去，否则退出进程
+void exitCompile(int Status);
+// 设置结束编译时的跳转位置，服务器模式和库由此返回，为 NULL 时取消
+void setErrorJmp(jmp_buf *Buf);
+jmp_buf *getErrorJmp(void);
+// 接收错误信息的函数，Ctx 为设置时给出的参数，File 为 NULL 时错误没有位置，
+// Msg 由 malloc 分配。并行生成代码时可能被多个线程同时调用
+typedef void DiagHandler(void *Ctx, char *File, int Line, int Col, char *Msg);
+// 设置接收错误信息的函数，为 NULL 时向标准错误输出
+void setDiagHandler(DiagHandler *Fn, void *Ctx);
+DiagHandler *getDiagHandler(void **Ctx);
+// 获取输入中某一位置所在的行号
+int getLineNo(char *Loc);
+// 获取输入中某一位置所在的文件
+File *getFile(char *Loc);
+// 获取所有的输入文件，包括缓存的头文件
+File **getFiles(int *Cnt);
+// 使用另一个线程的文件列表，用于并行生成代码的工作线程
+void shareFiles(File **Fs, int Cnt);
+// 获取本次编译的所有有编号的输入文件，按编号排列，以 NULL 结尾
+File **getInputFiles(void);
+// 为本次编译中第一次被包含的头文件分配文件编号
+void numberFile(File *F);
+
+// 判断 Token 是否为编号 Id 的关键字或操作符
+bool equal(Token *Tok, TokenId Id);
+Token *skip(Token *Tok, TokenId Id);
+bool consume(Token **Rest, Token *Tok, TokenId Id);
+// 关键字或操作符的拼写
+char *tokenIdName(TokenId Id);
+// 获取 TK_STR 终结符的字符串字面量
+StrLiteral *getStrLiteral(Token *Tok);
+
+// 读取文件的全部内容，通过 Len 返回文件的长度，Path 为"-"时读取标准输入
+char *readFile(char *Path, size_t *Len);
+// 对被包含的头文件进行词法分析，通过 F 返回其输入文件，头文件跨编译保留
+Token *tokenizeFile(char *Path, int Jobs, File **F);
+// 对已读入的文件内容进行词法分析，文件按读入的顺序编号
+Token *tokenizeBuffer(char *Path, char *Buf, size_t Len, int Jobs);
+// 对内存中的文本进行词法分析
+Token *tokenizeText(char *Name, char *Buf, size_t Len);
+// 将一段文本分析为一个终结符，用于宏的拼接和字符串化，不能构成一个终结符时返回 false
+bool tokenizeOne(char *S, int Len, Token *Tok);
+// 丢弃本次编译的输入文件、字符串字面量和读入的内容，保留头文件
+void tokenizeReset(void);
 
-// 判断 Token 与 Str 的关系
-bool equal(Token *Tok, char *Str);
-Token *skip(Token *Tok, char *Str);
-bool consume(Token **Rest, Token *Tok, char *Str);
+//
+// 预处理
+//
 
-// 词法分析入口函数
-Token *tokenizeFile(char *Path);
+// 添加 #include 搜索的目录
+void addIncludePath(char *Dir);
+// 预处理入口函数，展开宏并处理预处理指令，返回新的终结符数组
+Token *preprocess(Token *Tok);
+// 将当前定义的所有宏以 #define 指令的形式输出
+void writeMacros(FILE *Out);
+// 清除本次编译定义的宏和 #include 搜索的目录，保留头文件的缓存
+void preprocessReset(void);
 
 // rvcc 源文件的某个文件的某一行出了问题，打印出文件名和行号
 #define unreachable() error("internal error at %s:%d", __FILE__, __LINE__)
@@ -96,6 +279,8 @@ typedef enum
     TY_UNION,  // 联合体
 } TypeKind;
 
+// 类型，指针、数组和函数类型是规范化的：结构相同的类型是同一个对象，
+// 因此可以直接比较指针，且不能记录声明相关的信息（如变量名）
 struct Type
 {
     TypeKind kind;
@@ -103,16 +288,15 @@ struct Type
     int align; // 对齐因子
 
     Type *base;
-    Token *name; // 其类型对应的名称，如：变量名、函数名
-
-    Type *next; // 下一类型
 
     // 结构体
     Member *Mems;
+    HashMap *MemMap; // 成员较多时，按名称索引成员的哈希表
 
     // 函数类型
     Type *ReturnTy; // 函数返回的类型
-    Type *Params;   // 形参
+    Type **Params;  // 形参的类型
+    int ParamCnt;   // 形参的数量
 
     // 数组类型
     int ArrayLen; // 数组大小
@@ -130,13 +314,15 @@ bool isInteger(Type *Ty);
 // 构建一个指针类型，并指向基类
 Type *pointerTo(Type *Base);
 // 构建函数类型
-Type *funcType(Type *ReturnTy);
+Type *funcType(Type *ReturnTy, Type **Params, int ParamCnt);
 // 创建数组类型
 Type *arrayOf(Type *Base, int size);
-// 复制类型
-Type *copyType(Type *Ty);
+// 为成员较多的结构体建立按名称查找成员的哈希表
+void indexMembers(Type *Ty);
 // 为所有节点赋予类型
 void addType(Node *node);
+// 清除规范化的派生类型
+void typeReset(void);
 
 // 语法分析 (抽象语法树构建)
 
@@ -177,6 +363,9 @@ typedef enum
     ND_NUM // 整形
 } NodeKind;
 
+// 函数在增量编译缓存中的记录
+typedef struct FnRecord FnRecord;
+
 // 变量或函数
 typedef struct Obj Obj;
 struct Obj
@@ -202,43 +391,78 @@ struct Obj
     Obj *Params;   // 形参
     Obj *locals;   // 函数的局部变量
     int stackSize; // 栈深度
+    FnRecord *Rec; // 增量编译缓存中的记录，命中时没有函数体
 };
 
 // 类型转换，将表达式的值转换为另一种类型
 Node *newCast(Node *Expr, Type *type);
 // 语法解析入口函数
-Obj *parse(Token *Tok);
+// OnFunction 不为 NULL 时为流式模式：每个函数定义解析完成后立即交给 OnFunction，
+// 然后释放其语法树和局部变量
+Obj *parse(Token *Tok, void (*OnFunction)(Obj *Fn));
 
+// 全局域中的一个名称，用于保存和载入声明快照
+typedef struct
+{
+    char *Name;    // 名称
+    Obj *Var;      // 全局变量或函数
+    Type *Typedef; // 类型别名
+    Type *Tag;     // 结构体或联合体的标签
+} GlobalName;
+
+// 按声明的顺序获取全局域中的所有名称
+GlobalName *getGlobalNames(int *Cnt);
+// 在全局域中声明一个名称
+void declareGlobalName(GlobalName *G);
+// 清除全局域和解析的状态
+void parseReset(void);
+
+// 语法树节点，由公共的节点头和按种类区分的内容组成，
+// 节点只分配其种类用到的部分（见 parse.c 中的 nodeSize）
 struct Node
 {
     NodeKind kind;
     Token *Tok;
-
-    Node *next; // 指向下一语句
-
-    Node *LHS;
-    Node *RHS;
-
-    // 结构体
-    Member *Mem; // 成员访问
-
-    // if 语句或 for 语句
-    Node *Cond; // 条件语句
-    Node *Then; // true 走向的语句
-    Node *Else; // false 走向的语句
-    Node *Init; // 初始化语句
-    Node *Inc;  // 递增语句
-
-    Node *Body; // 代码块 or 表达式语句
-
-    // 函数
-    char *FuncName; // 函数名
-    Node *Args;     // 函数参数
-    Type *FuncType; // 函数返回类型
-
-    Type *type;  // 节点中的数据的类型
-    Obj *Var;    // ND_VAR 类型的变量
-    int64_t Val; // ND_NUM 类型的值
+    Type *type; // 节点中的数据的类型
+    Node *next; // 指向下一语句或下一参数
+
+    union
+    {
+        // 一元、二元运算，表达式语句和返回语句
+        struct
+        {
+            Node *LHS;
+            union
+            {
+                Node *RHS;
+                Member *Mem; // ND_MEMBER 访问的结构体成员
+            };
+        };
+
+        // if 语句或 for 语句
+        struct
+        {
+            Node *Cond; // 条件语句
+            Node *Then; // true 走向的语句
+            Node *Else; // false 走向的语句
+            Node *Init; // 初始化语句
+            Node *Inc;  // 递增语句
+        };
+
+        // 代码块或语句表达式
+        Node *Body;
+
+        // 函数调用
+        struct
+        {
+            char *FuncName; // 函数名
+            Type *FuncType; // 函数类型
+            Node *Args;     // 函数参数
+        };
+
+        Obj *Var;    // ND_VAR 类型的变量
+        int64_t Val; // ND_NUM 类型的值
+    };
 };
 
 // 结构体成员
@@ -254,6 +478,165 @@ struct Member
 // 语义分析与代码生成
 //
 
+// 代码生成的选项：是否输出注释，是否输出行号信息，是否直接输出目标文件
+// 选项属于正在编译的线程
+extern _Thread_local bool OptVerboseAsm;
+extern _Thread_local bool OptDebugInfo;
+extern _Thread_local bool OptC;
+
 // 代码生成入口函数
 int alignTo(int N, int Align);
-void codegen(Obj *Prog, FILE *Out);
\ No newline at end of file
+// Jobs 为并行生成函数代码的线程数
+void codegen(Obj *Prog, FILE *Out, int Jobs);
+// 流式代码生成：设置输出文件后逐个生成函数，最后生成数据段
+void codegenBegin(FILE *Out);
+void codegenFunction(Obj *Fn);
+void codegenEnd(Obj *Prog);
+// 清除代码生成的状态，出错中断时缓冲区中可能留有未写出的代码
+void codegenReset(void);
+
+//
+// 汇编器
+//
+
+// 汇编代码生成的汇编代码，可以分多次传入，每次都以完整的行结束
+void assemble(char *Buf, size_t Len);
+
+// 代码生成用到的指令，与汇编代码中的助记符一一对应
+typedef enum
+{
+    AI_ADD,
+    AI_SUB,
+    AI_MUL,
+    AI_DIV,
+    AI_SLT,
+    AI_SLTU,
+    AI_XOR,
+    AI_ADDW,
+    AI_SUBW,
+    AI_MULW,
+    AI_DIVW,
+    AI_ADDI,
+    AI_SLTIU,
+    AI_XORI,
+    AI_ADDIW,
+    AI_SLLI,
+    AI_SRAI,
+    AI_LB,
+    AI_LH,
+    AI_LW,
+    AI_LD,
+    AI_SB,
+    AI_SH,
+    AI_SW,
+    AI_SD,
+    AI_LI,
+    AI_LA,
+    AI_MV,
+    AI_NEG,
+    AI_NEGW,
+    AI_SEQZ,
+    AI_SNEZ,
+    AI_BEQZ,
+    AI_J,
+    AI_CALL,
+    AI_RET,
+    AI_COUNT,
+} AsmInsn;
+
+// 代码生成用到的寄存器的编号
+enum
+{
+    REG_ZERO = 0,
+    REG_RA = 1,
+    REG_SP = 2,
+    REG_T0 = 5,
+    REG_T1 = 6,
+    REG_FP = 8,
+    REG_A0 = 10,
+    REG_A1 = 11,
+};
+
+// 直接编码指令，不经过汇编代码的文本，结果与汇编对应的文本相同。
+// 操作数按汇编代码中的顺序排列：rd, rs1, rs2 或 rd, rs1, imm 或 rd, imm 或 rd, rs，
+// 访存指令 rd, imm(rs1) 和 rs2, imm(rs1) 的立即数排在最后
+void asmInsn(AsmInsn Insn, int A, int B, int64_t C);
+// 引用符号或函数内标签的指令：la rd, symbol、beqz rs, label、j label、call symbol
+void asmSymInsn(AsmInsn Insn, int Reg, char *Name);
+// 定义标签，切换节，声明全局符号
+void asmLabel(char *Name);
+void asmText(void);
+void asmData(void);
+void asmGlobal(char *Name);
+// 在数据段中追加 Len 个字节，Buf 为 NULL 时填充零
+void asmBytes(char *Buf, int64_t Len);
+// 结束汇编，输出 ELF64 可重定位文件
+void writeObject(FILE *Out);
+// 清除汇编器的符号、重定位和节的内容
+void asmReset(void);
+
+//
+// 声明快照
+//
+
+// 将全局域中的声明和宏写入声明快照
+void writeSnapshot(Obj *Prog, FILE *Out);
+// 载入声明快照，需要在预处理和语法分析之前调用
+void loadSnapshot(char *Path);
+//
+// 编译缓存
+//
+
+typedef enum
+{
+    CACHE_HIT,    // 命中，缓存中已有编译结果
+    CACHE_MISS,   // 未命中，编译结果需要写入缓存
+    CACHE_BYPASS, // 编译结果还依赖于其他文件，不使用缓存
+} CacheResult;
+
+// 在缓存目录 Dir 中查找输入内容 Buf 在选项 Opts 下的编译结果，
+// Dep 不为空时其内容也参与计算哈希值，MaxSize 为缓存的大小上限
+CacheResult cacheLookup(char *Dir, size_t MaxSize, char *Buf, size_t Len, char *Opts, char *Dep);
+// 未命中时，创建写入编译结果的临时文件
+FILE *cacheCreate(void);
+// 将写完的临时文件原子地放入缓存
+void cacheCommit(FILE *Tmp);
+// 将缓存中的编译结果复制到输出文件
+void cacheCopy(FILE *Out);
+// 输出缓存的命中统计信息
+void cachePrintStats(char *Dir, FILE *Out);
+
+// 增量编译：载入上次编译输入文件 Path 时各个函数的指纹和代码
+void fnCacheOpen(char *Path);
+// 是否正在进行增量编译
+bool fnCacheEnabled(void);
+// 查找指纹数据为 Data 的函数的记录，函数体开头位于文件 FileNo 的第 Line 行
+FnRecord *fnCacheLookup(char *Data, size_t Len, int FileNo, int Line);
+// 是否复用上次编译的代码，命中时不再解析函数体
+bool fnCacheHit(FnRecord *R);
+// 记录或获取函数用到的字符串字面量
+void fnCacheAddString(FnRecord *R, char *Str, int Len);
+char *fnCacheString(FnRecord *R, int I, int *Len);
+// 获取命中的函数的代码
+char *fnCacheText(FnRecord *R, size_t *Len);
+// 记录重新生成的函数的代码
+void fnCacheStore(FnRecord *R, char *Text, size_t Len);
+// 结束增量编译，保存本次编译的所有函数
+void fnCacheCommit(void);
+// 结束本次编译对缓存的使用，删除未放入缓存的临时文件
+void cacheReset(void);
+
+//
+// 库
+//
+
+// 丢弃当前线程本次编译的状态和内存池，缓存的头文件和驻留的名称跨编译保留
+void resetCompiler(void);
+
+//
+// 服务器
+//
+
+// 常驻在 Unix 套接字 Path 上处理编译请求，Workers 为处理请求的进程数。
+// 每个请求的命令行参数交给 Run 处理，其返回值为请求的退出状态
+void serve(char *Path, int Workers, int (*Run)(int Argc, char **Argv));
@@ -0,0 +1,277 @@
+// 使用 SCM_RIGHTS 等套接字扩展需要引入 BSD/SVID 扩展
+#define _DEFAULT_SOURCE
+
+#include "rvcc.h"
+
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//
+// 编译服务器
+//
+// 服务器常驻在 Unix 套接字上，每个连接为一个编译请求。客户端先发送请求的长度，
+// 同时通过 SCM_RIGHTS 传递其标准输入、标准输出和标准错误，然后发送当前目录和
+// 各个命令行参数，均以 '\0' 结尾。服务器在客户端的当前目录下，以客户端的标准输入
+// 输出处理请求，最后回复 32 位的退出状态。
+// 请求由预先创建的若干进程并行处理，每个进程各自缓存读入的头文件，
+// 请求结束后重置各个模块的状态，丢弃本次编译的内存池。
+//
+
+// 请求的最大长度
+#define MAX_REQUEST (1 << 20)
+
+// 服务器自身的标准输入、标准输出和标准错误，处理请求的间隙恢复为它们
+static int StdFds[3];
+// 监听的套接字路径，主进程退出时删除
+static char *SockPath;
+
+// 默认的套接字路径，与 rvcc-client 的约定相同
+static char *defaultPath(void)
+{
+    char *Path = getenv("RVCC_SERVER");
+    return Path ? Path : format("/tmp/rvcc-%d.sock", (int)getuid());
+}
+
+// 创建监听的套接字，路径上遗留的套接字文件没有服务器在监听时删除它
+static int listenOn(char *Path)
+{
+    struct sockaddr_un Addr = {.sun_family = AF_UNIX};
+    if (strlen(Path) >= sizeof(Addr.sun_path))
+    {
+        error("socket path too long: %s", Path);
+    }
+    strcpy(Addr.sun_path, Path);
+
+    int FD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD < 0)
+    {
+        error("cannot create socket: %s", strerror(errno));
+    }
+    if (bind(FD, (struct sockaddr *)&Addr, sizeof(Addr)) < 0)
+    {
+        if (errno != EADDRINUSE)
+        {
+            error("cannot bind %s: %s", Path, strerror(errno));
+        }
+        int C = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool Alive = C >= 0 && connect(C, (struct sockaddr *)&Addr, sizeof(Addr)) == 0;
+        close(C);
+        if (Alive)
+        {
+            error("a server is already listening on %s", Path);
+        }
+        unlink(Path);
+        if (bind(FD, (struct sockaddr *)&Addr, sizeof(Addr)) < 0)
+        {
+            error("cannot bind %s: %s", Path, strerror(errno));
+        }
+    }
+    if (listen(FD, 128) < 0)
+    {
+        error("cannot listen on %s: %s", Path, strerror(errno));
+    }
+    return FD;
+}
+
+// 读取请求的长度和客户端的标准输入输出，格式不对时返回 false
+static bool recvHeader(int Conn, uint32_t *Len, int *Fds)
+{
+    char Ctrl[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec IO = {.iov_base = Len, .iov_len = sizeof(*Len)};
+    struct msghdr Msg = {
+        .msg_iov = &IO,
+        .msg_iovlen = 1,
+        .msg_control = Ctrl,
+        .msg_controllen = sizeof(Ctrl),
+    };
+    ssize_t N = recvmsg(Conn, &Msg, MSG_WAITALL);
+
+    struct cmsghdr *C = CMSG_FIRSTHDR(&Msg);
+    if (N < 0 || !C || C->cmsg_level != SOL_SOCKET || C->cmsg_type != SCM_RIGHTS)
+    {
+        return false;
+    }
+    int Cnt = (C->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (N != sizeof(*Len) || Cnt != 3 || *Len == 0 || *Len > MAX_REQUEST)
+    {
+        // 丢弃收到的文件描述符
+        for (int I = 0; I < Cnt; I++)
+        {
+            close(((int *)CMSG_DATA(C))[I]);
+        }
+        return false;
+    }
+    memcpy(Fds, CMSG_DATA(C), sizeof(int) * 3);
+    return true;
+}
+
+// 编译一个请求，出错时从 exitCompile 跳转回来，返回退出状态
+static int runRequest(int (*Run)(int Argc, char **Argv), int Argc, char **Argv)
+{
+    jmp_buf Buf;
+    int R = setjmp(Buf);
+    if (R)
+    {
+        setErrorJmp(NULL);
+        return R - 1;
+    }
+    setErrorJmp(&Buf);
+    int Status = Run(Argc, Argv);
+    setErrorJmp(NULL);
+    return Status;
+}
+
+// 处理一个连接上的请求
+static void handle(int Conn, int (*Run)(int Argc, char **Argv))
+{
+    uint32_t Len;
+    int Fds[3];
+    if (!recvHeader(Conn, &Len, Fds))
+    {
+        return;
+    }
+
+    // 请求为当前目录和各个参数，均以 '\0' 结尾
+    char *Req = malloc(Len);
+    ssize_t N = recv(Conn, Req, Len, MSG_WAITALL);
+    int Argc = 0;
+    char **Argv = malloc(sizeof(char *) * (Len + 1));
+    if (N == Len && Req[Len - 1] == '\0')
+    {
+        for (char *P = Req + strlen(Req) + 1; P < Req + Len; P += strlen(P) + 1)
+        {
+            Argv[Argc++] = P;
+        }
+    }
+    Argv[Argc] = NULL;
+
+    int Status = 1;
+    for (int I = 0; I < 3; I++)
+    {
+        dup2(Fds[I], I);
+        close(Fds[I]);
+    }
+    if (Argc == 0)
+    {
+        fprintf(stderr, "rvcc: malformed request\n");
+    }
+    else if (chdir(Req) < 0)
+    {
+        fprintf(stderr, "rvcc: cannot change directory to %s: %s\n", Req, strerror(errno));
+    }
+    else
+    {
+        Status = runRequest(Run, Argc, Argv);
+    }
+
+    // 写出客户端的输出并归还其标准输入输出，客户端的管道随之关闭
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdout);
+    clearerr(stderr);
+    for (int I = 0; I < 3; I++)
+    {
+        dup2(StdFds[I], I);
+    }
+
+    int32_t Reply = Status;
+    if (write(Conn, &Reply, sizeof(Reply)) < 0)
+    {
+        // 客户端已经退出
+    }
+
+    free(Req);
+    free(Argv);
+    resetCompiler();
+}
+
+// 处理请求的进程，各自从监听的套接字上接受连接
+static void worker(int Listen, int (*Run)(int Argc, char **Argv))
+{
+    // 主进程退出时随之退出
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    while (true)
+    {
+        int Conn = accept(Listen, NULL, NULL);
+        if (Conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            error("cannot accept connection: %s", strerror(errno));
+        }
+        handle(Conn, Run);
+        close(Conn);
+    }
+}
+
+// 创建一个处理请求的进程
+static void spawn(int Listen, int (*Run)(int Argc, char **Argv))
+{
+    pid_t Pid = fork();
+    if (Pid < 0)
+    {
+        error("cannot fork: %s", strerror(errno));
+    }
+    if (Pid == 0)
+    {
+        worker(Listen, Run);
+        exit(0);
+    }
+}
+
+// 主进程被终止时删除套接字文件
+static void onSignal(int Sig)
+{
+    unlink(SockPath);
+    _exit(128 + Sig);
+}
+
+// 常驻在 Unix 套接字 Path 上处理编译请求，Path 为 NULL 时使用默认的路径，
+// Workers 为处理请求的进程数，不大于 0 时为处理器的数量
+void serve(char *Path, int Workers, int (*Run)(int Argc, char **Argv))
+{
+    SockPath = Path ? Path : defaultPath();
+    if (Workers < 1)
+    {
+        Workers = sysconf(_SC_NPROCESSORS_ONLN);
+        Workers = Workers < 1 ? 1 : Workers;
+    }
+
+    int Listen = listenOn(SockPath);
+    for (int I = 0; I < 3; I++)
+    {
+        StdFds[I] = dup(I);
+    }
+    // 客户端提前退出时，写入其输出只会失败，而不会终止服务器
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    for (int I = 0; I < Workers; I++)
+    {
+        spawn(Listen, Run);
+    }
+
+    // 处理请求的进程意外退出时重新创建
+    while (true)
+    {
+        if (wait(NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("cannot wait for workers: %s", strerror(errno));
+        }
+        spawn(Listen, Run);
+    }
+}
@@ -0,0 +1,458 @@
+#include "rvcc.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// 声明快照
+//
+// 将全局域的状态（类型别名、结构体标签和布局、函数声明、全局变量）和宏保存为紧凑的二进制文件，
+// 之后的编译将其映射到内存中并直接恢复这些声明，不再对公共的头文件进行词法分析和语法分析。
+//
+// 文件依次为：文件头、名称表、宏、类型表和声明表。
+// 名称表（每行一个标识符）和宏（每行一条 #define 指令）是文本，
+// 载入时经过词法分析得到驻留的名称和宏定义，结构体成员的名称也直接使用其中的终结符；
+// 类型表和声明表是 32 位整数的序列，类型按依赖关系排列在引用它的类型和声明之前，通过下标引用。
+//
+
+#define SNAPSHOT_MAGIC "RVCCSNAP"
+// 文件格式的版本，格式改变时递增
+#define SNAPSHOT_VERSION 1
+
+// 文件头，各部分的位置为相对于文件开头的字节偏移量
+typedef struct
+{
+    char Magic[8];
+    uint32_t Version;
+    uint32_t NamesOff;  // 名称表
+    uint32_t NamesLen;  // 名称表的字节数
+    uint32_t MacrosOff; // 宏
+    uint32_t MacrosLen; // 宏的字节数
+    uint32_t TypesOff;  // 类型表
+    uint32_t TypesLen;  // 类型表的整数个数
+    uint32_t TypeCnt;   // 类型的数量，不含内置类型
+    uint32_t DeclsOff;  // 声明表
+    uint32_t DeclsLen;  // 声明表的整数个数
+    uint32_t DeclCnt;   // 声明的数量
+} SnapshotHeader;
+
+// 声明的种类
+enum
+{
+    DECL_VAR,     // 全局变量
+    DECL_FUNC,    // 函数
+    DECL_TYPEDEF, // 类型别名
+    DECL_TAG,     // 结构体或联合体标签
+};
+
+// 内置类型占用类型表的前几个下标，不写入文件
+#define BUILTIN_CNT 5
+
+static Type *builtinType(int I)
+{
+    Type *Builtins[BUILTIN_CNT] = {TyVoid, TyChar, TyShort, TyInt, TyLong};
+    return Builtins[I];
+}
+
+//
+// 保存
+//
+
+// 32 位整数的可变长数组
+typedef struct
+{
+    uint32_t *Data;
+    int Len;
+    int Cap;
+} Words;
+
+static void pushWord(Words *W, uint32_t Val)
+{
+    if (W->Len == W->Cap)
+    {
+        W->Cap = W->Cap ? W->Cap * 2 : 256;
+        W->Data = realloc(W->Data, sizeof(uint32_t) * W->Cap);
+    }
+    W->Data[W->Len++] = Val;
+}
+
+// 保存时的状态
+typedef struct
+{
+    FILE *Names;     // 名称表
+    HashMap NameIdx; // 名称到下标 +1 的映射
+    int NameCnt;
+    Words Types;     // 类型表
+    HashMap TypeIdx; // 类型到下标 +1 的映射
+    int TypeCnt;     // 类型的数量，含内置类型
+    Words Decls;     // 声明表
+} Writer;
+
+// 名称在名称表中的下标，第一次出现时加入名称表
+static int nameIndex(Writer *W, char *Name)
+{
+    int Idx = (intptr_t)hashmapGetPtr(&W->NameIdx, Name) - 1;
+    if (Idx < 0)
+    {
+        fprintf(W->Names, "%s\n", Name);
+        Idx = W->NameCnt++;
+        hashmapPutPtr(&W->NameIdx, Name, (void *)(intptr_t)(Idx + 1));
+    }
+    return Idx;
+}
+
+// 类型在类型表中的下标，第一次出现时先加入其依赖的类型，再加入类型表
+static int typeIndex(Writer *W, Type *Ty)
+{
+    int Idx = (intptr_t)hashmapGetPtr(&W->TypeIdx, Ty) - 1;
+    if (Idx >= 0)
+    {
+        return Idx;
+    }
+
+    switch (Ty->kind)
+    {
+    case TY_PTR:
+    {
+        int Base = typeIndex(W, Ty->base);
+        pushWord(&W->Types, TY_PTR);
+        pushWord(&W->Types, Base);
+        break;
+    }
+    case TY_ARRAY:
+    {
+        int Base = typeIndex(W, Ty->base);
+        pushWord(&W->Types, TY_ARRAY);
+        pushWord(&W->Types, Base);
+        pushWord(&W->Types, Ty->ArrayLen);
+        break;
+    }
+    case TY_FUNC:
+    {
+        int Ret = typeIndex(W, Ty->ReturnTy);
+        int Params[Ty->ParamCnt + 1];
+        for (int I = 0; I < Ty->ParamCnt; I++)
+        {
+            Params[I] = typeIndex(W, Ty->Params[I]);
+        }
+        pushWord(&W->Types, TY_FUNC);
+        pushWord(&W->Types, Ret);
+        pushWord(&W->Types, Ty->ParamCnt);
+        for (int I = 0; I < Ty->ParamCnt; I++)
+        {
+            pushWord(&W->Types, Params[I]);
+        }
+        break;
+    }
+    case TY_STRUCT:
+    case TY_UNION:
+    {
+        // 结构体不能引用自身，成员的类型总是先于结构体加入类型表
+        int Cnt = 0;
+        for (Member *Mem = Ty->Mems; Mem; Mem = Mem->next)
+        {
+            Cnt++;
+        }
+        int Names[Cnt + 1], Types[Cnt + 1];
+        int I = 0;
+        for (Member *Mem = Ty->Mems; Mem; Mem = Mem->next, I++)
+        {
+            Names[I] = nameIndex(W, Mem->name->Name);
+            Types[I] = typeIndex(W, Mem->type);
+        }
+
+        pushWord(&W->Types, Ty->kind);
+        pushWord(&W->Types, Ty->size);
+        pushWord(&W->Types, Ty->align);
+        pushWord(&W->Types, Cnt);
+        I = 0;
+        for (Member *Mem = Ty->Mems; Mem; Mem = Mem->next, I++)
+        {
+            pushWord(&W->Types, Names[I]);
+            pushWord(&W->Types, Types[I]);
+            pushWord(&W->Types, Mem->offset);
+        }
+        break;
+    }
+    default:
+        unreachable();
+    }
+
+    Idx = W->TypeCnt++;
+    hashmapPutPtr(&W->TypeIdx, Ty, (void *)(intptr_t)(Idx + 1));
+    return Idx;
+}
+
+// 将全局域中的声明和当前定义的宏写入声明快照，Prog 中不能有函数定义
+void writeSnapshot(Obj *Prog, FILE *Out)
+{
+    for (Obj *Var = Prog; Var; Var = Var->next)
+    {
+        if (Var->isFunction && Var->isDefinition)
+        {
+            error("%s: function definitions cannot be saved in a snapshot", Var->name);
+        }
+    }
+
+    Writer W = {};
+    char *NamesBuf, *MacrosBuf;
+    size_t NamesLen, MacrosLen;
+    W.Names = open_memstream(&NamesBuf, &NamesLen);
+    for (int I = 0; I < BUILTIN_CNT; I++)
+    {
+        hashmapPutPtr(&W.TypeIdx, builtinType(I), (void *)(intptr_t)(I + 1));
+    }
+    W.TypeCnt = BUILTIN_CNT;
+
+    // 按声明的顺序写入全局域中的名称，载入时按同样的顺序声明，
+    // 同名的声明相互遮蔽的关系和 Globals 中变量的顺序都保持不变
+    int Cnt;
+    GlobalName *Names = getGlobalNames(&Cnt);
+    for (int I = 0; I < Cnt; I++)
+    {
+        GlobalName *G = &Names[I];
+        int Kind = G->Tag ? DECL_TAG : G->Typedef ? DECL_TYPEDEF : G->Var->isFunction ? DECL_FUNC : DECL_VAR;
+        Type *Ty = G->Tag ? G->Tag : G->Typedef ? G->Typedef : G->Var->type;
+        int Name = nameIndex(&W, G->Name);
+        int TyIdx = typeIndex(&W, Ty);
+        pushWord(&W.Decls, Kind);
+        pushWord(&W.Decls, Name);
+        pushWord(&W.Decls, TyIdx);
+    }
+    free(Names);
+    fclose(W.Names);
+
+    FILE *Macros = open_memstream(&MacrosBuf, &MacrosLen);
+    writeMacros(Macros);
+    fclose(Macros);
+
+    // 文本部分之后补齐到 4 字节，使整数表按 4 字节对齐
+    SnapshotHeader H = {.Version = SNAPSHOT_VERSION};
+    memcpy(H.Magic, SNAPSHOT_MAGIC, sizeof(H.Magic));
+    H.NamesOff = sizeof(H);
+    H.NamesLen = NamesLen;
+    H.MacrosOff = H.NamesOff + NamesLen;
+    H.MacrosLen = MacrosLen;
+    H.TypesOff = alignTo(H.MacrosOff + MacrosLen, sizeof(uint32_t));
+    H.TypesLen = W.Types.Len;
+    H.TypeCnt = W.TypeCnt - BUILTIN_CNT;
+    H.DeclsOff = H.TypesOff + sizeof(uint32_t) * W.Types.Len;
+    H.DeclsLen = W.Decls.Len;
+    H.DeclCnt = Cnt;
+
+    static char Zeros[sizeof(uint32_t)];
+    fwrite(&H, sizeof(H), 1, Out);
+    fwrite(NamesBuf, 1, NamesLen, Out);
+    fwrite(MacrosBuf, 1, MacrosLen, Out);
+    fwrite(Zeros, 1, H.TypesOff - (H.MacrosOff + MacrosLen), Out);
+    fwrite(W.Types.Data, sizeof(uint32_t), W.Types.Len, Out);
+    fwrite(W.Decls.Data, sizeof(uint32_t), W.Decls.Len, Out);
+    if (fflush(Out) || ferror(Out))
+    {
+        error("cannot write snapshot: %s", strerror(errno));
+    }
+
+    free(NamesBuf);
+    free(MacrosBuf);
+    free(W.Types.Data);
+    free(W.Decls.Data);
+    hashmapFree(&W.NameIdx);
+    hashmapFree(&W.TypeIdx);
+}
+
+//
+// 载入
+//
+
+// 按顺序读取整数表，越界时报错
+typedef struct
+{
+    uint32_t *P;
+    uint32_t *End;
+    char *Path;
+} Reader;
+
+static uint32_t readWord(Reader *R)
+{
+    if (R->P == R->End)
+    {
+        error("%s: corrupted snapshot", R->Path);
+    }
+    return *R->P++;
+}
+
+// 读取一个下标，必须小于 Cnt
+static uint32_t readIndex(Reader *R, uint32_t Cnt)
+{
+    uint32_t Idx = readWord(R);
+    if (Idx >= Cnt)
+    {
+        error("%s: corrupted snapshot", R->Path);
+    }
+    return Idx;
+}
+
+// 映射声明快照并恢复其中的声明和宏，需要在预处理和语法分析之前调用
+void loadSnapshot(char *Path)
+{
+    int FD = open(Path, O_RDONLY);
+    if (FD < 0)
+    {
+        error("cannot open %s: %s", Path, strerror(errno));
+    }
+    struct stat St;
+    if (fstat(FD, &St) < 0)
+    {
+        error("cannot stat %s: %s", Path, strerror(errno));
+    }
+    size_t Size = St.st_size;
+    if (Size < sizeof(SnapshotHeader))
+    {
+        error("%s: not a snapshot file", Path);
+    }
+    // 只读映射，名称和宏的终结符直接指向映射的内存
+    char *Base = mmap(NULL, Size, PROT_READ, MAP_PRIVATE, FD, 0);
+    if (Base == MAP_FAILED)
+    {
+        error("cannot map %s: %s", Path, strerror(errno));
+    }
+    close(FD);
+
+    SnapshotHeader *H = (SnapshotHeader *)Base;
+    if (memcmp(H->Magic, SNAPSHOT_MAGIC, sizeof(H->Magic)))
+    {
+        error("%s: not a snapshot file", Path);
+    }
+    if (H->Version != SNAPSHOT_VERSION)
+    {
+        error("%s: snapshot was built by a different version of rvcc", Path);
+    }
+    if ((uint64_t)H->NamesOff + H->NamesLen > Size || (uint64_t)H->MacrosOff + H->MacrosLen > Size ||
+        (uint64_t)H->TypesOff + sizeof(uint32_t) * H->TypesLen > Size ||
+        (uint64_t)H->DeclsOff + sizeof(uint32_t) * H->DeclsLen > Size ||
+        H->TypesOff % sizeof(uint32_t) || H->DeclsOff % sizeof(uint32_t) ||
+        // 每个类型至少占一个整数，每个声明占三个整数
+        H->TypeCnt > H->TypesLen || (uint64_t)H->DeclCnt * 3 > H->DeclsLen)
+    {
+        error("%s: corrupted snapshot", Path);
+    }
+
+    // 名称表中的每个终结符都是一个标识符
+    Token *Names = tokenizeText(Path, Base + H->NamesOff, H->NamesLen);
+    uint32_t NameCnt = 0;
+    for (; Names[NameCnt].kind != TK_EOF; NameCnt++)
+    {
+        if (Names[NameCnt].kind != TK_IDENT)
+        {
+            error("%s: corrupted snapshot", Path);
+        }
+    }
+
+    // 类型表，类型只引用下标更小的类型
+    uint32_t TypeCnt = BUILTIN_CNT + H->TypeCnt;
+    Type **Types = malloc(sizeof(Type *) * TypeCnt);
+    if (!Types)
+    {
+        error("out of memory: %s", strerror(errno));
+    }
+    for (int I = 0; I < BUILTIN_CNT; I++)
+    {
+        Types[I] = builtinType(I);
+    }
+
+    Reader R = {(uint32_t *)(Base + H->TypesOff), (uint32_t *)(Base + H->TypesOff) + H->TypesLen, Path};
+    for (uint32_t I = BUILTIN_CNT; I < TypeCnt; I++)
+    {
+        uint32_t Kind = readWord(&R);
+        switch (Kind)
+        {
+        case TY_PTR:
+            Types[I] = pointerTo(Types[readIndex(&R, I)]);
+            break;
+        case TY_ARRAY:
+        {
+            Type *BaseTy = Types[readIndex(&R, I)];
+            Types[I] = arrayOf(BaseTy, readWord(&R));
+            break;
+        }
+        case TY_FUNC:
+        {
+            Type *Ret = Types[readIndex(&R, I)];
+            uint32_t ParamCnt = readWord(&R);
+            if (ParamCnt > (uint32_t)(R.End - R.P))
+            {
+                error("%s: corrupted snapshot", Path);
+            }
+            Type *Params[ParamCnt + 1];
+            for (uint32_t J = 0; J < ParamCnt; J++)
+            {
+                Params[J] = Types[readIndex(&R, I)];
+            }
+            Types[I] = funcType(Ret, Params, ParamCnt);
+            break;
+        }
+        case TY_STRUCT:
+        case TY_UNION:
+        {
+            Type *Ty = arenaAlloc(AK_TYPE, sizeof(Type));
+            Ty->kind = Kind;
+            Ty->size = readWord(&R);
+            Ty->align = readWord(&R);
+            uint32_t MemCnt = readWord(&R);
+
+            Member Head = {};
+            Member *Cur = &Head;
+            for (uint32_t J = 0; J < MemCnt; J++)
+            {
+                Member *Mem = arenaAlloc(AK_TYPE, sizeof(Member));
+                Mem->name = &Names[readIndex(&R, NameCnt)];
+                Mem->type = Types[readIndex(&R, I)];
+                Mem->offset = readWord(&R);
+                Cur = Cur->next = Mem;
+            }
+            Ty->Mems = Head.next;
+            indexMembers(Ty);
+            Types[I] = Ty;
+            break;
+        }
+        default:
+            error("%s: corrupted snapshot", Path);
+        }
+    }
+
+    // 按保存时的顺序在全局域中声明
+    R = (Reader){(uint32_t *)(Base + H->DeclsOff), (uint32_t *)(Base + H->DeclsOff) + H->DeclsLen, Path};
+    for (uint32_t I = 0; I < H->DeclCnt; I++)
+    {
+        uint32_t Kind = readWord(&R);
+        char *Name = Names[readIndex(&R, NameCnt)].Name;
+        Type *Ty = Types[readIndex(&R, TypeCnt)];
+
+        GlobalName G = {.Name = Name};
+        switch (Kind)
+        {
+        case DECL_VAR:
+        case DECL_FUNC:
+            G.Var = arenaAlloc(AK_OBJ, sizeof(Obj));
+            G.Var->name = Name;
+            G.Var->type = Ty;
+            G.Var->isFunction = Kind == DECL_FUNC;
+            break;
+        case DECL_TYPEDEF:
+            G.Typedef = Ty;
+            break;
+        case DECL_TAG:
+            G.Tag = Ty;
+            break;
+        default:
+            error("%s: corrupted snapshot", Path);
+        }
+        declareGlobalName(&G);
+    }
+    free(Types);
+
+    // 重新预处理 #define 指令以恢复宏表
+    preprocess(tokenizeText(Path, Base + H->MacrosOff, H->MacrosLen));
+}
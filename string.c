@@ -1,17 +1,42 @@
 #include "rvcc.h"
 
-// 格式化后返回字符串
-char *format(char *Fmt, ...)
+// 以 va_list 类型的参数格式化后返回字符串
+char *vformat(char *Fmt, va_list VA)
 {
     char *Buf;
     size_t BufLen;
     // 将字符串对应的内存作为 I/O 流
     FILE *Out = open_memstream(&Buf, &BufLen);
-    va_list VA;
-    va_start(VA, Fmt);
     // 向流中写入数据
     vfprintf(Out, Fmt, VA);
-    va_end(VA);
     fclose(Out);
     return Buf;
+}
+
+// 格式化后返回字符串
+char *format(char *Fmt, ...)
+{
+    va_list VA;
+    va_start(VA, Fmt);
+    char *Buf = vformat(Fmt, VA);
+    va_end(VA);
+    return Buf;
+}
+
+// 字符串驻留表，内容映射到唯一的字符串
+static _Thread_local HashMap InternMap;
+
+// 驻留字符串，词法分析时每种拼写只复制一次，之后比较名称只需比较指针。
+// 缓存的头文件中的终结符引用驻留的名称，因此名称跨编译保留
+char *intern(char *S, int Len)
+{
+    char *Str = hashmapGet2(&InternMap, S, Len);
+    if (Str)
+    {
+        return Str;
+    }
+
+    Str = arenaStrndup(AK_PERM, S, Len);
+    hashmapPut2(&InternMap, Str, Len, Str);
+    return Str;
 }
\ No newline at end of file
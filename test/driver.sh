@@ -31,4 +31,152 @@ check -o
 ./rvcc --help 2>&1 | grep -q rvcc
 # 将--help传入check函数
 check --help
+
+# -fmem-report
+# 编译结束后向标准错误输出内存池的统计信息
+./rvcc -fmem-report -o $tmp/out $tmp/empty.c 2>&1 | grep -q '^total'
+check -fmem-report
+
+# -fstream
+# 逐个函数地生成代码，全局变量在函数之后输出
+echo 'int x; int f() { return 1; } int main() { return f(); }' > $tmp/stream.c
+./rvcc -fstream -o $tmp/out $tmp/stream.c
+grep -q '^main:' $tmp/out && grep -q '^f:' $tmp/out && grep -q '^x:' $tmp/out
+check -fstream
+
+# -j
+# 并行生成代码的输出与串行生成的完全相同
+./rvcc -o $tmp/out1 $tmp/stream.c
+./rvcc -j 4 -o $tmp/out2 $tmp/stream.c
+cmp -s $tmp/out1 $tmp/out2
+check -j
+
+# -j 并行生成代码的线程出错时，只报告一次错误并正常结束编译
+printf 'int f() { return 1; }\nint main() { 1 = 2; return 0; }\n' > $tmp/lvalue.c
+! ./rvcc -j 4 -o $tmp/out $tmp/lvalue.c 2> $tmp/err &&
+  [ "$(grep -c 'not an lvalue' $tmp/err)" = 1 ]
+check '-j errors'
+
+# -j 较大的输入按行切分后并行进行词法分析，跨越分块边界的块注释需要重新分析
+awk 'BEGIN {
+  for (i = 0; i < 30000; i++) print "int f" i "(int x) { return x + " i "; }"
+  print "/*"
+  for (i = 0; i < 30000; i++) print " * \"not a string, int y = 1; / * in text *"
+  print " */"
+  for (i = 30000; i < 80000; i++) print "int f" i "(int x) { return x + " i "; }"
+  print "int main() { return f79999(1); }"
+}' > $tmp/lex.c
+./rvcc -o $tmp/out1 $tmp/lex.c
+./rvcc -j 4 -o $tmp/out2 $tmp/lex.c
+cmp -s $tmp/out1 $tmp/out2
+check '-j lexing'
+
+# 默认的输出不含注释，-fverbose-asm 输出解释每条指令的注释
+./rvcc -o $tmp/out $tmp/stream.c
+! grep -q '#' $tmp/out
+check 'lean asm'
+./rvcc -fverbose-asm -o $tmp/out $tmp/stream.c
+grep -q '^ *#' $tmp/out
+check -fverbose-asm
+
+# -g0 不输出行号信息
+./rvcc -g0 -o $tmp/out $tmp/stream.c
+! grep -q '\.loc\|\.file' $tmp/out
+check -g0
+
+# -c 由内置的汇编器直接输出 ELF 可重定位文件
+./rvcc -c -o $tmp/out.o $tmp/stream.c
+[ "$(head -c 4 $tmp/out.o | tail -c 3)" = ELF ]
+check -c
+# 直接编码的结果与汇编 -fverbose-asm 输出的文本得到的完全相同
+./rvcc -c -o $tmp/out1.o $tmp/lex.c
+./rvcc -c -fverbose-asm -o $tmp/out2.o $tmp/lex.c
+cmp -s $tmp/out1.o $tmp/out2.o
+check '-c direct encoding'
+
+# 多个输入文件在一个进程内同时编译，结果写入 -output-dir 中的同名文件，
+# 出错的文件不影响其余文件的编译
+mkdir -p $tmp/multi $tmp/multi-out
+echo 'int one() { return 1; }' > $tmp/multi/a.c
+echo 'int two() { return 2; }' > $tmp/multi/b.c
+echo 'int main() { return x; }' > $tmp/multi/bad.c
+! ./rvcc -j 2 -output-dir $tmp/multi-out $tmp/multi/a.c $tmp/multi/bad.c $tmp/multi/b.c 2> /dev/null &&
+  ./rvcc -o $tmp/out $tmp/multi/b.c && cmp -s $tmp/out $tmp/multi-out/b.s &&
+  grep -q '^one:' $tmp/multi-out/a.s && [ ! -f $tmp/multi-out/bad.s ]
+check 'multiple inputs'
+
+# -I 添加 #include <...> 搜索的目录
+mkdir -p $tmp/inc
+echo 'int incfn() { return 3; }' > $tmp/inc/inc.h
+echo '#include <inc.h>' > $tmp/inc.c
+./rvcc -I $tmp/inc -o $tmp/out $tmp/inc.c
+grep -q '^incfn:' $tmp/out
+check -I
+
+# 头文件包含自身时，超过嵌套的最大层数后报错
+echo '#include "self.h"' > $tmp/self.h
+echo '#include "self.h"' > $tmp/self.c
+! ./rvcc -o $tmp/out $tmp/self.c 2> $tmp/err && grep -q 'exceeds maximum' $tmp/err
+check 'include depth'
+
+# -emit-snapshot 保存头文件中的声明和宏，-include-snapshot 直接载入
+cat > $tmp/snap.h <<EOF
+typedef struct { int a; long b; } SnapT;
+int snapfn(SnapT *p);
+#define SNAPVAL 7
+EOF
+echo 'int main() { SnapT t; t.b = SNAPVAL; return snapfn(&t); }' > $tmp/snap.c
+./rvcc -emit-snapshot -o $tmp/snap.snap $tmp/snap.h
+./rvcc -include-snapshot $tmp/snap.snap -o $tmp/out $tmp/snap.c
+grep -q 'snapfn' $tmp/out
+check -include-snapshot
+# 解析出错时不留下声明快照
+echo 'int f(;' > $tmp/badsnap.h
+! ./rvcc -emit-snapshot -o $tmp/bad.snap $tmp/badsnap.h 2> /dev/null && [ ! -e $tmp/bad.snap ]
+check '-emit-snapshot error'
+# 文件头中的类型数量损坏时报错而不是崩溃
+cp $tmp/snap.snap $tmp/corrupt.snap
+printf '\000\000\000\100' | dd of=$tmp/corrupt.snap bs=1 seek=36 conv=notrunc 2> /dev/null
+! ./rvcc -include-snapshot $tmp/corrupt.snap -o $tmp/out $tmp/snap.c 2> $tmp/err &&
+  grep -q 'corrupted snapshot' $tmp/err
+check '-include-snapshot corrupted'
+
+# -fcache-dir 缓存编译结果，相同的输入第二次编译时命中缓存
+./rvcc -fcache-dir=$tmp/cache -o $tmp/out1 $tmp/stream.c
+./rvcc -fcache-dir=$tmp/cache -o $tmp/out2 $tmp/stream.c
+./rvcc -o $tmp/out3 $tmp/stream.c
+cmp -s $tmp/out1 $tmp/out3 && cmp -s $tmp/out2 $tmp/out3
+check -fcache-dir
+./rvcc -fcache-dir=$tmp/cache -fcache-stats 2>&1 | grep -q '^hits *1$'
+check -fcache-stats
+
+# 增量编译时只重新生成修改过的函数，其余函数复用上次编译的代码
+echo 'int one() { return 1; }' > $tmp/incr.h
+printf '#include "incr.h"\nint f() { return one(); }\nint main() { return 0; }\n' > $tmp/incr.c
+./rvcc -fcache-dir=$tmp/cache2 -o $tmp/out1 $tmp/incr.c
+printf '#include "incr.h"\nint f() { return one(); }\nint main() { return 1; }\n' > $tmp/incr.c
+./rvcc -fcache-dir=$tmp/cache2 -fcache-stats -o $tmp/out1 $tmp/incr.c 2> $tmp/stats
+./rvcc -o $tmp/out2 $tmp/incr.c
+cmp -s $tmp/out1 $tmp/out2 && grep -q '^fn-hits *2$' $tmp/stats
+check 'incremental compilation'
+
+# --server 常驻处理编译请求，rvcc-client 的用法与 rvcc 相同，结果与直接编译相同
+./rvcc --server=$tmp/sock --server-workers=1 &
+server=$!
+trap 'kill $server; rm -rf $tmp' INT TERM HUP EXIT
+for i in $(seq 50); do [ -S $tmp/sock ] && break; sleep 0.1; done
+export RVCC_SERVER=$tmp/sock
+./rvcc-client -o $tmp/out1 $tmp/incr.c
+echo 'int one() { return 2; }' > $tmp/incr.h
+./rvcc-client -o $tmp/out1 $tmp/incr.c
+./rvcc -o $tmp/out2 $tmp/incr.c
+cmp -s $tmp/out1 $tmp/out2
+check --server
+# 出错的请求只影响其自身，服务器继续处理之后的请求
+echo 'int main() { return x; }' > $tmp/bad.c
+! ./rvcc-client -o $tmp/out1 $tmp/bad.c 2> /dev/null &&
+  ./rvcc-client -o - $tmp/stream.c | cmp -s - $tmp/out3
+check 'server error recovery'
+unset RVCC_SERVER
+
 echo OK
\ No newline at end of file
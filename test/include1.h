@@ -0,0 +1,9 @@
+#ifndef INCLUDE1_H
+#define INCLUDE1_H
+
+// 包含保护的宏已定义时，重复包含的内容被跳过
+int include1() { return 5; }
+
+#define INCLUDE1 1
+
+#endif
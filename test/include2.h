@@ -0,0 +1,4 @@
+#pragma once
+
+// #pragma once 的文件只包含一次
+int include2() { return 7; }
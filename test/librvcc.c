@@ -0,0 +1,80 @@
+// librvcc 的测试，在主机上编译运行，不经过 rvcc
+#include "../librvcc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int Fails;
+
+// 检查条件是否成立，不成立时输出所在的行
+#define CHECK(Cond)                                                    \
+    do                                                                 \
+    {                                                                  \
+        if (!(Cond))                                                   \
+        {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,    \
+                    __LINE__, #Cond);                                  \
+            Fails++;                                                   \
+        }                                                              \
+    } while (0)
+
+static char Good[] = "int sq(int x) { return x * x; }\nint main() { return sq(3); }\n";
+static char Bad[] = "int main() {\n  return x;\n}\n";
+// 错误在生成代码时才被发现，并行生成时由工作线程报告
+static char NotLvalue[] = "int f() { return 1; }\nint main() { 1 = 2; return 0; }\n";
+
+// 编译正确的代码，检查输出
+static void compileGood(RvccContext *C)
+{
+    char *Out;
+    size_t Len;
+    CHECK(rvccCompile(C, "good.c", Good, strlen(Good), &Out, &Len) == 0);
+    CHECK(rvccGetDiags(C) == NULL);
+    CHECK(Out && Len > 0);
+    CHECK(Out && strstr(Out, ".file 1 \"good.c\""));
+    CHECK(Out && strstr(Out, "\nsq:\n"));
+    CHECK(Out && strstr(Out, "\nmain:\n"));
+}
+
+int main(void)
+{
+    RvccContext *C = rvccCreate();
+
+    compileGood(C);
+
+    // 出错时返回非 0，错误通过诊断信息返回，进程继续运行
+    char *Out;
+    size_t Len;
+    CHECK(rvccCompile(C, "bad.c", Bad, strlen(Bad), &Out, &Len) != 0);
+    CHECK(Out == NULL && Len == 0);
+    RvccDiag *D = rvccGetDiags(C);
+    CHECK(D && D->File && strcmp(D->File, "bad.c") == 0);
+    CHECK(D && D->Line == 2 && D->Col == 10);
+    CHECK(D && D->Msg && strcmp(D->Msg, "undefined variable") == 0);
+    CHECK(D && D->Next == NULL);
+
+    // 出错后同一个上下文可以继续编译
+    compileGood(C);
+
+    // 并行生成代码时出错
+    rvccSetOption(C, RVCC_OPT_JOBS, 2);
+    CHECK(rvccCompile(C, "lvalue.c", NotLvalue, strlen(NotLvalue), &Out, &Len) != 0);
+    D = rvccGetDiags(C);
+    CHECK(D && D->File && strcmp(D->File, "lvalue.c") == 0);
+    CHECK(D && D->Line == 2);
+    CHECK(D && D->Msg && strcmp(D->Msg, "not an lvalue") == 0);
+    compileGood(C);
+
+    // 直接输出 ELF 可重定位文件
+    rvccSetOption(C, RVCC_OPT_OBJECT, 1);
+    CHECK(rvccCompile(C, "good.c", Good, strlen(Good), &Out, &Len) == 0);
+    CHECK(Len > 4 && memcmp(Out, "\x7f" "ELF", 4) == 0);
+
+    rvccDestroy(C);
+    if (Fails)
+    {
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "test.h"
+#include "include1.h"
+#include "include1.h"
+#include "include2.h"
+#include "include2.h"
+
+#
+
+#define M1 3
+#define M2 M1 + M1
+#define M3 (M1 * 2)
+#define ADD(x, y) ((x) + (y))
+#define TWICE(x) ADD(x, x)
+#define NOARG() 9
+#define CAT(x, y) x##y
+#define STR(x) #x
+#define FIRST(x, ...) x
+#define SELF SELF
+#define LONG_MACRO 1 + \
+    2
+
+int main()
+{
+    // 支持 #include，包含保护和 #pragma once
+    ASSERT(5, include1());
+    ASSERT(7, include2());
+    ASSERT(1, INCLUDE1);
+
+    // 支持对象式宏
+    ASSERT(3, M1);
+    ASSERT(9, M2 * 2);
+    ASSERT(12, M3 * 2);
+    ASSERT(3, LONG_MACRO);
+    ASSERT(4, ({ int SELF = 4; SELF; }));
+
+    // 支持函数式宏
+    ASSERT(5, ADD(2, 3));
+    ASSERT(10, TWICE(5));
+    ASSERT(7, ADD((1, 2), 5));
+    ASSERT(9, NOARG());
+    ASSERT(3, ({ int NOARG = 3; NOARG; }));
+    ASSERT(2, FIRST(2, 3, 4));
+
+    // 支持 # 和 ##
+    ASSERT(12, CAT(1, 2));
+    ASSERT(6, ({ int xy = 6; CAT(x, y); }));
+    ASSERT(5, sizeof(STR(a + b)));
+    ASSERT(34, STR("x")[0]);
+
+    // 支持 #undef
+#undef M1
+    ASSERT(4, ({ int M1 = 4; M1; }));
+#define M1 5
+    ASSERT(5, M1);
+
+    // 支持 #if、#ifdef、#ifndef、#elif 和 #else
+#if 1 + 2 == 3 && (4 << 1) == 8
+    int a = 1;
+#else
+    int a = 2;
+#endif
+    ASSERT(1, a);
+
+#if 0
+#if 1
+    a = 3;
+#endif
+    a = 4;
+#elif defined M1 || defined(UNDEFINED)
+    a = 5;
+#else
+    a = 6;
+#endif
+    ASSERT(5, a);
+
+#ifdef UNDEFINED
+    a = 7;
+#elif M1 - 5
+    a = 8;
+#else
+    a = 9;
+#endif
+    ASSERT(9, a);
+
+#ifndef UNDEFINED
+    a = 10;
+#endif
+    ASSERT(10, a);
+
+#if UNDEFINED ? 0 : !(1 > 2) * 11
+    a = 11;
+#endif
+    ASSERT(11, a);
+
+    printf("OK\n");
+    return 0;
+}
@@ -41,6 +41,9 @@ int main()
     ASSERT(4, ({ int x[2][3]; int *y=x; y[4]=4; x[1][1]; }));
     ASSERT(5, ({ int x[2][3]; int *y=x; y[5]=5; x[1][2]; }));
 
+    // 括号后的下标中含有表达式，解析时操作数栈会扩大
+    ASSERT(3, ({ int a; int b[2]; b[0]=0; b[1]=3; a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=a=(b)[1+(b)[0]]; a; }));
+
     printf("OK\n");
     return 0;
 }
\ No newline at end of file
@@ -57,6 +57,11 @@ int main()
     // [50] 支持 short 类型
     ASSERT(4, ({ struct {char a; short b;} x; sizeof(x); }));
 
+    // 成员较多的结构体，通过哈希表查找成员
+    ASSERT(9, ({ struct {int a,b,c,d,e,f,g,h,i;} x; x.i=9; x.a=1; x.i; }));
+    ASSERT(36, ({ struct {char a,b,c,d; int e,f,g,h,i;} x; sizeof(x); }));
+    ASSERT(2, ({ struct {int a,b,c,d,e,f,g,h;} x; struct {char h; int a;} y; y.h=2; x.h=5; y.h; }));
+
     printf("OK\n");
     return 0;
 }
\ No newline at end of file
@@ -67,6 +67,9 @@ int main()
     ASSERT(4, ({ char (x[3])[4]; sizeof(x[0]); }));
     ASSERT(3, ({ char *x[3]; char y; x[0]=&y; y=3; x[0][0]; }));
     ASSERT(4, ({ char x[3]; char (*y)[3]=x; y[0][0]=4; y[0][0]; }));
+    ASSERT(96, ({ char *(x[3])[4]; sizeof(x); }));
+    ASSERT(24, ({ char (*(*x)[3])[4]; sizeof(*x); }));
+    ASSERT(4, ({ char (*(*x)[3])[4]; sizeof(**x[0]); }));
 
     // [52] 支持 void 类型
     {
@@ -1,44 +1,262 @@
 #include "rvcc.h"
 
-static char *Input;           // 读入的内容
-static char *CurrentFilename; // 输入的文件名
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 所有的输入文件，按读入的顺序排列
+static _Thread_local File **Files;
+static _Thread_local int FileCnt;
+static _Thread_local int FileCap;
+// 本次编译有编号的输入文件，按编号排列，以 NULL 结尾
+static _Thread_local File **InputFiles;
+static _Thread_local int InputFileCnt;
+static _Thread_local int InputFileCap;
+// 下一个文件编号，临时文本不占用编号
+static _Thread_local int NextFileNo = 1;
+
+// 字符串字面量表
+typedef struct
+{
+    StrLiteral *Lits;
+    int Cnt;
+    int Cap;
+} StrTable;
+
+// TK_STR 终结符通过下标引用字符串字面量表中的项，
+// 跨编译保留的头文件中的字符串字面量存放在 KeptStrs 中，下标 I 记为 ~I
+static _Thread_local StrTable Strs;
+static _Thread_local StrTable KeptStrs;
+
+// 本次编译读入的文件内容和临时文本的缓冲区，服务器模式下编译结束后释放。
+// 跨编译保留的头文件的内容不在其中
+typedef struct
+{
+    char *Buf;
+    size_t Len;
+    bool Mapped; // 是否为映射的文件，否则为 malloc 分配的缓冲区
+} Buffer;
+
+static _Thread_local Buffer *Buffers;
+static _Thread_local int BufferCnt;
+static _Thread_local int BufferCap;
+
+// 结束编译时的跳转位置，属于设置它的线程
+static _Thread_local jmp_buf *ErrorJmp;
+// 接收错误信息的函数及其参数，为 NULL 时向标准错误输出
+static _Thread_local DiagHandler *OnDiag;
+static _Thread_local void *DiagCtx;
+
+// 新建一个输入文件，第一行从内容的开头开始，之后的行在遇到换行符时记录
+static File *newFile(char *Name, char *Contents, size_t Len, bool Keep)
+{
+    File *F = calloc(1, sizeof(File));
+    F->Name = Name;
+    F->Contents = Contents;
+    F->End = Contents + Len;
+    F->LineStarts = malloc(sizeof(uint32_t) * (F->LineCap = 1024));
+    F->LineStarts[F->LineCnt++] = 0;
+    F->Keep = Keep;
+
+    if (FileCnt + 1 >= FileCap)
+    {
+        FileCap = FileCap ? FileCap * 2 : 16;
+        Files = realloc(Files, sizeof(File *) * FileCap);
+    }
+    Files[FileCnt++] = F;
+    Files[FileCnt] = NULL;
+    return F;
+}
+
+// 为文件分配下一个编号，文件按编号的顺序输出 .file
+void numberFile(File *F)
+{
+    F->FileNo = NextFileNo++;
+    if (InputFileCnt + 1 >= InputFileCap)
+    {
+        InputFileCap = InputFileCap ? InputFileCap * 2 : 16;
+        InputFiles = realloc(InputFiles, sizeof(File *) * InputFileCap);
+    }
+    InputFiles[InputFileCnt++] = F;
+    InputFiles[InputFileCnt] = NULL;
+}
+
+// 获取所有的输入文件，通过 Cnt 返回文件的数量
+File **getFiles(int *Cnt)
+{
+    *Cnt = FileCnt;
+    return Files;
+}
+
+// 使用另一个线程的文件列表，用于并行生成代码的工作线程查询行号，
+// 共享期间文件列表不能变化
+void shareFiles(File **Fs, int Cnt)
+{
+    Files = Fs;
+    FileCnt = Cnt;
+}
+
+// 获取本次编译的所有有编号的输入文件
+File **getInputFiles(void)
+{
+    static File *None[1];
+    return InputFiles ? InputFiles : None;
+}
+
+// 相邻的终结符多数在同一个文件中，每个线程各自记录上次查到的文件和行
+static _Thread_local File *LastFile;
+static _Thread_local File *LastLineFile;
+static _Thread_local int LastLine;
+
+// 获取 Loc 所在的文件，TK_EOF 的位置为文件内容的末尾
+File *getFile(char *Loc)
+{
+    if (LastFile && LastFile->Contents <= Loc && Loc < LastFile->End)
+    {
+        return LastFile;
+    }
+
+    for (int I = 0; I < FileCnt; I++)
+    {
+        if (Files[I]->Contents <= Loc && Loc < Files[I]->End)
+        {
+            return LastFile = Files[I];
+        }
+    }
+    // 文件的末尾可能与另一个文件的开头重合，所以最后再比较
+    for (int I = 0; I < FileCnt; I++)
+    {
+        if (Loc == Files[I]->End)
+        {
+            return Files[I];
+        }
+    }
+    unreachable();
+    return NULL;
+}
+
+// 通过二分查找，获取 Loc 所在的行号
+int getLineNo(char *Loc)
+{
+    File *F = getFile(Loc);
+    uint32_t Off = Loc - F->Contents;
+    uint32_t *LineStarts = F->LineStarts;
+    int LineCnt = F->LineCnt;
+
+    // 代码生成按顺序查询行号，多数情况下仍在上次查到的行内
+    if (LastLineFile == F && LineStarts[LastLine] <= Off &&
+        (LastLine + 1 == LineCnt || Off < LineStarts[LastLine + 1]))
+    {
+        return LastLine + 1;
+    }
+
+    // 查找最后一个不大于 Off 的行首
+    int Lo = 0, Hi = LineCnt - 1;
+    while (Lo < Hi)
+    {
+        int Mid = (Lo + Hi + 1) / 2;
+        if (LineStarts[Mid] <= Off)
+        {
+            Lo = Mid;
+        }
+        else
+        {
+            Hi = Mid - 1;
+        }
+    }
+    LastLineFile = F;
+    LastLine = Lo;
+    return Lo + 1;
+}
+
+// 设置结束编译时的跳转位置，只对调用者所在的线程有效
+void setErrorJmp(jmp_buf *Buf)
+{
+    ErrorJmp = Buf;
+}
+
+// 获取调用者所在的线程结束编译时的跳转位置
+jmp_buf *getErrorJmp(void)
+{
+    return ErrorJmp;
+}
+
+// 设置接收错误信息的函数，Ctx 为传给它的参数，只对调用者所在的线程有效
+void setDiagHandler(DiagHandler *Fn, void *Ctx)
+{
+    OnDiag = Fn;
+    DiagCtx = Ctx;
+}
+
+// 获取调用者所在的线程接收错误信息的函数，通过 Ctx 返回其参数
+DiagHandler *getDiagHandler(void **Ctx)
+{
+    *Ctx = DiagCtx;
+    return OnDiag;
+}
+
+// 结束编译，设置了跳转位置时跳转回去，否则（如工作线程出错）退出进程
+void exitCompile(int Status)
+{
+    if (ErrorJmp)
+    {
+        // setjmp 返回 0 表示首次返回，因此状态加一
+        longjmp(*ErrorJmp, Status + 1);
+    }
+    exit(Status);
+}
 
 // 输出错误信息
 void error(char *Fmt, ...)
 {
     va_list VA;
-    va_start(VA, Fmt);         // VA 获取 Fmt 后面的所有参数
-    vfprintf(stderr, Fmt, VA); // vfprintf 可以输出 va_list 类型的参数
-    fprintf(stderr, "\n");
+    va_start(VA, Fmt); // VA 获取 Fmt 后面的所有参数
+    if (OnDiag)
+    {
+        OnDiag(DiagCtx, NULL, 0, 0, vformat(Fmt, VA));
+    }
+    else
+    {
+        // 同时编译多个文件时，避免与其他线程的错误信息交错
+        flockfile(stderr);
+        vfprintf(stderr, Fmt, VA); // vfprintf 可以输出 va_list 类型的参数
+        fprintf(stderr, "\n");
+        funlockfile(stderr);
+    }
     // 清除 VA
     va_end(VA);
-    exit(1);
+    exitCompile(1);
 }
 
 // 输出错误出现的位置
 void verrorAt(int lineNo, char *Cur, char *Fmt, va_list VA)
 {
-    // 查找包含 loc 的行
-    char *Line = Cur;
+    // 从行首偏移量表中获取包含 loc 的行的行首
+    File *F = getFile(Cur);
+    char *Line = F->Contents + F->LineStarts[lineNo - 1];
 
-    // Line 递减到当前行的最开始的位置
-    // Line<Input, 判断是否读取到文件最开始的位置
-    // Line[-1] != '\n'，Line 字符串前一个字符是否为换行符（上一行末尾）
-    while (Input < Line && Line[-1] != '\n')
+    // End 为行尾的换行符，或是输入的末尾
+    char *End = memchr(Cur, '\n', F->End - Cur);
+    if (!End)
     {
-        Line--;
+        End = F->End;
     }
 
-    // End 递增到行尾的换行符
-    char *End = Cur;
-    while (*End != '\n')
+    if (OnDiag)
     {
-        End++;
+        OnDiag(DiagCtx, F->Name, lineNo, Cur - Line + 1, vformat(Fmt, VA));
+        va_end(VA);
+        return;
     }
 
+    // 同时编译多个文件时，避免与其他线程的错误信息交错
+    flockfile(stderr);
     // 输出 文件名：错误行
     // Indent 记录输出了多少个字符
-    int Indent = fprintf(stderr, "%s:%d: ", CurrentFilename, lineNo);
+    int Indent = fprintf(stderr, "%s:%d: ", F->Name, lineNo);
     // 输出 Line 的行内所有字符（不含换行符）
     fprintf(stderr, "%.*s\n", (int)(End - Line), Line);
 
@@ -50,6 +268,7 @@ void verrorAt(int lineNo, char *Cur, char *Fmt, va_list VA)
     fprintf(stderr, "^ ");
     vfprintf(stderr, Fmt, VA);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 
     va_end(VA);
 }
@@ -57,19 +276,10 @@ void verrorAt(int lineNo, char *Cur, char *Fmt, va_list VA)
 // 字符解析错误
 void errorAt(char *Loc, char *Fmt, ...)
 {
-    int lineNo = 1;
-    for (char *P = Input; P < Loc; P++)
-    {
-        if (*P == '\n')
-        {
-            lineNo++;
-        }
-    }
-
     va_list VA;
     va_start(VA, Fmt);
-    verrorAt(lineNo, Loc, Fmt, VA);
-    exit(1);
+    verrorAt(getLineNo(Loc), Loc, Fmt, VA);
+    exitCompile(1);
 }
 
 // Tok 解析错误
@@ -77,96 +287,427 @@ void errorTok(Token *T, char *Fmt, ...)
 {
     va_list VA;
     va_start(VA, Fmt);
-    verrorAt(T->lineNo, T->Loc, Fmt, VA);
-    exit(1);
+    verrorAt(getLineNo(T->Loc), T->Loc, Fmt, VA);
+    exitCompile(1);
+}
+
+// 关键字和多字符操作符的拼写
+static char *TokenIdStr[TID_COUNT] = {
+    [TID_EQ] = "==",
+    [TID_NE] = "!=",
+    [TID_LE] = "<=",
+    [TID_GE] = ">=",
+    [TID_ARROW] = "->",
+    [TID_LOGAND] = "&&",
+    [TID_LOGOR] = "||",
+    [TID_SHL] = "<<",
+    [TID_SHR] = ">>",
+    [TID_HASHHASH] = "##",
+    [KW_RETURN] = "return",
+    [KW_IF] = "if",
+    [KW_ELSE] = "else",
+    [KW_FOR] = "for",
+    [KW_WHILE] = "while",
+    [KW_INT] = "int",
+    [KW_LONG] = "long",
+    [KW_SHORT] = "short",
+    [KW_CHAR] = "char",
+    [KW_STRUCT] = "struct",
+    [KW_UNION] = "union",
+    [KW_SIZEOF] = "sizeof",
+    [KW_VOID] = "void",
+    [KW_TYPEDEF] = "typedef",
+};
+
+// 关键字或操作符的拼写
+char *tokenIdName(TokenId Id)
+{
+    if (Id < TID_EQ)
+    {
+        return format("%c", Id);
+    }
+    return TokenIdStr[Id];
 }
 
-bool equal(Token *T, char *ch)
+// 判断 Token 是否为编号 Id 的关键字或操作符，只需比较整数
+bool equal(Token *T, TokenId Id)
 {
-    return memcmp(T->Loc, ch, T->Len) == 0 && ch[T->Len] == '\0';
+    return T->Id == Id;
 }
 
 // 跳过指定的字符，如果与指定的字符不同，则报错
-Token *skip(Token *T, char *ch)
+Token *skip(Token *T, TokenId Id)
 {
-    if (!equal(T, ch))
+    if (!equal(T, Id))
     {
-        errorTok(T, "expected: %s, got: %s", ch, T->Loc);
+        errorTok(T, "expected: %s, got: %.*s", tokenIdName(Id), T->Len, T->Loc);
     }
-    return T->next;
+    return T + 1;
 }
 
 // 消耗掉指定字符的 Token，如果不匹配只会返回 false
-bool consume(Token **Rest, Token *Tok, char *str)
+bool consume(Token **Rest, Token *Tok, TokenId Id)
 {
-    if (equal(Tok, str))
+    if (equal(Tok, Id))
     {
-        *Rest = Tok->next;
+        *Rest = Tok + 1;
         return true;
     }
     *Rest = Tok;
     return false;
 }
 
-static Token *newToken(TokenKind kind, char *start, char *end)
+// 获取 TK_STR 终结符的字符串字面量
+StrLiteral *getStrLiteral(Token *Tok)
+{
+    return Tok->StrIdx < 0 ? &KeptStrs.Lits[~Tok->StrIdx] : &Strs.Lits[Tok->StrIdx];
+}
+
+// 词法分析器，分析输入中的一段区间 [Start, End)
+// 并行分析时每个分块各有一个，分析的过程中不访问内存池等共享的状态，
+// 名称的驻留、字符串字面量的解码和错误的报告都推迟到按顺序拼接分块时进行
+typedef struct
 {
-    Token *tok = calloc(1, sizeof(Token)); // 由于编译器的运行时间较短，可以不回收内存，而是等待程序结束后操作系统的回收，以提升效率
-    tok->kind = kind;
-    tok->Loc = start;
-    tok->Len = end - start;
+    File *F;         // 分析的文件
+    char *Start;     // 区间的开头
+    char *End;       // 区间的末尾
+    Token *Toks;     // 终结符数组，容量不足时成倍扩大
+    int TokCnt;      // 已产生的终结符数
+    int TokCap;
+    uint32_t *Lines; // 区间内新的各行的行首偏移量
+    int LineCnt;
+    int LineCap;
+    bool Deferred;   // 标识符只记录分块内的名称编号，拼接时再驻留
+    HashMap Names;   // 分块内的名称到编号 +1 的映射
+    int *NameToks;   // 各名称第一次出现的终结符的下标
+    int NameCnt;
+    int NameCap;
+    char *Spill;     // 越过区间末尾的注释或字符串字面量的开头
+    char *ErrLoc;    // 第一个错误的位置，出错后分析即停止
+    char *ErrMsg;    // 第一个错误的信息
+    bool AtBOL;      // 下一个终结符是否位于行首
+    bool HasSpace;   // 下一个终结符前是否有空白
+} Lexer;
+
+// 记录从 P 开始的新的一行
+static void addLine(Lexer *L, char *P)
+{
+    if (L->LineCnt == L->LineCap)
+    {
+        L->LineCap = L->LineCap ? L->LineCap * 2 : 1024;
+        L->Lines = realloc(L->Lines, sizeof(uint32_t) * L->LineCap);
+    }
+    L->Lines[L->LineCnt++] = P - L->F->Contents;
+}
+
+// 在终结符数组的末尾添加一个终结符
+static Token *newToken(Lexer *L, TokenKind kind, char *start, char *end)
+{
+    if (L->TokCnt == L->TokCap)
+    {
+        // 按平均每 8 个字符一个终结符估计初始容量
+        L->TokCap = L->TokCap ? L->TokCap * 2 : (L->End - L->Start) / 8 + 16;
+        L->Toks = realloc(L->Toks, sizeof(Token) * L->TokCap);
+    }
+    Token *tok = &L->Toks[L->TokCnt++];
+    *tok = (Token){.kind = kind, .Loc = start, .Len = end - start, .AtBOL = L->AtBOL, .HasSpace = L->HasSpace};
+    L->AtBOL = L->HasSpace = false;
     return tok;
 }
 
-// 判断 Str 是否以 SubStr 开头
-static bool startsWith(char *Str, char *SubStr)
+// 字符的类别，词法分析的主循环根据首字符的类别进行分派
+enum
+{
+    CC_OTHER, // 非法字符
+    CC_SPACE, // 空白字符
+    CC_DIGIT, // 数字
+    CC_IDENT, // 标识符首字母（字母和下划线）
+    CC_QUOTE, // 双引号，字符串字面量的开始
+    CC_SLASH, // 斜杠，注释的开始或操作符
+    CC_PUNCT, // 其他操作符
+};
+
+#define O CC_OTHER
+#define S CC_SPACE
+#define D CC_DIGIT
+#define I CC_IDENT
+#define Q CC_QUOTE
+#define L CC_SLASH
+#define P CC_PUNCT
+
+// 字符类别表，非 ASCII 字符均为非法字符
+static unsigned char CharClass[256] = {
+    O, O, O, O, O, O, O, O, O, S, S, S, S, S, O, O, // 0x00-0x0F
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, // 0x10-0x1F
+    S, P, Q, P, P, P, P, P, P, P, P, P, P, P, P, L, // 0x20-0x2F
+    D, D, D, D, D, D, D, D, D, D, P, P, P, P, P, P, // 0x30-0x3F
+    P, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, // 0x40-0x4F
+    I, I, I, I, I, I, I, I, I, I, I, P, P, P, P, I, // 0x50-0x5F
+    P, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, // 0x60-0x6F
+    I, I, I, I, I, I, I, I, I, I, I, P, P, P, P, O, // 0x70-0x7F
+};
+
+#undef O
+#undef S
+#undef D
+#undef I
+#undef Q
+#undef L
+#undef P
+
+// 获取字符的类别
+static int charClass(char C)
+{
+    return CharClass[(unsigned char)C];
+}
+
+// 判断是否符号标识符的非首字母部分
+static bool isIdentBody(char C)
+{
+    int Class = charClass(C);
+    return Class == CC_IDENT || Class == CC_DIGIT;
+}
+
+//
+// 按字（8 字节）扫描
+//
+// 将 8 个字节装入一个 64 位整数，通过位运算同时判断每个字节，
+// 结果中每个满足条件的字节的最高位被置位。
+//
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// 从 P 处读取一个字，调用者需保证 P 之后至少还有 8 个字节
+static uint64_t loadWord(char *P)
+{
+    uint64_t W;
+    memcpy(&W, P, sizeof(W));
+    return W;
+}
+
+// 标记值为 0 的字节
+static uint64_t zeroBytes(uint64_t W)
+{
+    // (低 7 位 + 0x7F) 在低 7 位非 0 时进位到最高位，再或上原最高位，即为非 0 的字节
+    return ~(((W & ~HIGHS) + ~HIGHS) | W) & HIGHS;
+}
+
+// 标记等于 C 的字节
+static uint64_t eqBytes(uint64_t W, char C)
+{
+    return zeroBytes(W ^ (ONES * (unsigned char)C));
+}
+
+// 标记属于区间 [Lo, Hi] 的字节，要求所有字节都小于 0x80
+static uint64_t rangeBytes(uint64_t W, char Lo, char Hi)
+{
+    return (W + ONES * (0x80 - Lo)) & ~(W + ONES * (0x7F - Hi)) & HIGHS;
+}
+
+// 标记不能作为标识符的非首字母部分的字节
+static uint64_t nonIdentBytes(uint64_t W)
 {
-    return strncmp(Str, SubStr, strlen(SubStr)) == 0; // 比较 Str 和 SubStr 的 N 个字符是否相等
+    // 非 ASCII 字节单独标记，其余字节去掉最高位后再按区间判断，避免字节间的进位
+    uint64_t High = W & HIGHS;
+    uint64_t X = W & ~HIGHS;
+    uint64_t Ident = rangeBytes(X, 'a', 'z') | rangeBytes(X, 'A', 'Z') |
+                     rangeBytes(X, '0', '9') | eqBytes(X, '_');
+    return (~Ident & HIGHS) | High;
 }
 
-static int isPunct(char *P)
+// 第一个被标记的字节在字中的下标，Mask 不能为 0
+static int firstByte(uint64_t Mask)
 {
-    // 多字节操作符列表
-    static char *Kw[] = {"==", "!=", "<=", ">=", "->"};
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_ctzll(Mask) >> 3;
+#else
+    return __builtin_clzll(Mask) >> 3;
+#endif
+}
 
-    for (int i = 0; i < sizeof(Kw) / sizeof(*Kw); ++i)
+// 跳过空格和制表符
+static char *skipBlanks(char *P, char *End)
+{
+    while (P + 8 <= End)
     {
-        if (startsWith(P, Kw[i]))
+        uint64_t W = loadWord(P);
+        uint64_t Stop = ~(eqBytes(W, ' ') | eqBytes(W, '\t')) & HIGHS;
+        if (Stop)
         {
-            return strlen(Kw[i]);
+            return P + firstByte(Stop);
         }
+        P += 8;
+    }
+    while (P < End && (*P == ' ' || *P == '\t'))
+    {
+        P++;
     }
+    return P;
+}
 
-    if ispunct (*P)
+// 跳过标识符的非首字母部分
+static char *skipIdentBody(char *P, char *End)
+{
+    while (P + 8 <= End)
+    {
+        uint64_t Stop = nonIdentBytes(loadWord(P));
+        if (Stop)
+        {
+            return P + firstByte(Stop);
+        }
+        P += 8;
+    }
+    while (P < End && isIdentBody(*P))
     {
-        return 1;
+        P++;
     }
-    return 0;
+    return P;
 }
 
-// 判断是否符号标识符首字母
-static bool isIdentHead(char c)
+// 查找第一个等于 C 的字符，不存在则返回 End（memchr 按向量扫描）
+static char *findChar(char *P, char *End, char C)
 {
-    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+    char *Q = memchr(P, C, End - P);
+    return Q ? Q : End;
 }
 
-// 判断是否符号标识符的非首字母部分
-static bool isIdentBody(char c)
+// 查找第一个等于 C1、C2 或 C3 的字符，不存在则返回 End
+static char *findChar3(char *P, char *End, char C1, char C2, char C3)
 {
-    return isIdentHead(c) || ('0' <= c && c <= '9');
+    while (P + 8 <= End)
+    {
+        uint64_t W = loadWord(P);
+        uint64_t Hit = eqBytes(W, C1) | eqBytes(W, C2) | eqBytes(W, C3);
+        if (Hit)
+        {
+            return P + firstByte(Hit);
+        }
+        P += 8;
+    }
+    while (P < End && *P != C1 && *P != C2 && *P != C3)
+    {
+        P++;
+    }
+    return P;
 }
 
-static bool isKeyword(Token *T)
+// 读取操作符，返回其长度，并通过 Id 返回其编号
+// 首字符决定状态，再由第二个字符决定是否构成多字符操作符
+static int readPunct(char *P, char *End, TokenId *Id)
 {
-    static char *keywordList[] = {"return", "if", "else", "for", "while", "int", "long", "short", "char", "struct", "union", "sizeof", "void", "typedef"};
+    char C = P + 1 < End ? P[1] : '\0';
 
-    for (int i = 0; i < sizeof(keywordList) / sizeof(*keywordList); i++)
+    switch (*P)
     {
-        if (equal(T, keywordList[i]))
+    case '=':
+        if (C == '=')
+        {
+            *Id = TID_EQ;
+            return 2;
+        }
+        break;
+    case '&':
+        if (C == '&')
+        {
+            *Id = TID_LOGAND;
+            return 2;
+        }
+        break;
+    case '|':
+        if (C == '|')
+        {
+            *Id = TID_LOGOR;
+            return 2;
+        }
+        break;
+    case '#':
+        if (C == '#')
+        {
+            *Id = TID_HASHHASH;
+            return 2;
+        }
+        break;
+    case '!':
+        if (C == '=')
+        {
+            *Id = TID_NE;
+            return 2;
+        }
+        break;
+    case '<':
+        if (C == '=')
         {
-            return true;
+            *Id = TID_LE;
+            return 2;
         }
+        if (C == '<')
+        {
+            *Id = TID_SHL;
+            return 2;
+        }
+        break;
+    case '>':
+        if (C == '=')
+        {
+            *Id = TID_GE;
+            return 2;
+        }
+        if (C == '>')
+        {
+            *Id = TID_SHR;
+            return 2;
+        }
+        break;
+    case '-':
+        if (C == '>')
+        {
+            *Id = TID_ARROW;
+            return 2;
+        }
+        break;
+    default:
+        break;
     }
-    return false;
+
+    *Id = (unsigned char)*P;
+    return 1;
+}
+
+// 关键字的完美哈希：Hash = (首字符 + 尾字符 * 5 + 长度) & 31
+// 常数通过穷举得到，所有关键字的哈希值互不相同，增加关键字时需要重新选取
+static int keywordHash(char *Start, int Len)
+{
+    return ((unsigned char)Start[0] + (unsigned char)Start[Len - 1] * 5 + Len) & 31;
+}
+
+// 以哈希值为下标的关键字表
+static TokenId KeywordTable[32] = {
+    [0] = KW_UNION,
+    [1] = KW_CHAR,
+    [2] = KW_ELSE,
+    [3] = KW_FOR,
+    [9] = KW_IF,
+    [14] = KW_VOID,
+    [16] = KW_INT,
+    [19] = KW_LONG,
+    [21] = KW_WHILE,
+    [23] = KW_SIZEOF,
+    [25] = KW_TYPEDEF,
+    [28] = KW_SHORT,
+    [29] = KW_STRUCT,
+    [30] = KW_RETURN,
+};
+
+// 如果标识符是关键字，返回关键字的编号，否则返回 TID_NONE
+static TokenId keywordId(char *Start, int Len)
+{
+    TokenId Id = KeywordTable[keywordHash(Start, Len)];
+    if (Id && !strncmp(TokenIdStr[Id], Start, Len) && TokenIdStr[Id][Len] == '\0')
+    {
+        return Id;
+    }
+    return TID_NONE;
 }
 
 // 返回一位十六进制的十进制（hexDigit = [0-9a-fA-F]）
@@ -235,31 +776,38 @@ static int readEscapedChar(char **NewPos, char *P)
     }
 }
 
-// 读取到字符串字面量尾部（'"'）
-static char *stringLiteralEnd(char *P)
+// 读取到字符串字面量尾部（'"'），普通字符按字跳过
+// 遇到换行符时返回 NULL，到达区间的末尾时返回 End
+static char *stringLiteralEnd(char *P, char *End)
 {
-    char *start = P;
-    while (*P != '"')
+    while (true)
     {
-        if (*P == '\n' || *P == '\0') // 遇到换行符和'\0'则报错
+        P = findChar3(P, End, '"', '\\', '\n');
+        if (P == End || *P == '"')
         {
-            errorAt(start, "unclosed string literal");
+            return P;
         }
-        else if (*P == '\\')
+        if (*P == '\n')
         {
-            P++;
+            return NULL;
+        }
+        // 跳过转义字符
+        P += 2;
+        if (P > End)
+        {
+            return End;
         }
-        P++;
     }
-    return P;
 }
 
-static Token *readStringLiteral(char *Start)
+// 解码 TK_STR 终结符的字符串字面量，并加入字符串字面量表，
+// Keep 为真时字符串字面量跨编译保留
+static void readStringLiteral(Token *Tok, bool Keep)
 {
-    // 读取到字符串字面量的右引号
-    char *End = stringLiteralEnd(Start + 1);
+    char *Start = Tok->Loc;
+    char *End = Tok->Loc + Tok->Len - 1;
     // 定义一个与字符串字面量内字符数 +1 的 Buf，用来存储最大位数的字符串字面量
-    char *Buf = calloc(1, End - Start);
+    char *Buf = arenaAlloc(Keep ? AK_PERM : AK_STR, End - Start);
     // 实际的字符位数，一个转义字符为 1 位
     int Len = 0;
 
@@ -276,185 +824,624 @@ static Token *readStringLiteral(char *Start)
         }
     }
 
-    // Token 这里需要包含带双引号的字符串字面量
-    Token *Tok = newToken(TK_STR, Start, End + 1);
-    Tok->type = arrayOf(TyChar, Len + 1); // 为\0增加一位
-    Tok->Str = Buf;
-    return Tok;
+    StrTable *T = Keep ? &KeptStrs : &Strs;
+    if (T->Cnt == T->Cap)
+    {
+        T->Cap = T->Cap ? T->Cap * 2 : 64;
+        T->Lits = realloc(T->Lits, sizeof(StrLiteral) * T->Cap);
+    }
+    T->Lits[T->Cnt] = (StrLiteral){Buf, Len + 1}; // 为\0增加一位
+    Tok->StrIdx = Keep ? ~T->Cnt : T->Cnt;
+    T->Cnt++;
 }
 
-// 将为关键字的 TK_IDENT 节点转换为 TK_KEYWORD 节点
-static void convertKeywords(Token *Tok)
+// 记录 [P, End) 中的所有换行符，返回其中是否有换行符
+static bool addLines(Lexer *L, char *P, char *End)
 {
-    for (Token *t = Tok; t; t = t->next)
+    bool Found = false;
+    while ((P = memchr(P, '\n', End - P)))
     {
-        if (equal(t, "return"))
-        {
-            t->kind = TK_KEYWORD;
-        }
+        addLine(L, ++P);
+        Found = true;
     }
+    return Found;
 }
 
-// 为所有 Token 添加行号
-static void addLineNumbers(Token *Tok)
+// 记录词法分析器遇到的错误，分析随即停止
+static void lexError(Lexer *L, char *Loc, char *Msg)
 {
-    char *P = Input;
-    int cnt = 1;
+    L->ErrLoc = Loc;
+    L->ErrMsg = Msg;
+}
+
+// 标识符的名称，分块分析时记录分块内的名称编号
+static void setName(Lexer *L, Token *Tok)
+{
+    if (!L->Deferred)
+    {
+        Tok->Name = intern(Tok->Loc, Tok->Len);
+        return;
+    }
 
-    do
+    int Idx = (intptr_t)hashmapGet2(&L->Names, Tok->Loc, Tok->Len) - 1;
+    if (Idx < 0)
     {
-        if (P == Tok->Loc)
-        {
-            Tok->lineNo = cnt;
-            Tok = Tok->next;
-        }
-        if (*P == '\n')
+        if (L->NameCnt == L->NameCap)
         {
-            cnt++;
+            L->NameCap = L->NameCap ? L->NameCap * 2 : 1024;
+            L->NameToks = realloc(L->NameToks, sizeof(int) * L->NameCap);
         }
-    } while (*P++);
+        Idx = L->NameCnt++;
+        L->NameToks[Idx] = Tok - L->Toks;
+        hashmapPut2(&L->Names, Tok->Loc, Tok->Len, (void *)(intptr_t)(Idx + 1));
+    }
+    Tok->StrIdx = Idx;
 }
 
 // 终结符解析
-Token *tokenize(char *Filename, char *P)
+// 根据首字符的类别分派，空白、标识符、注释和字符串的内容按字扫描。
+// 区间不是输入的末尾时，越过区间末尾的注释或字符串字面量记录在 Spill 中，
+// 由拼接时从其开头继续分析
+static void lex(Lexer *L)
 {
-    CurrentFilename = Filename;
-    Input = P;
-    Token Head = {}; // 空头指针，避免处理边界问题
-    Token *Cur = &Head;
+    char *P = L->Start;
+    char *End = L->End;
 
-    while (*P)
+    while (P < End)
     {
-
-        if (startsWith(P, "//")) // 跳过行注释
+        switch (charClass(*P))
         {
-            P += 2;
-            while (*P != '\n')
+        case CC_SPACE: // 跳过不可视的空白字符，遇到换行符时记录新的一行
+            L->HasSpace = true;
+            if (*P == '\n')
             {
-                P++;
+                addLine(L, P + 1);
+                L->AtBOL = true;
             }
+            P = skipBlanks(P + 1, End);
             continue;
-        }
-        if (startsWith(P, "/*")) // 跳过块注释
+
+        case CC_DIGIT: // 解析数字
         {
-            // 查找第一个"*/"的位置
-            char *Q = strstr(P + 2, "*/");
-            if (!Q)
+            char *start = P;
+            uint64_t Val = 0;
+            while (P < End && charClass(*P) == CC_DIGIT)
             {
-                errorAt(P, "unclosed block comment");
+                Val = Val * 10 + (*P++ - '0');
             }
-            P = Q + 2;
+            const int num = Val;
+
+            newToken(L, TK_NUM, start, P)->Val = num;
             continue;
         }
 
-        if (isspace(*P)) // 跳过不可视的空白字符
+        case CC_QUOTE: // 解析字符串字面量，内容在拼接时解码
         {
-            ++P;
+            char *Q = stringLiteralEnd(P + 1, End);
+            if (Q == End && End < L->F->End)
+            {
+                L->Spill = P;
+                return;
+            }
+            if (!Q || Q == End) // 遇到换行符和输入的末尾则报错
+            {
+                lexError(L, P + 1, "unclosed string literal");
+                return;
+            }
+            // Token 这里需要包含带双引号的字符串字面量
+            newToken(L, TK_STR, P, Q + 1);
+            P = Q + 1;
             continue;
         }
 
-        if (isdigit(*P))
+        case CC_IDENT: // 解析标记符或关键字
         {
             char *start = P;
-            const int num = strtoul(P, &P, 10);
-
-            Cur->next = newToken(TK_NUM, start, P);
-            Cur = Cur->next;
-            Cur->Val = num;
+            P = skipIdentBody(P + 1, End);
+            // 关键字在此直接确定编号，标识符则驻留其名称
+            TokenId Id = keywordId(start, P - start);
+            if (Id)
+            {
+                newToken(L, TK_KEYWORD, start, P)->Id = Id;
+                continue;
+            }
+            setName(L, newToken(L, TK_IDENT, start, P));
             continue;
         }
 
-        if (*P == '"') // 解析字符串字面量
+        case CC_SLASH:
+            if (P + 1 < End && P[1] == '/') // 跳过行注释
+            {
+                L->HasSpace = true;
+                P = findChar(P + 2, End, '\n');
+                continue;
+            }
+            if (P + 1 < End && P[1] == '*') // 跳过块注释
+            {
+                // 查找第一个"*/"的位置
+                char *Q = P + 2;
+                while (true)
+                {
+                    Q = findChar(Q, End, '*');
+                    if (Q + 1 >= End)
+                    {
+                        if (End < L->F->End)
+                        {
+                            L->Spill = P;
+                            return;
+                        }
+                        lexError(L, P, "unclosed block comment");
+                        return;
+                    }
+                    if (Q[1] == '/')
+                    {
+                        break;
+                    }
+                    Q++;
+                }
+                // 记录注释中的换行符，跨行的注释之后的终结符也位于行首
+                if (addLines(L, P + 2, Q))
+                {
+                    L->AtBOL = true;
+                }
+                L->HasSpace = true;
+                P = Q + 2;
+                continue;
+            }
+            // 不是注释，作为操作符处理
+            // fallthrough
+        case CC_PUNCT: // 解析操作符
         {
-            Cur->next = readStringLiteral(P);
-            Cur = Cur->next;
-            P += Cur->Len;
+            // 反斜杠加换行符将两行连接为一行
+            if (*P == '\\' && P + 1 < End && P[1] == '\n')
+            {
+                addLine(L, P + 2);
+                P += 2;
+                continue;
+            }
+            TokenId Id;
+            int length = readPunct(P, End, &Id);
+            newToken(L, TK_PUNCT, P, P + length)->Id = Id;
+            P += length;
             continue;
         }
 
-        if (isIdentHead(*P)) // 解析标记符或关键字
+        default:
+            lexError(L, P, "invalid token");
+            return;
+        }
+    }
+}
+
+// 将分块的分析结果合并到全局的表中：行首偏移量、驻留的名称和字符串字面量，
+// 然后报告分块中的错误。分块必须按顺序合并，错误才会按在输入中出现的顺序报告
+static void mergeLexer(Lexer *L)
+{
+    File *F = L->F;
+    if (F->LineCnt + L->LineCnt > F->LineCap)
+    {
+        while (F->LineCnt + L->LineCnt > F->LineCap)
+        {
+            F->LineCap *= 2;
+        }
+        F->LineStarts = realloc(F->LineStarts, sizeof(uint32_t) * F->LineCap);
+    }
+    memcpy(F->LineStarts + F->LineCnt, L->Lines, sizeof(uint32_t) * L->LineCnt);
+    F->LineCnt += L->LineCnt;
+
+    // 驻留分块内的各个名称
+    char **Names = malloc(sizeof(char *) * L->NameCnt);
+    for (int I = 0; I < L->NameCnt; I++)
+    {
+        Token *Tok = &L->Toks[L->NameToks[I]];
+        Names[I] = intern(Tok->Loc, Tok->Len);
+    }
+
+    for (Token *Tok = L->Toks, *End = L->Toks + L->TokCnt; Tok < End; Tok++)
+    {
+        if (Tok->kind == TK_STR)
         {
-            char *start = P;
-            do
+            readStringLiteral(Tok, F->Keep);
+        }
+        else if (Tok->kind == TK_IDENT && L->Deferred)
+        {
+            Tok->Name = Names[Tok->StrIdx];
+        }
+    }
+    free(Names);
+
+    if (L->ErrLoc)
+    {
+        errorAt(L->ErrLoc, "%s", L->ErrMsg);
+    }
+}
+
+// 释放词法分析器的私有内存，保留分析的区间
+static void freeLexer(Lexer *L)
+{
+    free(L->Toks);
+    free(L->Lines);
+    free(L->NameToks);
+    hashmapFree(&L->Names);
+    *L = (Lexer){.F = L->F, .Start = L->Start, .End = L->End, .AtBOL = L->AtBOL, .HasSpace = L->HasSpace};
+}
+
+// 并行词法分析时，所有线程共享的任务列表
+typedef struct
+{
+    Lexer *Ls;       // 各个分块的词法分析器，按输入的顺序排列
+    int Cnt;         // 分块的数量
+    atomic_int Next; // 下一个未被领取的分块
+} LexJobs;
+
+// 工作线程不断领取下一个分块进行分析
+static void *lexWorker(void *Arg)
+{
+    LexJobs *J = Arg;
+    for (int I; (I = atomic_fetch_add(&J->Next, 1)) < J->Cnt;)
+    {
+        lex(&J->Ls[I]);
+    }
+    return NULL;
+}
+
+// 并行词法分析的最小分块大小，更小的输入直接串行分析
+#define LEX_CHUNK_MIN (1 << 20)
+
+// 将输入按行切分为若干分块，每个线程约分到两块以平衡负载，返回分块的数量
+static int splitChunks(File *F, Lexer *Ls, int MaxCnt, int Jobs)
+{
+    char *Input = F->Contents;
+    char *InputEnd = F->End;
+    size_t Len = InputEnd - Input;
+    size_t Size = Len / ((size_t)Jobs * 2);
+    if (Size < LEX_CHUNK_MIN)
+    {
+        Size = LEX_CHUNK_MIN;
+    }
+
+    int Cnt = 0;
+    char *P = Input;
+    while (P < InputEnd && Cnt < MaxCnt - 1 && (size_t)(InputEnd - P) > Size)
+    {
+        // 分块在换行符之后结束，这样只有块注释和字符串字面量可能跨越分块，
+        // 以反斜杠续行的行不能切分，否则下一个分块的开头会被误认为行首
+        char *End = memchr(P + Size, '\n', InputEnd - (P + Size));
+        while (End && End[-1] == '\\')
+        {
+            End = memchr(End + 1, '\n', InputEnd - (End + 1));
+        }
+        if (!End)
+        {
+            break;
+        }
+        // 分块之前是换行符，推测其开头的终结符位于行首
+        Ls[Cnt++] = (Lexer){.F = F, .Start = P, .End = End + 1, .AtBOL = true, .HasSpace = P > Input};
+        P = End + 1;
+    }
+    if (P < InputEnd || Cnt == 0)
+    {
+        Ls[Cnt++] = (Lexer){.F = F, .Start = P, .End = InputEnd, .AtBOL = true, .HasSpace = P > Input};
+    }
+    return Cnt;
+}
+
+// 终结符解析
+// Jobs 大于 1 且输入足够大时，按行切分为若干分块并行分析，再按顺序拼接。
+// 分块的开头只是推测的分析起点：前一个分块末尾的注释或字符串字面量跨越了边界时，
+// 拼接时从其开头重新分析该分块，结果与串行分析完全相同
+static Token *tokenize(File *F, int Jobs)
+{
+    char *Input = F->Contents;
+    // 各分块的终结符先写入各自按需扩大的数组，拼接时再复制到内存池中大小恰好的数组
+    // 每个线程约分到两块，但分块的数量不会超过输入按最小分块大小切分的块数
+    size_t MaxCnt = Jobs > 1 ? (size_t)Jobs * 2 : 1;
+    size_t MaxChunks = (F->End - Input) / LEX_CHUNK_MIN + 1;
+    if (MaxCnt > MaxChunks)
+    {
+        MaxCnt = MaxChunks;
+    }
+    Lexer Ls[MaxCnt];
+    int Cnt = splitChunks(F, Ls, MaxCnt, Jobs > 1 ? Jobs : 1);
+
+    if (Cnt > 1)
+    {
+        LexJobs J = {.Ls = Ls, .Cnt = Cnt};
+        for (int I = 0; I < Cnt; I++)
+        {
+            Ls[I].Deferred = true;
+        }
+
+        // 当前线程也作为工作线程之一
+        int NThreads = Jobs < Cnt ? Jobs : Cnt;
+        pthread_t Threads[NThreads];
+        for (int T = 1; T < NThreads; T++)
+        {
+            if (pthread_create(&Threads[T], NULL, lexWorker, &J))
             {
-                ++P;
-            } while (isIdentBody(*P));
-            Cur->next = newToken(TK_IDENT, start, P);
-            Cur = Cur->next;
-            continue;
+                error("cannot create thread: %s", strerror(errno));
+            }
         }
+        lexWorker(&J);
+        for (int T = 1; T < NThreads; T++)
+        {
+            pthread_join(Threads[T], NULL);
+        }
+    }
 
-        int length = isPunct(P);
-        if (length) // 是标点符号
+    // 按顺序拼接各分块，Pos 为前一个分块实际结束分析的位置，
+    // AtBOL 和 HasSpace 为该位置的状态
+    int TokCnt = 0;
+    char *Pos = Input;
+    bool AtBOL = true, HasSpace = false;
+    for (int I = 0; I < Cnt; I++)
+    {
+        Lexer *L = &Ls[I];
+        if (Cnt == 1 || L->Start != Pos)
         {
-            Cur->next = newToken(TK_PUNCT, P, P + length);
-            Cur = Cur->next;
-            P += length;
-            continue;
+            // 串行分析，或分块的开头位于前一个分块的注释或字符串字面量中，
+            // 从实际的位置（重新）分析到分块的末尾
+            freeLexer(L);
+            L->Start = Pos;
+            L->AtBOL = AtBOL;
+            L->HasSpace = HasSpace;
+            lex(L);
+        }
+
+        mergeLexer(L);
+        TokCnt += L->TokCnt;
+        Pos = L->Spill ? L->Spill : L->End;
+        AtBOL = L->AtBOL;
+        HasSpace = L->HasSpace;
+    }
+
+    ArenaKind Kind = F->Keep ? AK_HEADER : AK_TOKEN;
+    Token *Toks = arenaAlloc(Kind, sizeof(Token) * (TokCnt + 1));
+    TokCnt = 0;
+    for (int I = 0; I < Cnt; I++)
+    {
+        memcpy(Toks + TokCnt, Ls[I].Toks, sizeof(Token) * Ls[I].TokCnt);
+        TokCnt += Ls[I].TokCnt;
+        freeLexer(&Ls[I]);
+    }
+
+    Toks[TokCnt] = (Token){.kind = TK_EOF, .Loc = F->End, .AtBOL = true}; // 添加终止节点
+    return Toks;
+}
+
+// 记录本次编译读入的内容或分配的缓冲区
+static void addBuffer(char *Buf, size_t Len, bool Mapped)
+{
+    if (BufferCnt == BufferCap)
+    {
+        BufferCap = BufferCap ? BufferCap * 2 : 16;
+        Buffers = realloc(Buffers, sizeof(Buffer) * BufferCap);
+    }
+    Buffers[BufferCnt++] = (Buffer){Buf, Len, Mapped};
+}
+
+// 宏的拼接和字符串化产生的文本存放在临时文件中，每段文本单独占一行，
+// 使这些终结符也能像普通的终结符一样报告错误的位置
+#define SCRATCH_SIZE (64 * 1024)
+static _Thread_local File *Scratch;
+static _Thread_local size_t ScratchCap;
+
+// 将一段文本分析为一个终结符，不能构成一个终结符时返回 false
+bool tokenizeOne(char *S, int Len, Token *Tok)
+{
+    if (!Scratch || (Scratch->End - Scratch->Contents) + Len + 1 > ScratchCap)
+    {
+        ScratchCap = Len + 1 > SCRATCH_SIZE ? Len + 1 : SCRATCH_SIZE;
+        Scratch = newFile("<scratch space>", malloc(ScratchCap), 0, false);
+        addBuffer(Scratch->Contents, ScratchCap, false);
+    }
+    else
+    {
+        // 开始新的一行
+        if (Scratch->LineCnt == Scratch->LineCap)
+        {
+            Scratch->LineCap *= 2;
+            Scratch->LineStarts = realloc(Scratch->LineStarts, sizeof(uint32_t) * Scratch->LineCap);
         }
-        errorAt(P, "invalid token");
+        Scratch->LineStarts[Scratch->LineCnt++] = Scratch->End - Scratch->Contents;
     }
 
-    Cur->next = newToken(TK_EOF, P, P); // 添加终止节点
+    char *P = Scratch->End;
+    memcpy(P, S, Len);
+    P[Len] = '\n';
+    Scratch->End = P + Len + 1;
 
-    addLineNumbers(Head.next); // 为所有 Token 添加行号
+    Lexer L = {.F = Scratch, .Start = P, .End = P + Len};
+    lex(&L);
+    bool Ok = !L.ErrLoc && !L.Spill && L.TokCnt == 1;
+    if (Ok)
+    {
+        *Tok = L.Toks[0];
+    }
+    freeLexer(&L);
+    if (!Ok)
+    {
+        return false;
+    }
 
-    convertKeywords(Head.next);
-    return Head.next;
+    if (Tok->kind == TK_STR)
+    {
+        readStringLiteral(Tok, false);
+    }
+    return true;
 }
 
-// 读取指定文件
-static char *readFile(char *Path)
+// 读取管道等无法映射的输入，按 SizeHint 预先分配缓冲区，不够时再成倍扩大
+static char *readAll(int FD, size_t SizeHint, size_t *Len)
 {
-    FILE *FP;
+    size_t Cap = SizeHint > 0 ? SizeHint : 64 * 1024;
+    char *Buf = malloc(Cap);
+    size_t N = 0;
+
+    while (true)
+    {
+        if (N == Cap)
+        {
+            Cap *= 2;
+            Buf = realloc(Buf, Cap);
+        }
+
+        ssize_t R = read(FD, Buf + N, Cap - N);
+        if (R == 0)
+        {
+            break;
+        }
+        if (R < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error("cannot read input: %s", strerror(errno));
+        }
+        N += R;
+    }
+
+    *Len = N;
+    return Buf;
+}
+
+// 读取指定文件，通过 Len 返回文件的长度，Mapped 返回内容是否为映射的文件
+// 普通文件以只读方式映射到内存中，词法分析直接在映射的内存上进行，不需要复制，
+// 也不需要在末尾追加 '\0'
+static char *loadFile(char *Path, size_t *Len, bool *Mapped)
+{
+    int FD;
     if (strcmp(Path, "-") == 0)
     {
         // 如果文件名是"-"，那么就从输入中读取
-        FP = stdin;
+        FD = STDIN_FILENO;
     }
     else
     {
-        FP = fopen(Path, "r");
-        if (!FP)
+        FD = open(Path, O_RDONLY);
+        if (FD < 0)
             // strerror 以字符串的形式输出错误代码，errno 为系统最后一次的错误代码
             error("cannot open %s: %s", Path, strerror(errno));
     }
 
-    // 要返回的字符串
-    char *Buf;
-    size_t BufLen;
-    FILE *Out = open_memstream(&Buf, &BufLen);
+    struct stat St;
+    if (fstat(FD, &St) < 0)
+    {
+        error("cannot stat %s: %s", Path, strerror(errno));
+    }
 
-    while (true)
+    char *Buf;
+    *Mapped = S_ISREG(St.st_mode);
+    if (*Mapped)
     {
-        char Buf2[4096];
-        // fread 从文件流中读取数据到数组中
-        int N = fread(Buf2, 1, sizeof(Buf2), FP);
-        if (N == 0)
-            break;
-        fwrite(Buf2, 1, N, Out);
+        *Len = St.st_size;
+        if (*Len == 0)
+        {
+            // 空文件无法映射
+            Buf = "";
+        }
+        else
+        {
+            Buf = mmap(NULL, *Len, PROT_READ, MAP_PRIVATE, FD, 0);
+            if (Buf == MAP_FAILED)
+            {
+                error("cannot map %s: %s", Path, strerror(errno));
+            }
+        }
+    }
+    else
+    {
+        // 管道或终端，读取到缓冲区中
+        Buf = readAll(FD, St.st_size, Len);
     }
 
-    // 如果来源是文件，关闭它
-    if (FP != stdin)
+    // 如果来源是文件，关闭它（映射在关闭后仍然有效）
+    if (FD != STDIN_FILENO)
     {
-        fclose(FP);
+        close(FD);
     }
 
-    // 刷新流的输出缓冲区，确保内容都被输出到流中
-    fflush(Out);
-    // 确保最后一行以'\n'结尾
-    if (BufLen == 0 || Buf[BufLen - 1] != '\n')
-        // 将字符输出到流中
-        fputc('\n', Out);
-    fputc('\0', Out);
-    fclose(Out);
+    return Buf;
+}
 
+// 读取指定文件，内容在本次编译结束前有效
+char *readFile(char *Path, size_t *Len)
+{
+    bool Mapped;
+    char *Buf = loadFile(Path, Len, &Mapped);
+    addBuffer(Buf, *Len, Mapped);
     return Buf;
 }
 
-// 对文件进行词法分析
-Token *tokenizeFile(char *Path)
+// 对内存中的文本进行词法分析，文本作为没有编号的输入文件，不输出行号信息
+Token *tokenizeText(char *Name, char *Buf, size_t Len)
 {
-    return tokenize(Path, readFile(Path));
+    return tokenize(newFile(Name, Buf, Len, false), 1);
+}
+
+// 对已读入的文件内容进行词法分析，Jobs 大于 1 时并行分析较大的文件
+Token *tokenizeBuffer(char *Path, char *Buf, size_t Len, int Jobs)
+{
+    File *F = newFile(Path, Buf, Len, false);
+    numberFile(F);
+    return tokenize(F, Jobs);
+}
+
+// 对被包含的头文件进行词法分析，头文件的内容和终结符跨编译保留，
+// 文件编号在每次编译第一次包含它时分配
+Token *tokenizeFile(char *Path, int Jobs, File **F)
+{
+    size_t Len;
+    bool Mapped;
+    char *Buf = loadFile(Path, &Len, &Mapped);
+    *F = newFile(Path, Buf, Len, true);
+    return tokenize(*F, Jobs);
+}
+
+// 丢弃本次编译的输入文件、字符串字面量和读入的内容，
+// 头文件保留在文件列表中，但不再有编号
+void tokenizeReset(void)
+{
+    int Cnt = 0;
+    for (int I = 0; I < FileCnt; I++)
+    {
+        File *F = Files[I];
+        if (F->Keep)
+        {
+            F->FileNo = 0;
+            Files[Cnt++] = F;
+            continue;
+        }
+        free(F->LineStarts);
+        free(F);
+    }
+    FileCnt = Cnt;
+    if (Files)
+    {
+        Files[FileCnt] = NULL;
+    }
+    InputFileCnt = 0;
+    if (InputFiles)
+    {
+        InputFiles[0] = NULL;
+    }
+    NextFileNo = 1;
+    Strs.Cnt = 0;
+    Scratch = NULL;
+    LastFile = LastLineFile = NULL;
+
+    for (int I = 0; I < BufferCnt; I++)
+    {
+        Buffer *B = &Buffers[I];
+        if (!B->Mapped)
+        {
+            free(B->Buf);
+        }
+        else if (B->Len)
+        {
+            munmap(B->Buf, B->Len);
+        }
+    }
+    BufferCnt = 0;
 }
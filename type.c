@@ -1,19 +1,81 @@
 #include "rvcc.h"
 
 // (Type){...}构造了一个复合字面量，相当于 Type 的匿名变量
+// 内置类型创建后不再修改，由所有编译线程共享
 Type *TyVoid = &(Type){TY_VOID, 1, 1};
 Type *TyChar = &(Type){TY_CHAR, 1, 1};
 Type *TyShort = &(Type){TY_SHORT, 2, 2};
 Type *TyInt = &(Type){TY_INT, 4, 4};
 Type *TyLong = &(Type){TY_LONG, 8, 8};
 
-static Type *newType(TypeKind kind, int size, int align)
+// 派生类型的规范化表，键为类型的结构（种类、基类、数组长度和形参类型）
+static _Thread_local HashMap TypeMap;
+
+// 返回与 Ty 结构相同的规范化类型，不存在时以 Ty 为模板创建
+static Type *internType(Type *Ty)
 {
-    Type *type = calloc(1, sizeof(Type));
-    type->kind = kind;
-    type->size = size;
-    type->align = align;
-    return type;
+    int N = 3 + Ty->ParamCnt;
+    uintptr_t Key[N];
+    Key[0] = Ty->kind;
+    Key[1] = (uintptr_t)(Ty->kind == TY_FUNC ? Ty->ReturnTy : Ty->base);
+    Key[2] = Ty->ArrayLen;
+    memcpy(Key + 3, Ty->Params, sizeof(Type *) * Ty->ParamCnt);
+
+    Type *Canon = hashmapGet2(&TypeMap, (char *)Key, sizeof(Key));
+    if (Canon)
+    {
+        return Canon;
+    }
+
+    Canon = arenaAlloc(AK_TYPE, sizeof(Type));
+    *Canon = *Ty;
+    if (Ty->ParamCnt)
+    {
+        Canon->Params = arenaAlloc(AK_TYPE, sizeof(Type *) * Ty->ParamCnt);
+        memcpy(Canon->Params, Ty->Params, sizeof(Type *) * Ty->ParamCnt);
+    }
+    // 键需要在哈希表的生命周期内有效
+    char *Stored = arenaAlloc(AK_TYPE, sizeof(Key));
+    memcpy(Stored, Key, sizeof(Key));
+    hashmapPut2(&TypeMap, Stored, sizeof(Key), Canon);
+    return Canon;
+}
+
+// 结构体成员数达到该值时，为其建立按名称查找的哈希表
+#define MEMBER_MAP_THRESHOLD 8
+
+// 已建立的成员哈希表，哈希表本身在类型的内存池中，桶则需要在重置时释放
+static _Thread_local HashMap **MemMaps;
+static _Thread_local int MemMapCnt;
+static _Thread_local int MemMapCap;
+
+// 成员较多时建立哈希表，同名成员以第一个为准
+void indexMembers(Type *Ty)
+{
+    int Cnt = 0;
+    for (Member *Mem = Ty->Mems; Mem; Mem = Mem->next)
+    {
+        Cnt++;
+    }
+    if (Cnt < MEMBER_MAP_THRESHOLD)
+    {
+        return;
+    }
+
+    Ty->MemMap = arenaAlloc(AK_TYPE, sizeof(HashMap));
+    if (MemMapCnt == MemMapCap)
+    {
+        MemMapCap = MemMapCap ? MemMapCap * 2 : 64;
+        MemMaps = realloc(MemMaps, sizeof(HashMap *) * MemMapCap);
+    }
+    MemMaps[MemMapCnt++] = Ty->MemMap;
+    for (Member *Mem = Ty->Mems; Mem; Mem = Mem->next)
+    {
+        if (!hashmapGetPtr(Ty->MemMap, Mem->name->Name))
+        {
+            hashmapPutPtr(Ty->MemMap, Mem->name->Name, Mem);
+        }
+    }
 }
 
 bool isInteger(Type *Ty)
@@ -25,35 +87,23 @@ bool isInteger(Type *Ty)
 // 创建一个基类为 base 的指针类型
 Type *pointerTo(Type *base)
 {
-    Type *ptr = newType(TY_PTR, 8, 8);
-    ptr->base = base;
-    return ptr;
+    return internType(&(Type){.kind = TY_PTR, .size = 8, .align = 8, .base = base});
 }
 
-// 创建一个返回类型为 ReturnTy 的函数类型
-Type *funcType(Type *ReturnTy)
+// 创建一个返回类型为 ReturnTy，形参类型为 Params 的函数类型
+Type *funcType(Type *ReturnTy, Type **Params, int ParamCnt)
 {
-    Type *Ty = calloc(1, sizeof(Type));
-    Ty->kind = TY_FUNC;
-    Ty->ReturnTy = ReturnTy;
-    return Ty;
+    return internType(&(Type){.kind = TY_FUNC, .ReturnTy = ReturnTy, .Params = Params, .ParamCnt = ParamCnt});
 }
 
 // 创建一个数组类型
 Type *arrayOf(Type *Base, int Len)
 {
-    Type *Ty = newType(TY_ARRAY, Base->size * Len, Base->align);
-    Ty->base = Base;
-    Ty->ArrayLen = Len;
-    return Ty;
-}
-
-// 复制类型
-Type *copyType(Type *Ty)
-{
-    Type *Ret = calloc(1, sizeof(Type));
-    *Ret = *Ty;
-    return Ret;
+    return internType(&(Type){.kind = TY_ARRAY,
+                              .size = Base->size * Len,
+                              .align = Base->align,
+                              .base = Base,
+                              .ArrayLen = Len});
 }
 
 // 获取容纳左右部的类型
@@ -87,23 +137,57 @@ void addType(Node *node)
         return;
     }
 
-    // 递归访问所有节点以增加类型
-    addType(node->LHS);
-    addType(node->RHS);
-    addType(node->Cond);
-    addType(node->Then);
-    addType(node->Else);
-    addType(node->Init);
-    addType(node->Inc);
-    // 访问链表内的所有节点以增加类型
-    for (Node *N = node->Body; N; N = N->next)
-    {
-        addType(N);
-    }
-    // 访问链表内的所有参数节点以增加类型
-    for (Node *N = node->Args; N; N = N->next)
+    // 按节点种类递归访问其子节点以增加类型
+    switch (node->kind)
     {
-        addType(N);
+    case ND_NUM:
+    case ND_VAR:
+        break;
+    case ND_IF:
+    case ND_FOR:
+        addType(node->Cond);
+        addType(node->Then);
+        // if 语句没有 Init 和 Inc
+        if (node->kind == ND_FOR)
+        {
+            addType(node->Init);
+            addType(node->Inc);
+        }
+        else
+        {
+            addType(node->Else);
+        }
+        break;
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        // 访问链表内的所有节点以增加类型
+        for (Node *N = node->Body; N; N = N->next)
+        {
+            addType(N);
+        }
+        break;
+    case ND_FUNCALL:
+        // 访问链表内的所有参数节点以增加类型
+        for (Node *N = node->Args; N; N = N->next)
+        {
+            addType(N);
+        }
+        break;
+    case ND_MEMBER:
+        addType(node->LHS);
+        break;
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+    case ND_CAST:
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+        addType(node->LHS);
+        break;
+    default: // 二元运算
+        addType(node->LHS);
+        addType(node->RHS);
+        break;
     }
 
     switch (node->kind)
@@ -207,4 +291,14 @@ void addType(Node *node)
     default:
         break;
     }
-}
\ No newline at end of file
+}
+// 清除规范化的派生类型和成员哈希表，它们随类型的内存池一起释放，内置的基本类型不受影响
+void typeReset(void)
+{
+    hashmapFree(&TypeMap);
+    for (int I = 0; I < MemMapCnt; I++)
+    {
+        hashmapFree(MemMaps[I]);
+    }
+    MemMapCnt = 0;
+}